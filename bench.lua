@@ -0,0 +1,614 @@
+-- benchmarks for lpath, run as: lua bench.lua [name ...]
+local path = require "path"
+local fs   = require "path.fs"
+local info = require "path.info"
+
+-- prefer wall clock time, os.clock() counts CPU time of all threads
+local has_socket, socket = pcall(require, "socket")
+local clock = has_socket and socket.gettime or os.clock
+local benches = {}
+
+local function bench(name, f)
+   benches[#benches+1] = { name = name, f = f }
+end
+
+local function report(title, count, elapsed, unit)
+   print(("  %-36s %10d %s in %7.3fs, %12.0f %s/s"):format(
+      title, count, unit or "entries", elapsed,
+      count / math.max(elapsed, 1e-9), unit or "entries"))
+end
+
+local function timeit(title, f, unit)
+   collectgarbage "collect"
+   local start = clock()
+   local count = f()
+   report(title, count, clock() - start, unit)
+   return count
+end
+
+local function maketree(root, width, depth, files)
+   assert(fs.makedirs(root))
+   for i = 1, files do
+      assert(fs.touch(path(root, ("file_%06d.txt"):format(i))))
+   end
+   if depth > 0 then
+      for i = 1, width do
+         maketree(path(root, ("dir_%03d"):format(i)), width, depth-1, files)
+      end
+   end
+end
+
+local function count(...)
+   local n = 0
+   for _ in ... do n = n + 1 end
+   return n
+end
+
+local function with_tmpdir(f)
+   local cwd = fs.getcwd()
+   local tmp = assert(fs.tmpdir "lpath_bench_")
+   assert(fs.chdir(tmp))
+   local ok, err = pcall(f)
+   assert(fs.chdir(cwd))
+   assert(fs.removedirs(tmp))
+   if not ok then error(err, 0) end
+end
+
+bench("bufsize", function()
+   -- compare read buffer sizes of the walker; on Linux run this under
+   -- `strace -c -e trace=getdents64` to see the syscall counts.
+   with_tmpdir(function()
+      maketree("wide", 0, 0, 20000)
+      maketree("deep", 4, 4, 50)
+      for _, size in ipairs { 4096, 32768, 0, 1024*1024 } do
+         local title = size == 0 and "default" or tostring(size)
+         timeit("wide, bufsize=" .. title, function()
+            local n = 0
+            for _ = 1, 10 do n = n + count(fs.scandir("wide", {bufsize=size})) end
+            return n
+         end)
+         timeit("deep, bufsize=" .. title, function()
+            local n = 0
+            for _ = 1, 10 do n = n + count(fs.scandir("deep", {bufsize=size})) end
+            return n
+         end)
+      end
+   end)
+end)
+
+bench("pscandir", function()
+   with_tmpdir(function()
+      maketree("tree", 6, 4, 20)
+      timeit("scandir", function() return count(fs.scandir "tree") end)
+      for _, threads in ipairs { 1, 2, 4, 8 } do
+         timeit("pscandir, threads=" .. threads, function()
+            return count(fs.pscandir("tree", { threads = threads }))
+         end)
+         timeit("pscandir, grouped, threads=" .. threads, function()
+            return count(fs.pscandir("tree", { threads = threads, grouped = true }))
+         end)
+      end
+   end)
+end)
+
+bench("batch", function()
+   with_tmpdir(function()
+      maketree("tree", 4, 4, 20)
+      timeit("scandir", function()
+         local n = 0
+         for _ = 1, 10 do n = n + count(fs.scandir "tree") end
+         return n
+      end)
+      for _, batch in ipairs { 16, 128, 512, 4096 } do
+         timeit("scandir, batch=" .. batch, function()
+            local n = 0
+            for _ = 1, 10 do
+               for _, _, c in fs.scandir("tree", { batch = batch }) do
+                  n = n + c
+               end
+            end
+            return n
+         end)
+      end
+   end)
+end)
+
+bench("entry", function()
+   with_tmpdir(function()
+      maketree("tree", 4, 4, 20)
+      timeit("scandir + fs.size", function()
+         local n = 0
+         for fn, ty in fs.scandir "tree" do
+            if ty == "file" then assert(fs.size(fn)) end
+            n = n + 1
+         end
+         return n
+      end)
+      timeit("scandir, entry=true + e:size()", function()
+         local n = 0
+         for e, ty in fs.scandir("tree", { entry = true }) do
+            if ty == "file" then assert(e:size()) end
+            n = n + 1
+         end
+         return n
+      end)
+   end)
+end)
+
+bench("sorted", function()
+   with_tmpdir(function()
+      maketree("tree", 4, 4, 20)
+      timeit("scandir + table.sort", function()
+         local t = {}
+         for fn in fs.scandir "tree" do t[#t+1] = fn end
+         table.sort(t)
+         return #t
+      end)
+      timeit("scandir, sorted=true", function()
+         return count(fs.scandir("tree", { sorted = true }))
+      end)
+      timeit("scandir, sorted=natural", function()
+         return count(fs.scandir("tree", { sorted = "natural" }))
+      end)
+   end)
+end)
+
+bench("prune", function()
+   with_tmpdir(function()
+      maketree("tree", 2, 1, 20)
+      maketree("tree/node_modules", 6, 3, 20)
+      timeit("scandir + filter in Lua", function()
+         local n = 0
+         for fn in fs.scandir "tree" do
+            if not fn:find("node_modules", 1, true) then n = n + 1 end
+         end
+         return n
+      end)
+      timeit("scandir, exclude", function()
+         return count(fs.scandir("tree", { exclude = "node_modules" }))
+      end)
+      timeit("scandir, ignore", function()
+         return count(fs.scandir("tree", { ignore = "node_modules/" }))
+      end)
+   end)
+end)
+
+bench("stats", function()
+   -- the gain grows with the latency of the file system, e.g. NFS
+   with_tmpdir(function()
+      maketree("tree", 4, 3, 50)
+      local list = {}
+      for fn, ty in fs.scandir "tree" do
+         if ty ~= "out" then list[#list+1] = fn end
+      end
+      timeit("fs.size one by one", function()
+         for _, fn in ipairs(list) do fs.size(fn) end
+         return #list
+      end)
+      timeit("fs.stats, uring=false", function()
+         return #fs.stats(list, { uring = false })
+      end)
+      for _, depth in ipairs { 8, 32, 256 } do
+         timeit("fs.stats, depth=" .. depth, function()
+            return #fs.stats(list, { depth = depth })
+         end)
+      end
+   end)
+end)
+
+bench("du", function()
+   with_tmpdir(function()
+      maketree("tree", 6, 3, 20)
+      timeit("scandir + fs.size", function()
+         local n, bytes = 0, 0
+         for fn, ty in fs.scandir "tree" do
+            if ty ~= "out" then bytes = bytes + fs.size(fn); n = n + 1 end
+         end
+         return n
+      end)
+      for _, threads in ipairs { 1, 2, 4, 8 } do
+         timeit("du, threads=" .. threads, function()
+            local r = assert(fs.du("tree", { threads = threads }))
+            return r.files + r.dirs
+         end)
+      end
+      timeit("du, depth=1 + exts", function()
+         local r = assert(fs.du("tree", { depth = 1, exts = true }))
+         return r.files + r.dirs
+      end)
+   end)
+end)
+
+bench("cache", function()
+   with_tmpdir(function()
+      maketree("tree", 4, 3, 20)
+      local list = {}
+      for fn in fs.scandir "tree" do list[#list+1] = fn end
+      local function query()
+         local n = 0
+         for _ = 1, 10 do
+            for _, fn in ipairs(list) do
+               if fs.exists(fn) and not fs.isdir(fn) then fs.mtime(fn) end
+               n = n + 1
+            end
+         end
+         return n
+      end
+      timeit("exists/isdir/mtime", query, "paths")
+      fs.cache.enable()
+      timeit("exists/isdir/mtime, cached", query, "paths")
+      fs.cache.enable { ttl = 1 }
+      timeit("exists/isdir/mtime, cached, ttl=1", query, "paths")
+      for i, fn in ipairs(list) do list[i] = path.abs(fn) end
+      timeit("exists/isdir/mtime, cached, absolute", query, "paths")
+      fs.cache.disable()
+   end)
+end)
+
+bench("changes", function()
+   with_tmpdir(function()
+      maketree("tree", 6, 3, 20)
+      local old = os.time() - 100
+      for fn, ty in fs.scandir "tree" do
+         if ty == "in" then assert(fs.touch(fn, old, old)) end
+      end
+      local _, _, state = fs.changes "tree"
+      _, _, state = fs.changes("tree", state)
+      local n = timeit("scandir", function() return count(fs.scandir "tree") end)
+      timeit("changes, nothing changed", function()
+         local paths
+         paths, _, state = fs.changes("tree", state)
+         assert(#paths == 0)
+         return n
+      end)
+      timeit("changes, files = true", function()
+         fs.changes("tree", state, { files = true })
+         return n
+      end)
+   end)
+end)
+
+bench("fnmatch", function()
+   -- the same matches in two orders: pattern by pattern the patterns are
+   -- compiled; name by name, the patterns evict each other in the state
+   -- cache, so every call runs the interpreter.
+   local names, pats = {}, {}
+   for i = 1, 1000 do
+      names[i] = ("file_%04d_%s.%s"):format(i, ("x"):rep(i % 17),
+         i % 3 == 0 and "txt" or "c")
+   end
+   for i = 1, 8 do
+      pats[#pats+1] = ("*_%d*.txt"):format(i)
+      pats[#pats+1] = ("file_*%d?_x*.c"):format(i)
+      pats[#pats+1] = ("*[%d-9]x*x[!.]*"):format(i)
+      pats[#pats+1] = ("*needle%d*"):format(i)
+   end
+   local function run(outer, inner, f)
+      local n = 0
+      for _ = 1, 20 do
+         for _, a in ipairs(outer) do
+            for _, b in ipairs(inner) do
+               if f(a, b) then n = n + 1 end
+            end
+         end
+      end
+      return n
+   end
+   local n1 = timeit("interpreted", function()
+      run(names, pats, function(s, p) return path.fnmatch(s, p) end)
+      return 20 * #names * #pats
+   end, "calls")
+   timeit("compiled", function()
+      run(pats, names, function(p, s) return path.fnmatch(s, p) end)
+      return n1
+   end, "calls")
+end)
+
+bench("glob_compile", function()
+   local paths = {}
+   for i = 1, 200 do
+      paths[i] = ("src/mod_%03d/sub/file_%03d.%s"):format(i % 20, i,
+         i % 3 == 0 and "lua" or "c")
+   end
+   timeit("path.match", function()
+      local n = 0
+      for _ = 1, 2000 do
+         for _, p in ipairs(paths) do
+            if path.match(p, "src/*/sub/*.c") then n = n + 1 end
+         end
+      end
+      return n
+   end, "matches")
+   local c = path.glob_compile "src/*/sub/*.c"
+   timeit("compiled match", function()
+      local n = 0
+      for _ = 1, 2000 do
+         for _, p in ipairs(paths) do
+            if c:match(p) then n = n + 1 end
+         end
+      end
+      return n
+   end, "matches")
+   timeit("compiled filter", function()
+      local n = 0
+      for _ = 1, 2000 do n = n + #c:filter(paths) end
+      return n
+   end, "matches")
+   with_tmpdir(function()
+      maketree("tree", 4, 3, 20)
+      timeit("fs.glob", function()
+         local n = 0
+         for _ = 1, 10 do n = n + count(fs.glob "tree/**/*.txt") end
+         return n
+      end)
+      c = path.glob_compile "tree/**/*.txt"
+      timeit("compiled walk", function()
+         local n = 0
+         for _ = 1, 10 do n = n + count(c:walk()) end
+         return n
+      end)
+   end)
+end)
+
+bench("globset", function()
+   local pats, names = {}, {}
+   for i = 1, 50 do
+      pats[#pats+1] = ("*.ext%d"):format(i)
+      pats[#pats+1] = ("name_%d.txt"):format(i)
+      pats[#pats+1] = ("*_%d?.c"):format(i)
+      pats[#pats+1] = ("src/**/mod%d/*.h"):format(i)
+   end
+   for i = 1, 2000 do
+      names[i] = ("src/a/mod%d/file_%d.%s"):format(i % 60, i,
+         ({ "c", "h", "txt", "ext7" })[i % 4 + 1])
+   end
+   local n = timeit("path.match per pattern", function()
+      local n = 0
+      for _, p in ipairs(names) do
+         for _, pat in ipairs(pats) do
+            if path.match(p, pat) then n = n + 1; break end
+         end
+      end
+      return #names
+   end, "paths")
+   local gs = path.globset(pats)
+   timeit("globset:match", function()
+      for _ = 1, 10 do
+         for _, p in ipairs(names) do gs:match(p) end
+      end
+      return n * 10
+   end, "paths")
+   with_tmpdir(function()
+      maketree("tree", 4, 3, 20)
+      local filter = path.globset { "*_0000[1-5].txt", "dir_001/" }
+      local total = count(fs.scandir "tree")
+      timeit("scandir + path.fnmatch in Lua", function()
+         for fn in fs.scandir "tree" do
+            local name = path.name(fn)
+            if path.fnmatch(name, "*_0000[1-5].txt")
+               or path.fnmatch(name, "dir_001") then end
+         end
+         return total
+      end)
+      timeit("scandir, filter = globset", function()
+         for _ in fs.scandir("tree", { filter = filter }) do end
+         return total
+      end)
+   end)
+end)
+
+bench("glob_probe", function()
+   with_tmpdir(function()
+      for i = 1, 200 do
+         local host = path("hosts", ("host_%03d"):format(i))
+         maketree(path(host, "current"), 0, 0, 50)
+         maketree(path(host, "archive"), 0, 0, 50)
+         assert(fs.touch(path(host, "current", "app.log")))
+      end
+      local n = count(fs.glob "hosts/*/current/app.log")
+      timeit("glob, literal parts probed", function()
+         count(fs.glob "hosts/*/current/app.log")
+         return n
+      end, "matches")
+      timeit("glob, same parts as wildcards", function()
+         count(fs.glob "hosts/*/curren[t]/app.lo[g]")
+         return n
+      end, "matches")
+   end)
+end)
+
+bench("glob_braces", function()
+   with_tmpdir(function()
+      maketree("tree", 6, 3, 10)
+      local alts = {}
+      for i = 1, 4 do alts[i] = ("tree/**/file_%06d.txt"):format(i) end
+      local n = 0
+      for _, pat in ipairs(alts) do n = n + count(fs.glob(pat)) end
+      timeit("one glob per alternative", function()
+         for _, pat in ipairs(alts) do count(fs.glob(pat)) end
+         return n
+      end, "matches")
+      local pat = "tree/**/file_00000{1,2,3,4}.txt"
+      assert(count(fs.glob(pat)) == n)
+      timeit("one glob with braces", function()
+         count(fs.glob(pat))
+         return n
+      end, "matches")
+   end)
+end)
+
+bench("glob_prune", function()
+   with_tmpdir(function()
+      maketree("tree", 8, 3, 10)
+      for _, pat in ipairs {
+         "dir_00[12]/*/*.txt",
+         "*/dir_001/dir_00[1-3]/*_00000?.txt",
+         "*/*/dir_001",
+      } do
+         local n = count(fs.glob("tree", pat))
+         timeit(pat, function()
+            for _ = 1, 50 do count(fs.glob("tree", pat)) end
+            return n * 50
+         end, "matches")
+      end
+   end)
+end)
+
+bench("glob_adversarial", function()
+   local pats = {
+      "**/a/**/a/**/a/**/c/**/b",
+      "**/a/**/a/**/a/**/a/**/a/**/c",
+      "**/*/**/*/**/*/**/*/**/x",
+   }
+   local deep = ("a/"):rep(20) .. "b"
+   for _, pat in ipairs(pats) do
+      local c = path.glob_compile(pat)
+      timeit("match  " .. pat, function()
+         for _ = 1, 10 do c:match(deep) end
+         return 10
+      end, "paths")
+   end
+   for _, pat in ipairs(pats) do
+      local gs = path.globset { pat }
+      timeit("globset " .. pat, function()
+         for _ = 1, 10 do gs:match(deep) end
+         return 10
+      end, "paths")
+   end
+   with_tmpdir(function()
+      local dir = "t"
+      for _ = 1, 14 do
+         assert(fs.makedirs(path(dir, "x")))
+         assert(fs.touch(path(dir, "b")))
+         assert(fs.touch(path(dir, "c")))
+         dir = path(dir, "a")
+      end
+      for _, pat in ipairs(pats) do
+         local n = count(fs.glob("t", pat))
+         timeit("glob   " .. pat, function()
+            for _ = 1, 10 do count(fs.glob("t", pat)) end
+            return n * 10
+         end, "matches")
+      end
+   end)
+end)
+
+bench("path_new", function()
+   -- the questions a loop asks about one path, from strings and from a
+   -- parsed path.new() object
+   local paths = {}
+   for i = 1, 10000 do
+      paths[i] = ("/usr/local/share/lua/5.4/pkg_%05d/sub/init.%d.lua"):format(i, i % 7)
+   end
+   local fns = { "name", "stem", "suffix", "parent", "drive", "root" }
+   timeit("strings", function()
+      for _ = 1, 10 do
+         for _, s in ipairs(paths) do
+            for _, f in ipairs(fns) do path[f](s) end
+         end
+      end
+      return #paths * #fns * 10
+   end, "calls")
+   local objs = {}
+   timeit("path.new", function()
+      for i, s in ipairs(paths) do objs[i] = path.new(s) end
+      return #paths
+   end, "paths")
+   timeit("objects", function()
+      for _ = 1, 10 do
+         for _, p in ipairs(objs) do
+            for _, f in ipairs(fns) do p[f](p) end
+         end
+      end
+      return #objs * #fns * 10
+   end, "calls")
+   timeit("objects / name", function()
+      for _ = 1, 10 do
+         for _, p in ipairs(objs) do local _ = p / "x.lua" end
+      end
+      return #objs * 10
+   end, "paths")
+   timeit("path(string, name)", function()
+      for _ = 1, 10 do
+         for _, s in ipairs(paths) do path(s, "x.lua") end
+      end
+      return #paths * 10
+   end, "paths")
+end)
+
+bench("bulk", function()
+   -- one call per path against one call per list
+   local list = {}
+   for i = 1, 200000 do
+      list[i] = ("src/./mod_%03d//sub/../file_%06d.lua"):format(i % 500, i)
+   end
+   local buf = table.concat(list, "\n")
+   for _, op in ipairs { "normalize", "abs", "rel" } do
+      local one = op == "normalize" and path or path[op]
+      local all = path[op .. "_all"]
+      timeit(op .. " per call", function()
+         local t = {}
+         for i, s in ipairs(list) do t[i] = one(s) end
+         return #t
+      end, "paths")
+      timeit(op .. "_all table", function()
+         return #all(list)
+      end, "paths")
+      timeit(op .. "_all string", function()
+         all(buf)
+         return #list
+      end, "paths")
+   end
+end)
+
+bench("join", function()
+   -- path(...) on short and long paths, mostly scanning and rendering
+   local cases = {
+      { "short", { "a/b.c" } },
+      { "short, 3 args", { "a", "b", "c.txt" } },
+      { "dots", { "./a/../b/./c/.." } },
+      { "long", { ("some_long_folder_name/"):rep(12) .. "file.txt" } },
+      { "long, few seps", { ("x"):rep(200) .. "/" .. ("y"):rep(200) } },
+      { "absolute", { "/usr/local/share/lua/5.4", "pkg/init.lua" } },
+   }
+   for _, c in ipairs(cases) do
+      local args, n = c[2], 200000
+      local unpack = table.unpack or unpack
+      timeit(c[1], function()
+         for _ = 1, n do path(unpack(args)) end
+         return n
+      end, "paths")
+   end
+end)
+
+bench("calls", function()
+   -- per call overhead of tiny routines, on a normalized and a
+   -- not normalized path
+   print("  " .. (jit and jit.version or _VERSION))
+   local n = 1000000
+   for _, s in ipairs { "src/lpath/init.lua", "./src//lpath/init.lua" } do
+      for _, f in ipairs {
+         "name", "stem", "suffix", "parent", "root", "exists",
+      } do
+         local fn = path[f]
+         timeit(("%-7s %s"):format(f, s), function()
+            for _ = 1, n do fn(s) end
+            return n
+         end, "calls")
+      end
+      timeit(("%-7s %s"):format("path", s), function()
+         for _ = 1, n do path(s) end
+         return n
+      end, "calls")
+   end
+end)
+
+local selected = {}
+for _, name in ipairs(arg or {}) do selected[name] = true end
+print(("lpath %s on %s"):format(info.version, info.platform))
+for _, b in ipairs(benches) do
+   if next(selected) == nil or selected[b.name] then
+      print(b.name .. ":")
+      b.f()
+   end
+end
@@ -4,6 +4,9 @@
 #include <lauxlib.h>
 
 #include <assert.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -16,6 +19,18 @@
 # define lua_setuservalue    lua_setfenv
 # ifndef LUA_GCISRUNNING /* not LuaJIT 2.1 */
 #   define luaL_newlib(L,l)    (lua_newtable(L), luaL_register(L,NULL,l))
+#   define luaL_newlibtable(L,l) lua_createtable(L,0,sizeof(l)/sizeof((l)[0])-1)
+
+static void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
+    luaL_checkstack(L, nup, "too many upvalues");
+    for (; l->name != NULL; l++) {
+        int i;
+        for (i = 0; i < nup; i++) lua_pushvalue(L, -nup);
+        lua_pushcclosure(L, l->func, nup);
+        lua_setfield(L, -(nup + 2), l->name);
+    }
+    lua_pop(L, nup);
+}
 
 static lua_Integer lua_tointegerx(lua_State *L, int idx, int *pisint) {
     *pisint = lua_type(L, idx) == LUA_TNUMBER;
@@ -129,17 +144,76 @@ static int vec_grow_(lua_State *L, void **pA, unsigned len, size_t objlen) {
 #define LP_STATE_KEY    ((void*)(ptrdiff_t)0x9A76B0FF)
 #define LP_WALKER_TYPE  "lpath.Walker"
 #define LP_GLOB_TYPE    "lpath.Glob"
+#define LP_GLOBPAT_TYPE "lpath.GlobPattern"
+#define LP_GLOBSET_TYPE "lpath.GlobSet"
 #define LP_PARTS_ITER   "lpath.PartsIter"
+#define LP_PATH_TYPE    "lpath.Path"
+#define LP_ENTRY_TYPE   "lpath.DirEntry"
+
+typedef struct lp_Part    lp_Part;
+typedef struct lp_State   lp_State;
+typedef struct lp_FnSlot  lp_FnSlot;
+typedef struct lp_GlobSet lp_GlobSet;
+typedef struct lp_Walker  lp_Walker;
+typedef struct lp_WalkRef lp_WalkRef;
+
+struct lp_Part {
+    const char *s, *e;
+};
 
-typedef struct lp_Part   lp_Part;
-typedef struct lp_State  lp_State;
-typedef struct lp_Walker lp_Walker;
+#define LP_RULE_NEGATE  1 /* '!pattern', keeps matched files */
+#define LP_RULE_DIRONLY 2 /* 'pattern/', only matches directories */
+#define LP_RULE_PATH    4 /* 'a/pattern', matches path from the root */
+#define LP_RULE_NAME    8 /* excluded name, not a pattern */
+
+typedef struct lp_Rule {
+    unsigned pos, len; /* pattern in 'text' */
+    unsigned flags;
+} lp_Rule;
+
+typedef struct lp_FnMatch {
+    uint64_t B[256];  /* positions accept each char */
+    uint64_t any;     /* positions accept any char ('?') */
+    uint64_t loop;    /* positions followed by '*' */
+    unsigned npos;    /* count of positions, the minimal length */
+    unsigned prefix;  /* literal positions at start */
+    unsigned suffix;  /* literal positions at end */
+    unsigned litpos, litlen; /* longest literal between them */
+    char     star;    /* has '*' */
+    char     lead;    /* starts with '*' */
+    lp_Part  pat;     /* the pattern, not owned */
+} lp_FnMatch;
+
+typedef struct lp_Prune {
+    char       *text;  /* patterns of 'rules' */
+    lp_Rule    *rules; /* the last matched rule wins */
+    lp_FnMatch *fms;   /* compiled 'rules', by index */
+    lp_GlobSet *filter; /* only yields the matched entries */
+    int         xdev;  /* do not walk into other filesystems */
+} lp_Prune;
 
 #define LP_WALKER_PUBLIC \
-    char        *buf;    \
-    int          limit;  \
-    lp_WalkState state;  \
-    lp_WalkLevel *levels /* 'pos' is readonly, others are undefined */
+    char        *buf;     /* use lp_walkpath() to read */ \
+    const char  *name;    /* current entry name */        \
+    size_t       namelen; \
+    int          limit;   \
+    unsigned     bufsize; /* read buffer size hint */     \
+    int          sort;    /* 'b'ytewise, 'n'atural, 0 for none */ \
+    int          follow;  /* walk into symbolic links */      \
+    int          unique;  /* skip hard links visited */        \
+    lp_WalkState state;   \
+    lp_WalkRef  *ref;     /* yields entries if not NULL */\
+    lp_Prune     prune;   \
+    lp_Part      probe;   /* the only name to read in the next folder */ \
+    int          pruned;  /* items pruned under the folder just left */ \
+    lp_WalkLevel *levels /* 'pos' and 'pruned' are common, others are undefined */
+
+#define LP_ENTRY_PUBLIC \
+    lp_WalkRef *ref;     /* walker, to stat relative to parent */ \
+    const char *path;    /* stored just after the entry */         \
+    size_t      len;     \
+    size_t      namepos; \
+    int         stated   /* 0 for not yet, 1 for ok, <0 for error */
 
 typedef enum lp_WalkState {
     LP_WALKINIT,
@@ -150,8 +224,10 @@ typedef enum lp_WalkState {
     LP_WALKSYS, /* '.' or '..', used internal */
 } lp_WalkState;
 
-struct lp_Part {
-    const char *s, *e;
+
+struct lp_WalkRef {
+    lp_Walker *w;    /* NULL after walker closed */
+    unsigned   refs; /* walker and its entries */
 };
 
 typedef struct lp_Path {
@@ -160,9 +236,12 @@ typedef struct lp_Path {
 } lp_Path;
 
 struct lp_State {
+    void          *key;   /* LP_STATE_KEY, tells it from other userdata */
     lua_State     *L;
     char          *buf;
     lp_Path        p, pp; /* path, pattern path */
+    struct lp_Cache *cache; /* metadata cache, NULL if disabled */
+    lp_FnSlot     *fns;   /* compiled patterns of fnmatch/match */
 #ifdef _WIN32
     wchar_t       *wbuf;
     int            cp;
@@ -183,9 +262,24 @@ static void lp_resetpath(lp_Path *p)
 static void lp_freepath(lp_Path *p)
 { if (p) vec_free(p->parts), p->dots = 0; }
 
+static void lp_unref(lp_WalkRef *r)
+{ if (r && --r->refs == 0) free(r); }
+
+static void lp_unrefset(lp_GlobSet *gs);
+
+static void lp_freeprune(lp_Prune *p) {
+    vec_free(p->text), vec_free(p->rules), vec_free(p->fms), p->xdev = 0;
+    lp_unrefset(p->filter), p->filter = NULL;
+}
+
+static void lp_freecache(lp_State *S);
+static void lp_freefns(lp_State *S);
+
 static int lpL_delstate(lua_State *L) {
     lp_State *S = (lp_State*)lua_touserdata(L, 1);
     if (S != NULL) {
+        lp_freecache(S);
+        lp_freefns(S);
         lp_freepath(&S->p);
         lp_freepath(&S->pp);
         vec_free(S->buf);
@@ -207,20 +301,35 @@ static lp_State *lp_resetstate(lp_State *S) {
     return S;
 }
 
-static lp_State *lp_getstate(lua_State *L) {
+static lp_State *lp_pushstate(lua_State *L) {
     lp_State *S;
     if (lua53_rawgetp(L, LUA_REGISTRYINDEX, LP_STATE_KEY) == LUA_TUSERDATA)
-        S = (lp_State*)lua_touserdata(L, -1);
-    else {
-        S = (lp_State*)lua_newuserdata(L, sizeof(lp_State));
-        memset(S, 0, sizeof(lp_State));
-        lua_createtable(L, 0, 1);
-        lua_pushcfunction(L, lpL_delstate);
-        lua_setfield(L, -2, "__gc");
-        lua_setmetatable(L, -2);
-        lua_rawsetp(L, LUA_REGISTRYINDEX, LP_STATE_KEY);
-    }
+        return (lp_State*)lua_touserdata(L, -1);
     lua_pop(L, 1);
+    S = (lp_State*)lua_newuserdata(L, sizeof(lp_State));
+    memset(S, 0, sizeof(lp_State));
+    S->key = LP_STATE_KEY;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lpL_delstate);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, LP_STATE_KEY);
+    return S;
+}
+
+#define lp_newlib(L,l) \
+    (luaL_newlibtable(L,l), lp_pushstate(L), luaL_setfuncs(L,l,1))
+
+static lp_State *lp_getstate(lua_State *L) {
+    /* functions of the modules have the state as the first upvalue, no
+     * other closure has a userdata there */
+    int up = lua_upvalueindex(1);
+    lp_State *S = (lp_State*)lua_touserdata(L, up);
+    if (S == NULL) S = lp_pushstate(L), lua_pop(L, 1);
+    else if (lua_type(L, up) != LUA_TUSERDATA
+            || lua_rawlen(L, up) != sizeof(lp_State) || S->key != LP_STATE_KEY)
+        luaL_error(L, "path: the first upvalue is not the path state");
     S->L = L;
     return lp_resetstate(S);
 }
@@ -252,11 +361,64 @@ static lp_State *lp_getstate(lua_State *L) {
 #define lp_ispardir(s)  (memcmp((s),LP_PARDIR,LP_LEN(PARDIR)) == 0 && lp_isdirend(s[LP_LEN(PARDIR)]))
 #define lp_charequal(ch1,ch2) (lp_normchar(ch1) == lp_normchar(ch2))
 
+#if defined(__SANITIZE_ADDRESS__) && !defined(LP_NO_SIMD)
+# define LP_NO_SIMD /* aligned loads may read past the string */
+#endif
+#ifdef __has_feature
+# if __has_feature(address_sanitizer) && !defined(LP_NO_SIMD)
+#   define LP_NO_SIMD
+# endif
+#endif
+
+#if !defined(LP_NO_SIMD) && defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+
+static const char *lp_nextsep(const char *p) {
+    /* aligned loads never cross a page, bytes before 'p' are masked */
+    const char *b = (const char*)((uintptr_t)p & ~(uintptr_t)15);
+    const __m128i z = _mm_setzero_si128();
+    const __m128i s1 = _mm_set1_epi8(LP_DIRSEP[0]);
+    const __m128i s2 = _mm_set1_epi8(LP_ALTSEP[0]);
+    unsigned m;
+    __m128i v = _mm_load_si128((const __m128i*)b);
+    m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, z),
+                _mm_or_si128(_mm_cmpeq_epi8(v, s1), _mm_cmpeq_epi8(v, s2))));
+    for (m &= ~0u << (p - b); m == 0; ) {
+        v = _mm_load_si128((const __m128i*)(b += 16));
+        m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, z),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, s1), _mm_cmpeq_epi8(v, s2))));
+    }
+    return b + __builtin_ctz(m);
+}
+
+#elif !defined(LP_NO_SIMD) && defined(__ARM_NEON) && defined(__GNUC__)
+# include <arm_neon.h>
+
+static uint64_t lp_sepmask(const char *b) {
+    /* 4 bits for each byte that is '\0' or a separator */
+    uint8x16_t v = vld1q_u8((const uint8_t*)b);
+    uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)),
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8(LP_DIRSEP[0])),
+                vceqq_u8(v, vdupq_n_u8(LP_ALTSEP[0]))));
+    return vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static const char *lp_nextsep(const char *p) {
+    /* aligned loads never cross a page, bytes before 'p' are masked */
+    const char *b = (const char*)((uintptr_t)p & ~(uintptr_t)15);
+    uint64_t m = lp_sepmask(b) & (~(uint64_t)0 << ((p - b)*4));
+    while (m == 0) m = lp_sepmask(b += 16);
+    return b + (__builtin_ctzll(m) >> 2);
+}
+
+#else
 static const char *lp_nextsep(const char *p) {
     while (*p != '\0' && !lp_isdirsep(*p))
         ++p;
     return p;
 }
+#endif
 
 static int lp_splitdrive(const char *s, lp_Part *p) {
     if (!(p->s = p->e = s)) return 0;
@@ -307,13 +469,15 @@ static int lp_driveequal(lp_Part d1, lp_Part d2) {
 static void lp_joinraw(lua_State *L, const char *s, lp_Path *p) {
     while (*s != '\0') {
         lp_Part *cur = vec_grow(L, p->parts, 1);
+        size_t len;
         while (lp_isdirsep(*s)) ++s;
         cur->s = s;
         cur->e = s = lp_nextsep(s);
-        if (lp_iscurdir(cur->s)) {
+        len = s - cur->s; /* the part is known, no need to match it again */
+        if (len == LP_LEN(CURDIR) && cur->s[0] == LP_CURDIR[0]) {
             if (*cur->e == '\0') vec_rawlen(p->parts) += 1;
             cur->e = cur->s;
-        } else if (!lp_ispardir(cur->s))
+        } else if (len != LP_LEN(PARDIR) || memcmp(cur->s, LP_PARDIR, len))
             vec_rawlen(p->parts) += 1;
         else if (vec_rawlen(p->parts) > 1)
             vec_rawlen(p->parts) -= 1;
@@ -340,50 +504,74 @@ static int lp_joinparts(lua_State *L, const char *s, lp_Path *p) {
     return p->dots;
 }
 
-static char *lp_applydrive(lua_State *L, int sep, char **pp, lp_Part drive) {
+static char *lp_writedrive(char *d, int sep, lp_Part drive) {
     const char *s;
     for (s = drive.s; s < drive.e; ++s) {
         int ch = *s;
         if (lp_isdirsep(ch))
-            vec_push(L, *pp, sep);
+            *d++ = (char)sep;
 #ifdef _WIN32
         else if (ch >= 'a' && ch <='z')
-            vec_push(L, *pp, ch + 'A' - 'a');
+            *d++ = (char)(ch + 'A' - 'a');
 #endif
         else
-            vec_push(L, *pp, ch);
+            *d++ = (char)ch;
     }
-    return *pp;
+    return d;
+}
+
+static char *lp_applydrive(lua_State *L, int sep, char **pp, lp_Part drive) {
+    size_t len = lp_len(drive);
+    lp_writedrive(vec_grow(L, *pp, len), sep, drive);
+    return vec_rawlen(*pp) += (unsigned)len, *pp;
 }
 
-static char *lp_applysepparts(lua_State *L, const char *sep, char **pp, lp_Path *p) {
+static size_t lp_rendersize(lp_Path *p) {
+    /* length of the rendered 'p', without the '.' of empty paths */
     int i, len = vec_len(p->parts);
+    size_t size = 0;
     if (len) {
-        lp_applydrive(L, sep[0], pp, p->parts[0]);
-        if (p->dots <= -2) vec_concat(L, *pp, sep);
-        if (p->dots <= -1) vec_concat(L, *pp, sep);
-        if (p->dots > 0) {
-            for (i = 0; i < p->dots; ++i) {
-                if (i > 0) vec_concat(L, *pp, sep);
-                vec_concat(L, *pp, LP_PARDIR);
-            }
-            if (len > 1) vec_concat(L, *pp, sep);
+        size = lp_len(p->parts[0]) + (p->dots < 0 ? -p->dots : 0);
+        if (p->dots > 0) size += (size_t)p->dots*(LP_LEN(PARDIR)+1) - (len == 1);
+        for (i = 1; i < len; ++i) size += lp_len(p->parts[i]) + (i > 1);
+    }
+    return size;
+}
+
+static char *lp_applysepparts(lua_State *L, const char *sep, char **pp,
+        lp_Path *p, unsigned *offs) {
+    /* 'offs' receives where the parts are in '*pp', if not NULL; the size
+     * is counted first, then all are copied into place */
+    int i, len = vec_len(p->parts);
+    char *s, *start;
+    s = start = vec_grow(L, *pp, lp_rendersize(p) + 2); /* may be '.', and '\0' */
+    if (len) {
+        s = lp_writedrive(s, sep[0], p->parts[0]);
+        if (p->dots <= -2) *s++ = sep[0];
+        if (p->dots <= -1) *s++ = sep[0];
+        for (i = 0; i < p->dots; ++i) {
+            if (i > 0) *s++ = sep[0];
+            memcpy(s, LP_PARDIR, LP_LEN(PARDIR)), s += LP_LEN(PARDIR);
         }
+        if (p->dots > 0 && len > 1) *s++ = sep[0];
         for (i = 1; i < len; ++i) {
-            if (i > 1) vec_concat(L, *pp, sep);
-            vec_extend(L, *pp, p->parts[i].s, lp_len(p->parts[i]));
+            size_t n = lp_len(p->parts[i]);
+            if (i > 1) *s++ = sep[0];
+            if (offs) offs[i*2] = (unsigned)(s - *pp);
+            memcpy(s, p->parts[i].s, n), s += n;
+            if (offs) offs[i*2+1] = (unsigned)(s - *pp);
         }
     }
-    if (vec_len(*pp) == 0) vec_push(L, *pp, LP_CURDIR[0]);
-    *vec_grow(L, *pp, 1) = 0;
+    if (s == start) *s++ = LP_CURDIR[0];
+    *s = 0, vec_rawlen(*pp) = (unsigned)(s - *pp);
     return *pp;
 }
 
 static char *lp_applyparts(lua_State *L, char **pp, lp_Path *p)
-{ return lp_applysepparts(L, LP_DIRSEP, pp, p); }
+{ return lp_applysepparts(L, LP_DIRSEP, pp, p, NULL); }
 
 static char *lp_applyaltparts(lua_State *L, char **pp, lp_Path *p)
-{ return lp_applysepparts(L, LP_ALTSEP, pp, p); }
+{ return lp_applysepparts(L, LP_ALTSEP, pp, p, NULL); }
 
 static lp_Part lp_name(lp_Path *p) {
     unsigned len = vec_len(p->parts);
@@ -429,14 +617,125 @@ static int lp_indexparts(lua_State *L, int idx, lp_Path *p) {
     return 1;
 }
 
+/* path object */
+
+typedef struct lp_PathObj {
+    int      dots;    /* as 'dots' of lp_Path */
+    unsigned n;       /* count of parts, with the drive */
+    size_t   len;     /* of the normalized path, stored after 'offs' */
+    unsigned offs[2]; /* start and end of each part in the string */
+} lp_PathObj;
+
+#define lp_pathstr(o) ((char*)&(o)->offs[(o)->n*2])
+
+static lp_PathObj *lp_topath(lua_State *L, int idx, const char **ps, size_t *plen) {
+    lp_PathObj *o = lua_type(L, idx) != LUA_TUSERDATA ? NULL :
+        (lp_PathObj*)luaL_testudata(L, idx, LP_PATH_TYPE);
+    if (o != NULL) {
+        *ps = lp_pathstr(o);
+        if (plen) *plen = o->len;
+    }
+    return o;
+}
+
+static const char *lp_checkpath(lua_State *L, int idx, size_t *plen) {
+    const char *s;
+    return lp_topath(L, idx, &s, plen) ? s : luaL_checklstring(L, idx, plen);
+}
+
+static const char *lp_checkitem(lua_State *L, int i, size_t *plen) {
+    /* the path at the top, item 'i' of a list */
+    const char *s;
+    if (!lp_topath(L, -1, &s, plen) && (s = lua_tolstring(L, -1, plen)) == NULL)
+        luaL_error(L, "string expected at index %d, got %s",
+                i, luaL_typename(L, -1));
+    return s;
+}
+
+static const char *lp_optpath(lua_State *L, int idx, const char *def)
+{ return lua_isnoneornil(L, idx) ? def : lp_checkpath(L, idx, NULL); }
+
+static void lp_joinarg(lua_State *L, int idx, lp_Path *p) {
+    /* parts of a path object are copied instead of parsed, if it replaces
+     * all of 'p' */
+    const char *s;
+    lp_PathObj *o = lp_topath(L, idx, &s, NULL);
+    if (o == NULL)
+        lp_joinparts(L, luaL_checkstring(L, idx), p);
+    else if (vec_len(p->parts) && (o->dots >= 0 || (o->offs[0] == o->offs[1]
+                    && lp_len(p->parts[0]) != 0))) /* keeps the drive */
+        lp_joinparts(L, s, p);
+    else {
+        unsigned i;
+        lp_Part *parts = (vec_reset(p->parts), vec_grow(L, p->parts, o->n));
+        for (i = 0; i < o->n; ++i)
+            parts[i] = lp_part(s + o->offs[i*2], o->offs[i*2+1] - o->offs[i*2]);
+        vec_rawlen(p->parts) = o->n, p->dots = o->dots;
+    }
+}
+
+static int lp_isnormal(const char *s, size_t len) {
+    /* whether 's' is the same after path(), and has no trailing '/' */
+    const char *e = s + len, *part;
+    if (len == 0 || lp_isdirsep(e[-1])) return 0;
+    if (*s == LP_DIRSEP[0]) ++s; /* root */
+    for (part = s; s < e; part = ++s) {
+        for (; s < e && !lp_isdirsep(*s); ++s) {
+#ifdef _WIN32
+            if (*s == ':') return 0; /* may be a drive */
+#endif
+            if (*s == '\0') return 0;
+        }
+        if (s == part || (s < e && *s != LP_DIRSEP[0])) return 0;
+        if (*part == LP_CURDIR[0] && (s - part == 1
+                    || (s - part == 2 && part[1] == LP_CURDIR[0])))
+            return 0; /* '.' or '..' */
+    }
+    return 1;
+}
+
+static const char *lp_normalarg(lua_State *L, int idx, size_t *plen) {
+    /* the only argument at 'idx', if it needs no joining */
+    const char *s;
+    if (lua_gettop(L) != idx || lua_type(L, idx) != LUA_TSTRING) return NULL;
+    s = lua_tolstring(L, idx, plen);
+    return lp_isnormal(s, *plen) ? s : NULL;
+}
+
+static lp_Part lp_normalname(const char *s, size_t len) {
+    const char *e = s + len, *p = e;
+    while (s < p && !lp_isdirsep(p[-1])) --p;
+    return lp_part(p, e - p);
+}
+
 static lp_State *lp_joinargs(lua_State *L, int start, int count) {
     lp_State *S = lp_getstate(L);
     int i;
     for (i = start; i <= count; ++i)
-        lp_joinparts(L, luaL_checkstring(L, i), &S->p);
+        lp_joinarg(L, i, &S->p);
     return S;
 }
 
+static int lp_natcmp(const char *a, const char *b) {
+    while (*a && *b) {
+        const char *sa = a, *sb = b;
+        size_t la, lb;
+        int r;
+        if (!isdigit((unsigned char)*a) || !isdigit((unsigned char)*b)) {
+            if (*a != *b) break;
+            ++a, ++b;
+            continue;
+        }
+        while (*sa == '0') ++sa;
+        while (*sb == '0') ++sb;
+        for (a = sa; isdigit((unsigned char)*a); ++a) ;
+        for (b = sb; isdigit((unsigned char)*b); ++b) ;
+        if ((la = a - sa) != (lb = b - sb)) return la < lb ? -1 : 1;
+        if ((r = memcmp(sa, sb, la)) != 0) return r;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
 /* system specfied utils */
 
 #define LP_MAX_TMPNUM     1000000
@@ -554,10 +853,22 @@ static int lpL_utf8(lua_State *L) {
 /* scandir */
 
 typedef struct lp_WalkLevel {
-    HANDLE   *hFile;
+    HANDLE   *hFile; /* closed once a sorted level is read */
+    unsigned  abase, snext, send; /* sorted entries of this level */
     unsigned  pos;
+    int       pruned; /* items pruned under it */
 } lp_WalkLevel;
 
+typedef struct lp_WinEnt {
+    WIN32_FIND_DATAW wfd;
+    char             name[1]; /* in 'cp', compared when sorting */
+} lp_WinEnt;
+
+typedef union lp_SortKey {
+    size_t     off; /* arena may move while reading sub directories */
+    lp_WinEnt *ent; /* only used when sorting */
+} lp_SortKey;
+
 struct lp_Walker {
     LP_WALKER_PUBLIC;
 
@@ -566,6 +877,9 @@ struct lp_Walker {
     WCHAR           *wbuf;
     WIN32_FIND_DATAW wfd;
     DWORD            err;
+    int              found;  /* 'wfd' holds the current entry */
+    char            *arena;  /* entries copied for sorting, a stack of levels */
+    lp_SortKey      *sorted; /* entries in 'arena', in order */
 };
 
 static void lp_initwalker(lp_State *S, lp_Walker *w, char *s, int limit) {
@@ -579,15 +893,24 @@ static void lp_initwalker(lp_State *S, lp_Walker *w, char *s, int limit) {
 static void lp_freewalker(lp_Walker *w) {
     int i, len;
     for (i = 0, len = vec_len(w->levels); i < len; ++i)
-        FindClose(w->levels[i].hFile);
+        if (w->levels[i].hFile != INVALID_HANDLE_VALUE)
+            FindClose(w->levels[i].hFile);
+    if (w->ref) w->ref->w = NULL, lp_unref(w->ref), w->ref = NULL;
+    lp_freeprune(&w->prune);
     vec_free(w->buf);
     vec_free(w->wbuf);
     vec_free(w->levels);
+    vec_free(w->arena);
+    vec_free(w->sorted);
 }
 
+static const char *lp_walkpath(lua_State *L, lp_Walker *w)
+{ return (void)L, w->buf; }
+
 static int lpW_init(lua_State *L, lp_Walker *w) {
     DWORD attr = GetFileAttributesW(lpP_addl2wstring(L,
                 &w->wbuf, w->buf, -1, w->cp));
+    w->name = w->buf, w->namelen = vec_len(w->buf);
     if (w->buf[0] != '\0' && attr == INVALID_FILE_ATTRIBUTES)
         return 0;
     if (w->buf[0] != '\0' && (attr & FILE_ATTRIBUTE_DIRECTORY) == 0)
@@ -595,9 +918,65 @@ static int lpW_init(lua_State *L, lp_Walker *w) {
     return w->state = (w->limit ? LP_WALKIN : LP_WALKDIR);
 }
 
+static int lpP_cmpbytes(const void *lhs, const void *rhs) {
+    const lp_SortKey *a = (const lp_SortKey*)lhs, *b = (const lp_SortKey*)rhs;
+    return strcmp(a->ent->name, b->ent->name);
+}
+
+static int lpP_cmpnatural(const void *lhs, const void *rhs) {
+    const lp_SortKey *a = (const lp_SortKey*)lhs, *b = (const lp_SortKey*)rhs;
+    int r = lp_natcmp(a->ent->name, b->ent->name);
+    return r ? r : strcmp(a->ent->name, b->ent->name); /* "01" vs "1" */
+}
+
+static int lpP_sortlevel(lua_State *L, lp_Walker *w, lp_WalkLevel *top) {
+    size_t base = vec_len(w->buf), hsize = offsetof(lp_WinEnt, name);
+    lp_SortKey *i, *e;
+    DWORD err;
+    top->abase = vec_len(w->arena);
+    top->snext = top->send = vec_len(w->sorted);
+    do {
+        size_t len, size;
+        lp_SortKey key;
+        lp_WinEnt *ent;
+        if (wcscmp(w->wfd.cFileName, L"" LP_CURDIR) == 0
+                || wcscmp(w->wfd.cFileName, L"" LP_PARDIR) == 0)
+            continue;
+        lpP_addlw2string(L, &w->buf, w->wfd.cFileName, -1, w->cp);
+        len = vec_rawlen(w->buf) - base;
+        size = (hsize + len + 1 + 7) & ~(size_t)7; /* keep entries aligned */
+        key.off = vec_len(w->arena);
+        vec_push(L, w->sorted, key);
+        ent = (lp_WinEnt*)vec_grow(L, w->arena, size);
+        ent->wfd = w->wfd;
+        memcpy(ent->name, w->buf + base, len + 1);
+        vec_rawlen(w->arena) += (unsigned)size;
+        vec_rawlen(w->buf) = (unsigned)base;
+    } while (FindNextFileW(top->hFile, &w->wfd));
+    err = GetLastError();
+    FindClose(top->hFile), top->hFile = INVALID_HANDLE_VALUE;
+    w->buf[base] = 0;
+    if (err != ERROR_NO_MORE_FILES) {
+        vec_setlen(w->arena, top->abase);
+        vec_setlen(w->sorted, top->snext);
+        return lpP_pusherrmsg(L, err, "walkin", w->buf);
+    }
+    i = w->sorted + top->snext, e = vec_rawend(w->sorted);
+    for (; i < e; ++i) /* the arena does not move while sorting */
+        i->ent = (lp_WinEnt*)(w->arena + i->off);
+    i = w->sorted + top->snext;
+    qsort(i, e - i, sizeof(lp_SortKey),
+            w->sort == 'n' ? lpP_cmpnatural : lpP_cmpbytes);
+    for (top->send = vec_rawlen(w->sorted); i < e; ++i)
+        i->off = (size_t)((char*)i->ent - w->arena);
+    w->err = ERROR_SUCCESS;
+    return 0;
+}
+
 static int lpW_in(lua_State *L, lp_Walker *w) {
     lp_WalkLevel *top = vec_grow(L, w->levels, 1);
     WCHAR *pathend = vec_grow(L, w->wbuf, 3);
+    int r;
     if (w->limit == 0) return 0;
     if (vec_rawlen(w->wbuf) && !lp_isdirsep(pathend[-1])) {
         vec_push(L, w->wbuf, LP_DIRSEP[0]);
@@ -608,7 +987,8 @@ static int lpW_in(lua_State *L, lp_Walker *w) {
     if (top->hFile == INVALID_HANDLE_VALUE)
         return lp_pusherror(L, "walkin", w->buf);
     w->err = ERROR_ALREADY_ASSIGNED;
-    top->pos = vec_rawlen(w->wbuf);
+    top->pos = vec_rawlen(w->wbuf), top->pruned = 0;
+    if (w->sort && (r = lpP_sortlevel(L, w, top)) < 0) return r;
     vec_rawlen(w->levels) += 1;
     return --w->limit, 0;
 }
@@ -616,21 +996,49 @@ static int lpW_in(lua_State *L, lp_Walker *w) {
 static int lpW_out(lua_State *L, lp_Walker *w) {
     lp_WalkLevel *top = vec_rawend(w->levels) - 1;
     DWORD err = GetLastError();
-    if (err != ERROR_NO_MORE_FILES)
+    if (!w->sort && err != ERROR_NO_MORE_FILES)
         return lpP_pusherrmsg(L, err, "walkout", w->buf);
-    FindClose(top->hFile);
+    if (!w->sort) FindClose(top->hFile);
+    else {
+        vec_setlen(w->arena, top->abase);
+        vec_setlen(w->sorted, top > w->levels ? top[-1].send : 0);
+    }
     vec_rawlen(w->wbuf) = vec_rawlen(w->buf) = top->pos ? top->pos - 1 : 0;
     *vec_rawend(w->buf) = (char)(*vec_rawend(w->wbuf) = 0);
+    if ((w->pruned = top->pruned) && top > w->levels) top[-1].pruned = 1;
     vec_rawlen(w->levels) -= 1;
+    top = vec_rawlen(w->levels) ? top - 1 : NULL;
+    w->name = w->buf + (top ? top->pos : 0);
+    w->namelen = vec_rawlen(w->buf) - (top ? top->pos : 0);
+    w->found = 0;
     return ++w->limit, 0;
 }
 
+static int lpP_samedev(lp_Walker *w)
+{ return (void)w, 1; /* 'xdev' is not supported on Windows */ }
+
+static int lpP_firstvisit(lua_State *L, lp_Walker *w)
+{ return (void)L, (void)w, 1; /* nor 'follow' and 'unique' */ }
+
+static int lpP_checkpoint(lua_State *L, lp_Walker *w) {
+    (void)w;
+    lua_pushnil(L);
+    lua_pushstring(L, "checkpoint not support on Windows");
+    return 2;
+}
+
+static int lpP_resume(lua_State *L, lp_Walker *w, const char *s, size_t len)
+{ return (void)w, (void)s, (void)len, luaL_error(L, "resume not support on Windows"); }
+
 static int lpW_file(lua_State *L, lp_Walker *w) {
     lp_WalkLevel* top;
     size_t len;
     if (vec_len(w->levels) == 0) return 0;
     top = vec_rawend(w->levels) - 1;
-    if (w->err == ERROR_ALREADY_ASSIGNED)
+    if (w->sort) {
+        if (top->snext >= top->send) return LP_WALKOUT;
+        w->wfd = ((lp_WinEnt*)(w->arena + w->sorted[top->snext++].off))->wfd;
+    } else if (w->err == ERROR_ALREADY_ASSIGNED)
         w->err = ERROR_SUCCESS;
     else if (!FindNextFileW(vec_rawend(w->levels)[-1].hFile, &w->wfd)) {
         w->err = GetLastError();
@@ -646,10 +1054,39 @@ static int lpW_file(lua_State *L, lp_Walker *w) {
     lpP_addlw2string(L, &w->buf, w->wfd.cFileName, (int)len, w->cp);
     vec_extend(L, w->wbuf, w->wfd.cFileName, len);
     *vec_grow(L, w->wbuf, 1) = 0;
+    w->name = w->buf + top->pos, w->namelen = vec_rawlen(w->buf) - top->pos;
+    w->found = 1;
     return w->wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ?
         (w->limit ? LP_WALKIN : LP_WALKDIR) : LP_WALKFILE;
 }
 
+/* metadata cache */
+
+static void lp_freecache(lp_State *S) { (void)S; }
+
+static void lp_cacheinval(lp_State *S, const char *s, int tree)
+{ (void)S, (void)s, (void)tree; }
+
+static int lpL_cacheenable(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "cache not support on Windows");
+    return 2;
+}
+
+static int lpL_cachedisable(lua_State *L) { return (void)L, 0; }
+
+static int lpL_cacheinvalidate(lua_State *L)
+{ return lua_pushinteger(L, 0), 1; }
+
+static int lpL_cachestats(lua_State *L) {
+    lua_createtable(L, 0, 4);
+    lua_pushboolean(L, 0), lua_setfield(L, -2, "enabled");
+    lua_pushinteger(L, 0), lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, 0), lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, 0), lua_setfield(L, -2, "entries");
+    return 1;
+}
+
 /* dir operations */
 
 static LPWSTR lpP_addwstring(lp_State *S, const char *s) {
@@ -724,9 +1161,13 @@ static int lp_removedirs(lp_State *S, lp_Walker *w, int *pcount, void *ud) {
     if (w->state == LP_WALKFILE)
         return ++*pcount, DeleteFileW(w->wbuf) ?
             0 : lp_pusherror(S->L, "remove", w->buf);
-    if (w->state == LP_WALKDIR || w->state == LP_WALKOUT)
-        return ++*pcount, RemoveDirectoryW(w->wbuf) ?
-            0 : lp_pusherror(S->L, "rmdir", w->buf);
+    if (w->state == LP_WALKDIR || w->state == LP_WALKOUT) {
+        if (RemoveDirectoryW(w->wbuf)) return ++*pcount, 0;
+        if (w->state == LP_WALKOUT && w->pruned
+                && GetLastError() == ERROR_DIR_NOT_EMPTY)
+            return 0; /* keeps pruned files */
+        return lp_pusherror(S->L, "rmdir", w->buf);
+    }
     return 0;
 }
 
@@ -799,6 +1240,20 @@ static int lp_size(lp_State *S, const char *s) {
     return lua_pushinteger(S->L, ul.QuadPart), 1;
 }
 
+static int lpP_readfile(lp_State *S, const char *s) {
+    HANDLE h = lpP_open(lpP_addwstring(S, s), GENERIC_READ, OPEN_EXISTING);
+    DWORD n;
+    if (h == INVALID_HANDLE_VALUE)
+        return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 :
+            lp_pusherror(S->L, "open", s);
+    vec_reset(S->buf);
+    while (ReadFile(h, vec_grow(S->L, S->buf, BUFSIZ), BUFSIZ, &n, NULL)
+            && n > 0)
+        vec_rawlen(S->buf) += n;
+    CloseHandle(h);
+    return 0;
+}
+
 static int lpP_touch(lua_State *L) {
     FILETIME at, mt;
     SYSTEMTIME st;
@@ -816,7 +1271,7 @@ static int lpL_touch(lua_State *L) {
     lp_State *S = lp_getstate(L);
     int ret;
     size_t len;
-    const char *s = luaL_checklstring(L, 1, &len);
+    const char *s = lp_checkpath(L, 1, &len);
     LPCWSTR ws = lpP_addl2wstring(L, &S->wbuf, s, (int)len, S->cp);
     HANDLE hFile = lpP_open(ws, FILE_WRITE_ATTRIBUTES, OPEN_ALWAYS);
     if (hFile == INVALID_HANDLE_VALUE)
@@ -841,8 +1296,8 @@ static int lp_remove(lp_State *S, const char *s) {
 static int lpL_rename(lua_State *L) {
     lp_State *S = lp_getstate(L);
     size_t flen, tlen;
-    const char *from = luaL_checklstring(L, 1, &flen);
-    const char *to = luaL_checklstring(L, 2, &tlen);
+    const char *from = lp_checkpath(L, 1, &flen);
+    const char *to = lp_checkpath(L, 2, &tlen);
     LPWSTR wto = (lpP_addl2wstring(L, &S->wbuf, from, (int)flen+1, S->cp),
             lpP_addl2wstring(L, &S->wbuf, to, (int)tlen, S->cp));
     return MoveFileW(S->wbuf, wto) ? lp_bool(L, 1) :
@@ -852,8 +1307,8 @@ static int lpL_rename(lua_State *L) {
 static int lpL_copy(lua_State *L) {
     lp_State *S = lp_getstate(L);
     size_t flen, tlen;
-    const char *from = luaL_checklstring(L, 1, &flen);
-    const char *to = luaL_checklstring(L, 2, &tlen);
+    const char *from = lp_checkpath(L, 1, &flen);
+    const char *to = lp_checkpath(L, 2, &tlen);
     int failIfExists = lua_toboolean(L, 3);
     LPWSTR wto = (lpP_addl2wstring(L, &S->wbuf, from, (int)flen+1, S->cp),
             lpP_addl2wstring(L, &S->wbuf, to, (int)tlen, S->cp));
@@ -879,8 +1334,8 @@ static DWORD lp_CreateSymbolicLinkW(lua_State *L, LPCWSTR lpSymlinkFileName, LPC
 static int lpL_symlink(lua_State *L) {
     lp_State *S = lp_getstate(L);
     size_t flen, tlen;
-    const char *from = luaL_checklstring(L, 1, &flen);
-    const char *to = luaL_checklstring(L, 2, &tlen);
+    const char *from = lp_checkpath(L, 1, &flen);
+    const char *to = lp_checkpath(L, 2, &tlen);
     int dir = lua_toboolean(L, 3) ? /*SYMBOLIC_LINK_FLAG_DIRECTORY=*/1 : 0;
     LPWSTR wto = (lpP_addl2wstring(L, &S->wbuf, from, (int)flen+1, S->cp),
             lpP_addl2wstring(L, &S->wbuf, to, (int)tlen, S->cp));
@@ -904,6 +1359,15 @@ static int lp_abs(lp_State *S, const char *s) {
     return lp_pushresult(S);
 }
 
+static const char *lp_absbuf(lp_State *S, const char *cwd, const char *s) {
+    /* GetFullPathNameW() knows the current folder of each drive */
+    (void)cwd;
+    if (lp_abs(S, s) != 1) return NULL;
+    lua_pop(S->L, 1);
+    *vec_grow(S->L, S->buf, 1) = 0;
+    return S->buf;
+}
+
 #define lpP_isattr(N,ATTR)                                    do { \
     DWORD attr = GetFileAttributesW(lpP_addwstring(S, s));         \
     return (attr != INVALID_FILE_ATTRIBUTES                        \
@@ -956,6 +1420,74 @@ static int lp_ctime(lp_State *S, const char *s) {lp_time(c, CreationTime);  }
 static int lp_mtime(lp_State *S, const char *s) {lp_time(m, LastWriteTime); }
 static int lp_atime(lp_State *S, const char *s) {lp_time(a, LastAccessTime);}
 
+/* dir entry */
+
+typedef struct lp_DirEntry {
+    LP_ENTRY_PUBLIC;
+    DWORD                     err;
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+} lp_DirEntry;
+
+static void lpP_initentry(lp_Walker *w, lp_DirEntry *e) {
+    if (!w->found) return; /* root or 'out', query it later */
+    e->fad.dwFileAttributes = w->wfd.dwFileAttributes;
+    e->fad.ftCreationTime   = w->wfd.ftCreationTime;
+    e->fad.ftLastAccessTime = w->wfd.ftLastAccessTime;
+    e->fad.ftLastWriteTime  = w->wfd.ftLastWriteTime;
+    e->fad.nFileSizeHigh    = w->wfd.nFileSizeHigh;
+    e->fad.nFileSizeLow     = w->wfd.nFileSizeLow;
+    e->stated = 1;
+}
+
+static int lpE_stat(lua_State *L, lp_DirEntry *e) {
+    lp_State *S;
+    if (e->stated) return e->stated > 0;
+    S = lp_getstate(L);
+    if (!GetFileAttributesExW(lpP_addwstring(S, e->path),
+                GetFileExInfoStandard, &e->fad))
+        return e->err = GetLastError(), e->stated = -1, 0;
+    return e->stated = 1;
+}
+
+static const char *lpE_type(lua_State *L, lp_DirEntry *e) {
+    DWORD attr;
+    if (!lpE_stat(L, e)) return NULL;
+    attr = e->fad.dwFileAttributes;
+    return attr & FILE_ATTRIBUTE_REPARSE_POINT ? "link" :
+        attr & FILE_ATTRIBUTE_DIRECTORY ? "dir" : "file";
+}
+
+static int lpE_pushfield(lua_State *L, lp_DirEntry *e, int field) {
+    ULARGE_INTEGER ln;
+    if (field == 'i') {
+        lua_pushnil(L);
+        lua_pushstring(L, "ino not support on Windows");
+        return 2;
+    }
+    if (!lpE_stat(L, e))
+        return -lpP_pusherrmsg(L, e->err, "stat", e->path);
+    switch (field) {
+    case 's': ln.LowPart  = e->fad.nFileSizeLow;
+              ln.HighPart = e->fad.nFileSizeHigh;
+              return lua_pushinteger(L, (lua_Integer)ln.QuadPart), 1;
+    case 'o': return lua_pushinteger(L, e->fad.dwFileAttributes), 1;
+    case 'c': return lpP_pushtime(L, &e->fad.ftCreationTime);
+    case 'a': return lpP_pushtime(L, &e->fad.ftLastAccessTime);
+    default:  return lpP_pushtime(L, &e->fad.ftLastWriteTime);
+    }
+}
+
+/* bulk stat */
+
+#define LP_DEFAULT_DEPTH 32
+#define LP_MAX_DEPTH     4096
+
+static void lpP_statentries(lua_State *L, lp_DirEntry **es, int n, int follow, int depth) {
+    int i;
+    (void)follow, (void)depth;
+    for (i = 0; i < n; ++i) lpE_stat(L, es[i]);
+}
+
 static DWORD lp_GetFinalPathNameByHandleW(lua_State *L, HANDLE hFile, LPWSTR lpszFilePath, DWORD cchFilePath, DWORD dwFlags) {
     typedef DWORD WINAPI F(HANDLE hFile, LPWSTR lpszFilePath, DWORD cchFilePath, DWORD dwFlags);
     static F* f;
@@ -999,6 +1531,9 @@ static int lp_realpath(lp_State *S, const char *s) {
 
 /* utils */
 
+static double lpP_clock(void)
+{ return (double)GetTickCount64() / 1000.0; }
+
 static int lp_readreg(lp_State *S, HKEY hkey, LPCWSTR key) {
     DWORD wc = MAX_PATH, ret;
     LPWSTR ws = (vec_reset(S->wbuf), vec_grow(S->L, S->wbuf, wc));
@@ -1114,6 +1649,20 @@ static int lpL_expandvars(lua_State *L) {
 #ifndef __ANDROID__
 # include <wordexp.h>
 #endif
+#if defined(__linux__) && !defined(LP_NO_GETDENTS)
+# define LP_GETDENTS 1
+# include <sys/syscall.h>
+#endif
+#if defined(__linux__) && !defined(LP_NO_URING)
+# include <linux/io_uring.h>
+# include <linux/stat.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+# if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#   define LP_URING 1 /* headers of Linux 5.6+, which has IORING_OP_STATX */
+# endif
+#endif
 #ifdef __APPLE__
 #include <TargetConditionals.h>
 # if TARGET_OS_OSX
@@ -1154,13 +1703,73 @@ static int lpL_utf8(lua_State *L)
 
 /* scandir */
 
+#define LP_DEFAULT_BUFSIZE (128*1024)
+#define LP_MIN_BUFSIZE     (4*1024)
+
+#if defined(LP_GETDENTS) || defined(_DIRENT_HAVE_D_TYPE) || defined(__APPLE__)
+# define LP_DTYPE 1
+#endif
+
+#define lpP_issys(s) ((s)[0] == '.' && \
+        ((s)[1] == '\0' || ((s)[1] == '.' && (s)[2] == '\0')))
+
+typedef struct lp_FileId { uint64_t dev, ino; } lp_FileId;
+
 typedef struct lp_WalkLevel {
+#ifdef LP_GETDENTS
+    int       fd;
+    unsigned  dpos, dend; /* unread entries in 'dents' */
+    int64_t   off;        /* d_off of the last read entry, for cursors */
+#else
     DIR      *dir;
+#endif
+    unsigned  id; /* tells entries whether their parent is still open */
+    unsigned  abase, snext, send; /* sorted entries of this level */
     unsigned  pos;
+    int       pruned; /* items pruned under it */
+    lp_Part   probe; /* looks up this name instead of reading */
+    lp_FileId vid;   /* in 'visited' while it is open, for 'follow' */
 } lp_WalkLevel;
 
+#ifdef LP_GETDENTS
+typedef struct lp_Dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[1];
+} lp_Dirent64;
+#else
+typedef struct dirent lp_Dirent64;
+#endif
+
+typedef struct lp_IdSet {
+    lp_FileId *ids;   /* open addressing, {0,0} for empty slots */
+    size_t     count;
+    size_t     mask;  /* capacity - 1 */
+} lp_IdSet;
+
+typedef union lp_SortKey {
+    size_t       off; /* arena may move while reading sub directories */
+    lp_Dirent64 *ent; /* only used when sorting */
+} lp_SortKey;
+
 struct lp_Walker {
     LP_WALKER_PUBLIC;
+
+    /* private */
+    int          dirty;  /* 'buf' does not contain 'name' yet */
+    unsigned     nextid; /* id for next opened level */
+    lp_Dirent64 *ent;    /* current entry, NULL for root or 'out' */
+    dev_t        dev;    /* device of root, for 'xdev' */
+    lp_IdSet     visited; /* for 'follow' and 'unique' */
+    lp_FileId    vnext;  /* id of the folder to walk into */
+    char        *arena;  /* entries copied for sorting, a stack of levels */
+    lp_SortKey  *sorted; /* entries in 'arena', in order */
+    char        *probed; /* entry of the probed name */
+#ifdef LP_GETDENTS
+    char        *dents;  /* getdents64 buffer, a stack shared by all levels */
+#endif
 };
 
 static void lp_initwalker(lp_State *S, lp_Walker *w, char *s, int limit) {
@@ -1171,104 +1780,780 @@ static void lp_initwalker(lp_State *S, lp_Walker *w, char *s, int limit) {
     w->state = LP_WALKINIT;
 }
 
+#ifdef LP_GETDENTS
+static int lpP_levelfd(lp_WalkLevel *l) { return l->fd; }
+
+static int lpP_opendir(lp_WalkLevel *l, int fd)
+{ return l->fd = fd, l->dpos = l->dend = 0, l->off = 0, 1; }
+
+static int lpP_closedir(lp_WalkLevel *l) { return close(l->fd); }
+
+static lp_Dirent64 *lpP_readdir(lua_State *L, lp_Walker *w) {
+    lp_WalkLevel *top = vec_rawend(w->levels) - 1;
+    lp_Dirent64 *ent;
+    if (top->dpos >= top->dend) {
+        /* levels below share the buffer, read behind their entries */
+        unsigned base = top > w->levels ? top[-1].dend : 0;
+        unsigned size = w->bufsize ? w->bufsize : LP_DEFAULT_BUFSIZE;
+        long n;
+        if (size < LP_MIN_BUFSIZE) size = LP_MIN_BUFSIZE;
+        vec_setlen(w->dents, base);
+        vec_rawgrow(L, w->dents, size);
+        n = syscall(SYS_getdents64, top->fd, w->dents + base, size);
+        if (n <= 0) return NULL;
+        top->dpos = base, top->dend = base + (unsigned)n;
+    }
+    ent = (lp_Dirent64*)(w->dents + top->dpos);
+    top->dpos += ent->d_reclen, top->off = ent->d_off;
+    return ent;
+}
+
+static uint64_t lpP_tellevel(lp_WalkLevel *l) { return (uint64_t)l->off; }
+
+static int lpP_seeklevel(lp_WalkLevel *l, uint64_t pos)
+{ return l->off = (int64_t)pos, lseek(l->fd, (off_t)pos, SEEK_SET) >= 0; }
+#else
+static int lpP_levelfd(lp_WalkLevel *l) { return dirfd(l->dir); }
+
+static uint64_t lpP_tellevel(lp_WalkLevel *l)
+{ return (uint64_t)telldir(l->dir); }
+
+static int lpP_seeklevel(lp_WalkLevel *l, uint64_t pos)
+{ return seekdir(l->dir, (long)pos), 1; }
+
+static int lpP_opendir(lp_WalkLevel *l, int fd)
+{ return (l->dir = fdopendir(fd)) != NULL; }
+
+static int lpP_closedir(lp_WalkLevel *l) { return closedir(l->dir); }
+
+static lp_Dirent64 *lpP_readdir(lua_State *L, lp_Walker *w)
+{ return (void)L, readdir(vec_rawend(w->levels)[-1].dir); }
+#endif
+
+static int lpP_walkfd(lp_Walker *w) {
+    unsigned len = vec_len(w->levels);
+    return len ? lpP_levelfd(&w->levels[len-1]) : AT_FDCWD;
+}
+
 static void lp_freewalker(lp_Walker *w) {
     int i, len;
     for (i = 0, len = vec_len(w->levels); i < len; ++i)
-        closedir(w->levels[i].dir);
+        lpP_closedir(&w->levels[i]);
+    if (w->ref) w->ref->w = NULL, lp_unref(w->ref), w->ref = NULL;
+    lp_freeprune(&w->prune);
     vec_free(w->buf);
     vec_free(w->levels);
+    vec_free(w->arena);
+    vec_free(w->sorted);
+    vec_free(w->probed);
+    free(w->visited.ids), memset(&w->visited, 0, sizeof(lp_IdSet));
+#ifdef LP_GETDENTS
+    vec_free(w->dents);
+#endif
 }
 
-static int lpP_isdir(lp_Walker *w, struct dirent *ent) {
-#if defined(_DIRENT_HAVE_D_TYPE) || defined(__APPLE__)
-    return (void)w, ent->d_type == DT_DIR;
-#else
+static const char *lp_walkpath(lua_State *L, lp_Walker *w) {
+    if (w->dirty) {
+        vec_rawlen(w->buf) = vec_rawend(w->levels)[-1].pos;
+        vec_extend(L, w->buf, w->name, w->namelen);
+        *vec_grow(L, w->buf, 1) = 0;
+        w->dirty = 0;
+    }
+    return w->buf;
+}
+
+static const char *lpP_walkname(lp_Walker *w)
+{ return w->namelen ? w->name : LP_CURDIR; }
+
+static size_t lpP_hashid(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 31));
+}
+
+static int lpP_addid(lua_State *L, lp_IdSet *s, uint64_t dev, uint64_t ino) {
+    size_t i;
+    if (s->ids == NULL || s->count >= (s->mask >> 1) + (s->mask >> 2)) {
+        size_t j, cap = s->ids ? (s->mask + 1) << 1 : 256;
+        lp_FileId *ids = (lp_FileId*)calloc(cap, sizeof(lp_FileId));
+        if (ids == NULL) return L ? luaL_error(L, "out of memory") : -1;
+        for (j = 0; s->ids && j <= s->mask; ++j) {
+            lp_FileId *id = &s->ids[j];
+            if (id->dev == 0 && id->ino == 0) continue;
+            for (i = lpP_hashid(id->dev, id->ino) & (cap-1);
+                    ids[i].dev || ids[i].ino; i = (i+1) & (cap-1))
+                ;
+            ids[i] = *id;
+        }
+        free(s->ids), s->ids = ids, s->mask = cap - 1;
+    }
+    for (i = lpP_hashid(dev, ino) & s->mask;
+            s->ids[i].dev || s->ids[i].ino; i = (i+1) & s->mask)
+        if (s->ids[i].dev == dev && s->ids[i].ino == ino) return 0;
+    s->ids[i].dev = dev, s->ids[i].ino = ino;
+    return ++s->count, 1;
+}
+
+static void lpP_delid(lp_IdSet *s, lp_FileId *id) {
+    size_t i, j;
+    if (s->ids == NULL || (id->dev == 0 && id->ino == 0)) return;
+    for (i = lpP_hashid(id->dev, id->ino) & s->mask;
+            s->ids[i].dev != id->dev || s->ids[i].ino != id->ino;
+            i = (i+1) & s->mask)
+        if (s->ids[i].dev == 0 && s->ids[i].ino == 0) return;
+    memset(&s->ids[i], 0, sizeof(lp_FileId)), --s->count;
+    for (j = (i+1) & s->mask; s->ids[j].dev || s->ids[j].ino;
+            j = (j+1) & s->mask) {
+        size_t k = lpP_hashid(s->ids[j].dev, s->ids[j].ino) & s->mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        s->ids[i] = s->ids[j], memset(&s->ids[j], 0, sizeof(lp_FileId)), i = j;
+    }
+    id->dev = id->ino = 0;
+}
+
+static int lpP_isdir(lp_Walker *w, lp_Dirent64 *ent) {
+    struct stat buf;
+#ifdef LP_DTYPE
+    if (ent->d_type != DT_UNKNOWN && !(w->follow && ent->d_type == DT_LNK))
+        return ent->d_type == DT_DIR;
+#endif
+    return (void)ent, fstatat(lpP_walkfd(w), w->name, &buf,
+            w->follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(buf.st_mode);
+}
+
+static int lpP_cmpbytes(const void *lhs, const void *rhs) {
+    const lp_SortKey *a = (const lp_SortKey*)lhs, *b = (const lp_SortKey*)rhs;
+    return strcmp(a->ent->d_name, b->ent->d_name);
+}
+
+static int lpP_cmpnatural(const void *lhs, const void *rhs) {
+    const lp_SortKey *a = (const lp_SortKey*)lhs, *b = (const lp_SortKey*)rhs;
+    int r = lp_natcmp(a->ent->d_name, b->ent->d_name);
+    return r ? r : strcmp(a->ent->d_name, b->ent->d_name); /* "01" vs "1" */
+}
+
+static int lpP_sortlevel(lua_State *L, lp_Walker *w) {
+    lp_WalkLevel *top = vec_rawend(w->levels) - 1;
+    size_t dsize = offsetof(lp_Dirent64, d_name);
+    lp_SortKey *i, *e;
+    lp_Dirent64 *ent;
+    top->abase = vec_len(w->arena);
+    top->snext = top->send = vec_len(w->sorted);
+    for (errno = 0; (ent = lpP_readdir(L, w)) != NULL; errno = 0) {
+        size_t len = dsize + strlen(ent->d_name) + 1;
+        size_t size = (len + 7) & ~(size_t)7; /* keep entries aligned */
+        lp_SortKey key;
+        if (lpP_issys(ent->d_name)) continue;
+        key.off = vec_len(w->arena);
+        vec_push(L, w->sorted, key);
+        memcpy(vec_grow(L, w->arena, size), ent, len);
+        vec_rawlen(w->arena) += (unsigned)size;
+    }
+    if (errno) return 0;
+    if (vec_len(w->sorted) == top->snext) return 1; /* empty */
+    i = w->sorted + top->snext, e = vec_rawend(w->sorted);
+    for (; i < e; ++i) /* the arena does not move while sorting */
+        i->ent = (lp_Dirent64*)(w->arena + i->off);
+    i = w->sorted + top->snext;
+    qsort(i, e - i, sizeof(lp_SortKey),
+            w->sort == 'n' ? lpP_cmpnatural : lpP_cmpbytes);
+    for (top->send = vec_rawlen(w->sorted); i < e; ++i)
+        i->off = (size_t)((char*)i->ent - w->arena);
+    return 1;
+}
+
+static lp_Dirent64 *lpP_probe(lua_State *L, lp_Walker *w, lp_WalkLevel *top) {
+    /* the entry of a known name, without reading the whole folder */
+    size_t len = lp_len(top->probe), hsize = offsetof(lp_Dirent64, d_name);
+    size_t size = hsize + len + 1;
+    lp_Dirent64 *ent;
     struct stat buf;
-    return (void)ent, lstat(w->buf, &buf) == 0 && S_ISDIR(buf.st_mode);
+    if (len == 0) return NULL; /* looked up already */
+    vec_reset(w->probed);
+    vec_rawgrow(L, w->probed, size < sizeof(lp_Dirent64) ? sizeof(lp_Dirent64) : size);
+    ent = (lp_Dirent64*)w->probed;
+    memset(ent, 0, hsize);
+    memcpy(ent->d_name, top->probe.s, len), ent->d_name[len] = '\0';
+    top->probe.e = top->probe.s;
+    if (fstatat(lpP_levelfd(top), ent->d_name, &buf, AT_SYMLINK_NOFOLLOW) < 0)
+        return errno = 0, NULL; /* just not found */
+#if defined(LP_DTYPE) && defined(IFTODT)
+    ent->d_type = IFTODT(buf.st_mode);
 #endif
+    return ent;
+}
+
+static lp_Dirent64 *lpP_nextdir(lua_State *L, lp_Walker *w) {
+    lp_WalkLevel *top = vec_rawend(w->levels) - 1;
+    if (top->probe.s) return lpP_probe(L, w, top);
+    if (!w->sort) return lpP_readdir(L, w);
+    if (top->snext >= top->send) return NULL;
+    return (lp_Dirent64*)(w->arena + w->sorted[top->snext++].off);
 }
 
 static int lpW_init(lua_State *L, lp_Walker *w) {
     struct stat buf;
-    (void)L;
-    if (lstat(*w->buf ? w->buf : LP_CURDIR, &buf) < 0) return 0;
+    w->name = w->buf, w->namelen = vec_len(w->buf);
+    if (fstatat(AT_FDCWD, lpP_walkname(w), &buf,
+                w->follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+        return 0;
+    w->dev = buf.st_dev;
+    if (w->follow && S_ISDIR(buf.st_mode)
+            && lpP_addid(L, &w->visited, buf.st_dev, buf.st_ino))
+        w->vnext.dev = buf.st_dev, w->vnext.ino = buf.st_ino;
     return w->state = ((w->buf[0] == '\0' || S_ISDIR(buf.st_mode)) ?
             (w->limit ? LP_WALKIN : LP_WALKDIR) : LP_WALKFILE);
 }
 
 static int lpW_in(lua_State *L, lp_Walker *w) {
     lp_WalkLevel *top = vec_grow(L, w->levels, 1);
+    unsigned len;
+    int fd;
+    top->probe = w->probe, w->probe.s = w->probe.e = NULL;
     if (w->limit == 0) return 0;
-    top->dir = opendir(*w->buf ? w->buf : LP_CURDIR);
-    if (top->dir == NULL) return lp_pusherror(L, "walkin", w->buf);
-    if (vec_len(w->buf) && !lp_isdirsep(vec_rawend(w->buf)[-1]))
+    top->vid = w->vnext, w->vnext.dev = w->vnext.ino = 0;
+    fd = openat(lpP_walkfd(w), lpP_walkname(w),
+            O_RDONLY|O_DIRECTORY|O_CLOEXEC|(w->follow ? 0 : O_NOFOLLOW));
+    if (fd < 0 || !lpP_opendir(top, fd)) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        lpP_delid(&w->visited, &top->vid);
+        return errno = err, lp_pusherror(L, "walkin", lp_walkpath(L, w));
+    }
+    lp_walkpath(L, w);
+    if (w->sort) w->name = NULL, w->ent = NULL; /* arena may move */
+    len = vec_len(w->buf);
+    if (len && !lp_isdirsep(w->buf[len-1]))
         vec_push(L, w->buf, LP_DIRSEP[0]);
-    top->pos = vec_rawlen(w->buf);
+    top->pos = vec_rawlen(w->buf), top->pruned = 0;
+    top->id = ++w->nextid;
+#ifdef LP_GETDENTS
+    if (top->probe.s && top > w->levels) /* keeps entries of levels below */
+        top->dpos = top->dend = top[-1].dend;
+#endif
     vec_rawlen(w->levels) += 1;
+    if (w->sort && top->probe.s) { /* nothing to sort */
+        top->abase = vec_len(w->arena);
+        top->snext = top->send = vec_len(w->sorted);
+    } else if (w->sort && !lpP_sortlevel(L, w)) {
+        int err = errno;
+        vec_setlen(w->arena, top->abase);
+        vec_setlen(w->sorted, top->snext);
+        vec_rawlen(w->levels) -= 1;
+        lpP_closedir(top);
+        lpP_delid(&w->visited, &top->vid);
+        vec_rawlen(w->buf) = len, w->buf[len] = 0;
+        return errno = err, lp_pusherror(L, "walkin", w->buf);
+    }
     return --w->limit, 0;
 }
 
 static int lpW_out(lua_State *L, lp_Walker *w) {
     lp_WalkLevel *top = vec_rawend(w->levels) - 1;
-    if (closedir(top->dir) < 0) return lp_pusherror(L, "walkout", w->buf);
+    unsigned pos;
+    if (lpP_closedir(top) < 0)
+        return lp_pusherror(L, "walkout", lp_walkpath(L, w));
     vec_rawlen(w->buf)  = top->pos ? top->pos - 1 : 0;
     *vec_rawend(w->buf) = 0;
+    if ((w->pruned = top->pruned) && top > w->levels) top[-1].pruned = 1;
+    lpP_delid(&w->visited, &top->vid); /* may be reached again by links */
+    if (w->sort) {
+        vec_setlen(w->arena, top->abase);
+        vec_setlen(w->sorted, top > w->levels ? top[-1].send : 0);
+    }
     vec_rawlen(w->levels) -= 1;
+    pos = vec_rawlen(w->levels) ? top[-1].pos : 0;
+    w->name = w->buf + pos, w->namelen = vec_rawlen(w->buf) - pos;
+    w->dirty = 0, w->ent = NULL;
     return ++w->limit, 0;
 }
 
 static int lpW_file(lua_State *L, lp_Walker *w) {
-    lp_WalkLevel *top;
-    struct dirent *ent;
+    lp_Dirent64 *ent;
     if (vec_len(w->levels) == 0) return 0;
-    top = vec_rawend(w->levels) - 1;
     errno = 0;
-    ent = readdir(vec_rawend(w->levels)[-1].dir);
-    if (!ent && errno) return lp_pusherror(L, "walknext", w->buf);
+    ent = lpP_nextdir(L, w);
+    if (!ent && errno) return lp_pusherror(L, "walknext", lp_walkpath(L, w));
     if (ent == NULL) return LP_WALKOUT;
-    if (strcmp(ent->d_name, LP_CURDIR) == 0
-            || strcmp(ent->d_name, LP_PARDIR) == 0)
-        return LP_WALKSYS;
-    vec_rawlen(w->buf) = top->pos;
-    vec_concat(L, w->buf, ent->d_name);
-    *vec_grow(L, w->buf, 1) = 0;
+    if (lpP_issys(ent->d_name)) return LP_WALKSYS;
+    w->name = ent->d_name, w->namelen = strlen(ent->d_name);
+    w->dirty = 1, w->ent = ent;
     return lpP_isdir(w, ent) ?
         (w->limit ? LP_WALKIN : LP_WALKDIR) : LP_WALKFILE;
 }
 
-/* dir operations */
-
-static int lpL_getcwd(lua_State *L) {
-    lp_State *S = lp_getstate(L);
-    char *ret = vec_grow(L, S->buf, PATH_MAX);
-    ret = getcwd(ret, PATH_MAX);
-    if (ret == NULL) return -lp_pusherror(L, "getcwd", NULL);
-    lua_pushstring(L, ret);
-    return 1;
+static int lpP_samedev(lp_Walker *w) {
+    struct stat buf;
+    return fstatat(lpP_walkfd(w), w->name, &buf,
+            w->follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && buf.st_dev == w->dev;
 }
 
-static int lpL_binpath(lua_State *L) {
-#if defined(__APPLE__) && !defined(TARGET_OS_OSX)
-    lua_pushnil(L);
-    lua_pushstring(L, "binpath not supoort on iOS");
-    return 2;
-#else
-    lp_State *S = lp_getstate(L);
-#ifdef __APPLE__
-    char *ret = vec_grow(L, S->buf, PROC_PIDPATHINFO_MAXSIZE);
-    int r = proc_pidpath(getpid(), ret, PROC_PIDPATHINFO_MAXSIZE);
-    if (r < 0) return -lp_pusherror(L, "binpath", NULL);
-#else
-    char *ret = vec_grow(L, S->buf, PATH_MAX);
-    int r = readlink("/proc/self/exe", ret, PATH_MAX);
-    if (r < 0) return -lp_pusherror(L, "binpath", NULL);
-#endif
-    return lua_pushstring(L, ret), 1;
+static int lpP_islink(lp_Walker *w) {
+    struct stat buf;
+#ifdef LP_DTYPE
+    if (w->ent && w->ent->d_type != DT_UNKNOWN)
+        return w->ent->d_type == DT_LNK;
 #endif
+    return fstatat(lpP_walkfd(w), w->name, &buf, AT_SYMLINK_NOFOLLOW) == 0
+        && S_ISLNK(buf.st_mode);
 }
 
-static int lp_abs(lp_State *S, const char *s) {
-    lua_State *L = S->L;
+static int lpP_firstvisit(lua_State *L, lp_Walker *w) {
+    struct stat buf;
+    int isdir = (w->state == LP_WALKIN);
+    lpP_delid(&w->visited, &w->vnext); /* the last one was not walked into */
+    if (isdir ? !w->follow : (w->state != LP_WALKFILE || !w->unique))
+        return 1;
+    if (fstatat(lpP_walkfd(w), w->name, &buf,
+                w->follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+        return 1; /* e.g. broken links, just report it */
+    if (!isdir && buf.st_nlink <= 1 && !(w->follow && lpP_islink(w)))
+        return 1; /* the only path to this file */
+    if (!lpP_addid(L, &w->visited, buf.st_dev, buf.st_ino)) return 0;
+    if (isdir) w->vnext.dev = buf.st_dev, w->vnext.ino = buf.st_ino;
+    return 1;
+}
+
+/* cursor: "1" <sorted> <state> { "/" <hex pos> ":" <len> ":" <name> },
+ * <name> is the last entry read in every level */
+
+static void lpP_addnum(luaL_Buffer *B, uint64_t n, unsigned base) {
+    char buf[24], *p = buf + sizeof(buf);
+    do *--p = "0123456789abcdef"[n % base]; while ((n /= base) != 0);
+    luaL_addlstring(B, p, buf + sizeof(buf) - p);
+}
+
+static const char *lpP_getnum(const char *s, const char *e, unsigned base, int sep, uint64_t *pn) {
+    const char *start = s;
+    for (*pn = 0; s < e && *s != sep; ++s) {
+        unsigned d = *s >= '0' && *s <= '9' ? (unsigned)(*s - '0') :
+            *s >= 'a' && *s <= 'f' ? (unsigned)(*s - 'a' + 10) : base;
+        if (d >= base) return NULL;
+        *pn = *pn * base + d;
+    }
+    return s > start && s < e ? s + 1 : NULL;
+}
+
+static int lpP_checkpoint(lua_State *L, lp_Walker *w) {
+    unsigned i, n = vec_len(w->levels);
+    luaL_Buffer B;
+    if (n == 0 && w->state != LP_WALKINIT && w->state != LP_WALKIN)
+        return 0; /* walked all */
+    luaL_buffinit(L, &B);
+    luaL_addchar(&B, '1');
+    luaL_addchar(&B, w->sort ? (char)w->sort : 'u');
+    luaL_addchar(&B, w->state == LP_WALKINIT ? 'i' :
+            w->state == LP_WALKIN ? 'n' : 'f');
+    for (i = 0; i < n; ++i) {
+        lp_WalkLevel *l = &w->levels[i];
+        const char *name = i+1 < n ? w->buf + l->pos : w->name;
+        size_t len = i+1 < n ? l[1].pos - 1 - l->pos : w->namelen;
+        luaL_addchar(&B, '/');
+        lpP_addnum(&B, w->sort ? 0 : lpP_tellevel(l), 16);
+        luaL_addchar(&B, ':');
+        lpP_addnum(&B, len, 10);
+        luaL_addchar(&B, ':');
+        luaL_addlstring(&B, name, len);
+    }
+    luaL_pushresult(&B);
+    return 1;
+}
+
+static void lpP_skipsorted(lua_State *L, lp_Walker *w, const char *name, size_t len) {
+    lp_WalkLevel *top = vec_rawend(w->levels) - 1;
+    const char *s = (lua_pushlstring(L, name, len), lua_tostring(L, -1));
+    for (; top->snext < top->send; ++top->snext) {
+        const char *cur = ((lp_Dirent64*)(w->arena
+                    + w->sorted[top->snext].off))->d_name;
+        int r = w->sort == 'n' ? lp_natcmp(cur, s) : 0;
+        if ((r ? r : strcmp(cur, s)) > 0) break;
+    }
+    lua_pop(L, 1);
+}
+
+static void lpP_setname(lua_State *L, lp_Walker *w, const char *name, size_t len) {
+    w->name = name, w->namelen = len, w->dirty = 1;
+    lp_walkpath(L, w); /* copy it, the cursor is not zero terminated */
+    w->name = w->buf + vec_rawend(w->levels)[-1].pos, w->ent = NULL;
+}
+
+static int lpP_resume(lua_State *L, lp_Walker *w, const char *s, size_t len) {
+    const char *e = s + len, *name = NULL;
+    size_t namelen = 0;
+    int state;
+    if (len < 3 || s[0] != '1') return luaL_error(L, "invalid cursor");
+    if (s[1] != (w->sort ? w->sort : 'u'))
+        return luaL_error(L, "cursor does not match the 'sorted' option");
+    if ((state = s[2]) == 'i') return 0;
+    if (!lpW_init(L, w)) return 0; /* root removed, yields nothing */
+    for (s += 3; s < e; s += namelen) {
+        uint64_t pos, n;
+        struct stat buf;
+        if (*s++ != '/' || (s = lpP_getnum(s, e, 16, ':', &pos)) == NULL
+                || (s = lpP_getnum(s, e, 10, ':', &n)) == NULL
+                || n > (uint64_t)(e - s) || w->limit == 0)
+            return luaL_error(L, "invalid cursor");
+        if (name) lpP_setname(L, w, name, namelen);
+        if (lpW_in(L, w) < 0) return lua_error(L);
+        if (w->follow && fstat(lpP_walkfd(w), &buf) == 0
+                && lpP_addid(L, &w->visited, buf.st_dev, buf.st_ino)) {
+            lp_FileId *id = &vec_rawend(w->levels)[-1].vid;
+            id->dev = buf.st_dev, id->ino = buf.st_ino;
+        }
+        name = s, namelen = (size_t)n;
+        if (w->sort)
+            lpP_skipsorted(L, w, name, namelen);
+        else if (!lpP_seeklevel(vec_rawend(w->levels) - 1, pos))
+            return lp_pusherror(L, "resume", lp_walkpath(L, w)), lua_error(L);
+    }
+    if (name == NULL) /* root only */
+        return state == 'n' ? 0 : -1;
+    lpP_setname(L, w, name, namelen);
+    w->state = state == 'n' ? LP_WALKIN : LP_WALKFILE;
+    return 0;
+}
+
+/* thread safe directory reader, without Lua state */
+
+typedef struct lp_DirReader {
+#ifdef LP_GETDENTS
+    int       fd;
+    char     *buf; /* owned by caller */
+    unsigned  size, pos, end;
+#else
+    DIR      *dir;
+#endif
+} lp_DirReader;
+
+static int lpP_openreader(lp_DirReader *r, int dirfd, const char *s, int flags) {
+    int fd = openat(dirfd, *s ? s : LP_CURDIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC|flags);
+    if (fd < 0) return 0;
+#ifdef LP_GETDENTS
+    r->fd = fd, r->pos = r->end = 0;
+#else
+    if ((r->dir = fdopendir(fd)) == NULL) return close(fd), 0;
+#endif
+    return 1;
+}
+
+static void lpP_closereader(lp_DirReader *r) {
+#ifdef LP_GETDENTS
+    close(r->fd);
+#else
+    closedir(r->dir);
+#endif
+}
+
+static lp_Dirent64 *lpP_nextentry(lp_DirReader *r) {
+    lp_Dirent64 *ent;
+    do {
+#ifdef LP_GETDENTS
+        if (r->pos >= r->end) {
+            long n = syscall(SYS_getdents64, r->fd, r->buf, r->size);
+            if (n <= 0) return NULL;
+            r->pos = 0, r->end = (unsigned)n;
+        }
+        ent = (lp_Dirent64*)(r->buf + r->pos);
+        r->pos += ent->d_reclen;
+#else
+        if ((ent = readdir(r->dir)) == NULL) return NULL;
+#endif
+    } while (lpP_issys(ent->d_name));
+    return ent;
+}
+
+static int lpP_readerfd(lp_DirReader *r) {
+#ifdef LP_GETDENTS
+    return r->fd;
+#else
+    return dirfd(r->dir);
+#endif
+}
+
+static int lpP_entryisdir(lp_DirReader *r, lp_Dirent64 *ent) {
+    struct stat buf;
+#ifdef LP_DTYPE
+    if (ent->d_type != DT_UNKNOWN) return ent->d_type == DT_DIR;
+#endif
+    return fstatat(lpP_readerfd(r), ent->d_name, &buf, AT_SYMLINK_NOFOLLOW) == 0
+        && S_ISDIR(buf.st_mode);
+}
+
+/* metadata cache */
+
+#define LP_CACHE_MAX 65536
+
+static double lpP_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+typedef struct lp_CacheEntry {
+    size_t      hash, len;
+    double      time[2]; /* by lpP_clock(), of stat() and lstat() */
+    int         err[2];  /* errno of them, -1 for not called yet */
+    struct stat st[2];
+    char        path[1];
+} lp_CacheEntry;
+
+struct lp_Cache {
+    lp_CacheEntry **slots;
+    size_t   mask, count, max;
+    double   ttl;        /* seconds, 0 for forever */
+    uint64_t hits, misses;
+    char    *cwd;        /* entries are keyed by absolute paths */
+    char    *key;        /* buffer of lpP_cachekey() */
+    dev_t    cwddev;     /* of 'cwd', checked before using it */
+    ino_t    cwdino;
+};
+
+static size_t lpP_hashpath(const char *s, size_t len) {
+    size_t h = (size_t)2166136261u;
+    while (len--) h = (h ^ (unsigned char)*s++) * (size_t)16777619u;
+    return h;
+}
+
+static void lpP_clearcache(struct lp_Cache *C) {
+    size_t i;
+    for (i = 0; C->slots && i <= C->mask; ++i) free(C->slots[i]);
+    free(C->slots), C->slots = NULL, C->mask = C->count = 0;
+}
+
+static void lp_freecache(lp_State *S) {
+    if (S->cache == NULL) return;
+    lpP_clearcache(S->cache);
+    vec_free(S->cache->cwd), vec_free(S->cache->key);
+    free(S->cache), S->cache = NULL;
+}
+
+static void lpP_cachecwd(lua_State *L, struct lp_Cache *C) {
+    struct stat st;
+    vec_reset(C->cwd); /* keeps relative keys if getcwd() fails */
+    C->cwddev = 0, C->cwdino = 0;
+    if (getcwd(vec_grow(L, C->cwd, PATH_MAX), PATH_MAX) == NULL) return;
+    vec_rawlen(C->cwd) = (unsigned)strlen(C->cwd);
+    if (stat(C->cwd, &st) == 0) C->cwddev = st.st_dev, C->cwdino = st.st_ino;
+}
+
+static const char *lpP_cachekey(lua_State *L, struct lp_Cache *C,
+        const char *s, size_t *plen) {
+    /* the absolute form of normalized 's', leading ".." pop 'cwd' */
+    struct stat st;
+    size_t len;
+    if (lp_isdirsep(*s)) return *plen = strlen(s), s;
+    if (stat(LP_CURDIR, &st) == 0
+            && (st.st_dev != C->cwddev || st.st_ino != C->cwdino))
+        lpP_cachecwd(L, C); /* changed not by fs.chdir(), e.g. by C code */
+    if ((len = vec_len(C->cwd)) == 0) return *plen = strlen(s), s;
+    while (s[0] == '.' && s[1] == '.' && (s[2] == '\0' || lp_isdirsep(s[2]))) {
+        while (len > 1 && !lp_isdirsep(C->cwd[len-1])) --len;
+        if (len > 1) --len;
+        s += s[2] ? 3 : 2;
+    }
+    if (s[0] == '.' && s[1] == '\0') ++s;
+    vec_reset(C->key);
+    vec_extend(L, C->key, C->cwd, len);
+    if (*s && !lp_isdirsep(C->cwd[len-1])) vec_push(L, C->key, LP_DIRSEP[0]);
+    vec_concat(L, C->key, s);
+    C->key[*plen = vec_len(C->key)] = '\0';
+    return C->key;
+}
+
+static lp_CacheEntry **lpP_findslot(struct lp_Cache *C, const char *s,
+        size_t len, size_t h) {
+    size_t i;
+    for (i = h & C->mask; C->slots[i]; i = (i+1) & C->mask) {
+        lp_CacheEntry *e = C->slots[i];
+        if (e->hash == h && e->len == len && memcmp(e->path, s, len) == 0)
+            break;
+    }
+    return &C->slots[i];
+}
+
+static int lpP_rehash(struct lp_Cache *C, size_t cap) {
+    lp_CacheEntry **slots = (lp_CacheEntry**)calloc(cap, sizeof(lp_CacheEntry*));
+    size_t i, j;
+    if (slots == NULL) return 0;
+    for (i = 0; C->slots && i <= C->mask; ++i) {
+        lp_CacheEntry *e = C->slots[i];
+        if (e == NULL) continue;
+        for (j = e->hash & (cap-1); slots[j]; j = (j+1) & (cap-1))
+            ;
+        slots[j] = e;
+    }
+    free(C->slots), C->slots = slots, C->mask = cap - 1;
+    return 1;
+}
+
+static lp_CacheEntry *lpP_cacheentry(lua_State *L, struct lp_Cache *C,
+        const char *s, size_t len) {
+    size_t h = lpP_hashpath(s, len);
+    lp_CacheEntry **pe, *e;
+    if (C->slots && *(pe = lpP_findslot(C, s, len, h)) != NULL) return *pe;
+    if (C->count >= C->max) lpP_clearcache(C); /* simply starts over */
+    if ((C->slots == NULL || C->count >= (C->mask >> 1) + (C->mask >> 2))
+            && !lpP_rehash(C, C->slots ? (C->mask + 1) << 1 : 256))
+        luaL_error(L, "out of memory");
+    if ((e = (lp_CacheEntry*)malloc(sizeof(lp_CacheEntry) + len)) == NULL)
+        luaL_error(L, "out of memory");
+    e->hash = h, e->len = len, e->err[0] = e->err[1] = -1;
+    memcpy(e->path, s, len), e->path[len] = '\0';
+    *lpP_findslot(C, s, len, h) = e, ++C->count;
+    return e;
+}
+
+static int lpP_stat(lp_State *S, const char *s, int link, struct stat *st) {
+    struct lp_Cache *C = S->cache;
+    lp_CacheEntry *e;
+    double now = 0;
+    const char *key;
+    size_t len;
+    if (C == NULL) return link ? lstat(s, st) : stat(s, st);
+    key = lpP_cachekey(S->L, C, s, &len);
+    e = lpP_cacheentry(S->L, C, key, len);
+    if (C->ttl > 0) now = lpP_clock();
+    if (e->err[link] < 0 || (C->ttl > 0 && now - e->time[link] > C->ttl)) {
+        int r = link ? lstat(s, &e->st[link]) : stat(s, &e->st[link]);
+        e->err[link] = r < 0 ? errno : 0, e->time[link] = now;
+        ++C->misses;
+    } else
+        ++C->hits;
+    if (e->err[link] != 0) return errno = e->err[link], -1;
+    return *st = e->st[link], 0;
+}
+
+static void lpP_uncache(struct lp_Cache *C, const char *s, size_t len) {
+    size_t i = lpP_findslot(C, s, len, lpP_hashpath(s, len)) - C->slots, j;
+    if (C->slots[i] == NULL) return;
+    free(C->slots[i]), C->slots[i] = NULL, --C->count;
+    for (j = (i+1) & C->mask; C->slots[j]; j = (j+1) & C->mask) {
+        size_t k = C->slots[j]->hash & C->mask; /* shift back to 'i' */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        C->slots[i] = C->slots[j], C->slots[j] = NULL, i = j;
+    }
+}
+
+static size_t lpP_uncachetree(struct lp_Cache *C, const char *s, size_t len) {
+    size_t i, n = 0;
+    if (len && lp_isdirsep(s[len-1])) --len;
+    for (i = 0; i <= C->mask; ++i) {
+        lp_CacheEntry *e = C->slots[i];
+        if (e && e->len >= len && memcmp(e->path, s, len) == 0
+                && (e->len == len || lp_isdirsep(e->path[len]) || len == 0))
+            free(e), C->slots[i] = NULL, --C->count, ++n;
+    }
+    if (n) lpP_rehash(C, C->mask + 1);
+    return n;
+}
+
+static void lp_cacheinval(lp_State *S, const char *s, int tree) {
+    /* 's' and its parent are changed, or all items in 's' if 'tree' */
+    struct lp_Cache *C = S->cache;
+    size_t len;
+    if (C == NULL || C->slots == NULL) return;
+    s = lpP_cachekey(S->L, C, s, &len);
+    if (tree) lpP_uncachetree(C, s, len); else lpP_uncache(C, s, len);
+    while (len && lp_isdirsep(s[len-1])) --len;
+    while (len && !lp_isdirsep(s[len-1])) --len;
+    while (len > 1 && lp_isdirsep(s[len-1])) --len;
+    if (len) lpP_uncache(C, s, len);
+    else lpP_uncache(C, LP_CURDIR, 1), lpP_uncache(C, "", 0);
+}
+
+static void lp_cacheinvalraw(lua_State *L, const char *s, int tree) {
+    lp_State *S = lp_getstate(L); /* 's' is not normalized */
+    if (S->cache == NULL) return;
+    lp_joinparts(L, s, &S->p);
+    lp_cacheinval(S, lp_applyparts(L, &S->buf, &S->p), tree);
+}
+
+static int lpL_cacheenable(lua_State *L) {
+    lp_State *S = lp_getstate(L);
+    int opts = lua_istable(L, 1) ? 1 : 0;
+    if (S->cache == NULL) {
+        S->cache = (struct lp_Cache*)calloc(1, sizeof(struct lp_Cache));
+        if (S->cache == NULL) return luaL_error(L, "out of memory");
+        lpP_cachecwd(L, S->cache);
+    }
+    S->cache->max = LP_CACHE_MAX, S->cache->ttl = 0;
+    if (opts) {
+        lua_getfield(L, opts, "max");
+        if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 1)
+            S->cache->max = (size_t)lua_tonumber(L, -1);
+        lua_getfield(L, opts, "ttl");
+    } else
+        lua_pushvalue(L, 1);
+    S->cache->ttl = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+    return lp_bool(L, 1);
+}
+
+static int lpL_cachedisable(lua_State *L)
+{ return lp_freecache(lp_getstate(L)), 0; }
+
+static int lpL_cacheinvalidate(lua_State *L) {
+    lp_State *S = lp_getstate(L);
+    size_t n = 0;
+    if (S->cache == NULL) return lua_pushinteger(L, 0), 1;
+    if (lua_isnoneornil(L, 1))
+        n = S->cache->count, lpP_clearcache(S->cache);
+    else if (S->cache->slots) {
+        const char *key;
+        size_t len;
+        lp_joinarg(L, 1, &S->p);
+        lp_applyparts(L, &S->buf, &S->p);
+        key = lpP_cachekey(L, S->cache, S->buf, &len);
+        n = lpP_uncachetree(S->cache, key, len);
+    }
+    return lua_pushinteger(L, (lua_Integer)n), 1;
+}
+
+static int lpL_cachestats(lua_State *L) {
+    struct lp_Cache *C = lp_getstate(L)->cache;
+    lua_createtable(L, 0, 4);
+    lua_pushboolean(L, C != NULL);
+    lua_setfield(L, -2, "enabled");
+    lua_pushinteger(L, C ? (lua_Integer)C->hits : 0);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, C ? (lua_Integer)C->misses : 0);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, C ? (lua_Integer)C->count : 0);
+    lua_setfield(L, -2, "entries");
+    return 1;
+}
+
+/* dir operations */
+
+static int lpL_getcwd(lua_State *L) {
+    lp_State *S = lp_getstate(L);
+    char *ret = vec_grow(L, S->buf, PATH_MAX);
+    ret = getcwd(ret, PATH_MAX);
+    if (ret == NULL) return -lp_pusherror(L, "getcwd", NULL);
+    lua_pushstring(L, ret);
+    return 1;
+}
+
+static int lpL_binpath(lua_State *L) {
+#if defined(__APPLE__) && !defined(TARGET_OS_OSX)
+    lua_pushnil(L);
+    lua_pushstring(L, "binpath not supoort on iOS");
+    return 2;
+#else
+    lp_State *S = lp_getstate(L);
+#ifdef __APPLE__
+    char *ret = vec_grow(L, S->buf, PROC_PIDPATHINFO_MAXSIZE);
+    int r = proc_pidpath(getpid(), ret, PROC_PIDPATHINFO_MAXSIZE);
+    if (r < 0) return -lp_pusherror(L, "binpath", NULL);
+#else
+    char *ret = vec_grow(L, S->buf, PATH_MAX);
+    int r = readlink("/proc/self/exe", ret, PATH_MAX);
+    if (r < 0) return -lp_pusherror(L, "binpath", NULL);
+#endif
+    return lua_pushstring(L, ret), 1;
+#endif
+}
+
+static int lp_abs(lp_State *S, const char *s) {
+    lua_State *L = S->L;
     lua_pushstring(L, s);
     if (!lp_isdirsep(*s)) {
         size_t len;
@@ -1284,16 +2569,33 @@ static int lp_abs(lp_State *S, const char *s) {
     return 1;
 }
 
-static int lp_chdir(lp_State *S, const char *s)
-{ return chdir(s) ? lp_pusherror(S->L, "chdir", s) : 0; }
+static const char *lp_absbuf(lp_State *S, const char *cwd, const char *s) {
+    /* as lp_abs() into 'S->buf', with 'cwd' got once */
+    size_t len = strlen(cwd);
+    vec_reset(S->buf);
+    if (!lp_isdirsep(*s)) {
+        vec_extend(S->L, S->buf, cwd, len);
+        if (len == 0 || !lp_isdirsep(cwd[len-1]))
+            vec_concat(S->L, S->buf, LP_DIRSEP);
+    }
+    vec_concat(S->L, S->buf, s);
+    *vec_grow(S->L, S->buf, 1) = 0;
+    return S->buf;
+}
+
+static int lp_chdir(lp_State *S, const char *s) {
+    if (chdir(s)) return lp_pusherror(S->L, "chdir", s);
+    if (S->cache) lpP_clearcache(S->cache), lpP_cachecwd(S->L, S->cache);
+    return 0;
+}
 
 static int lp_mkdir(lp_State *S, const char *s) {
-    int r = mkdir(s, 0777);
+    int r = (lp_cacheinval(S, s, 0), mkdir(s, 0777));
     return (r != 0 && errno != EEXIST) ? lp_pusherror(S->L, "mkdir", s) : 0;
 }
 
 static int lp_rmdir(lp_State *S, const char *s)
-{ return rmdir(s) ? lp_pusherror(S->L, "rmdir", s) : 0; }
+{ return lp_cacheinval(S, s, 0), rmdir(s) ? lp_pusherror(S->L, "rmdir", s) : 0; }
 
 static int lp_makedirs(lp_State *S, char *s) {
     lp_Part drive;
@@ -1303,6 +2605,7 @@ static int lp_makedirs(lp_State *S, char *s) {
         int r;
         while (i < len && !lp_isdirsep(s[i])) ++i;
         s[i] = 0;
+        lp_cacheinval(S, s, 0);
         r = (mkdir(s, 0777) != 0);
         if (r && errno != EEXIST) return lp_pusherror(S->L, "makedirs", s);
         if (i != len) s[i] = LP_DIRSEP[0];
@@ -1311,25 +2614,35 @@ static int lp_makedirs(lp_State *S, char *s) {
 }
 
 static int lp_removedirs(lp_State *S, lp_Walker *w, int *pcount, void *ud) {
+    int fd = lpP_walkfd(w);
     (void)ud;
     if (w->state == LP_WALKFILE) {
-        int r = remove(w->buf) == 0;
-        return ++*pcount, r ? 0 : lp_pusherror(S->L, "remove", w->buf);
+        int r = unlinkat(fd, lpP_walkname(w), 0) == 0;
+        return ++*pcount, r ? 0 :
+            lp_pusherror(S->L, "remove", lp_walkpath(S->L, w));
     }
+    if (w->state == LP_WALKDIR && w->prune.xdev && !lpP_samedev(w))
+        return 0; /* never touch mount points */
     if (w->state == LP_WALKDIR || w->state == LP_WALKOUT) {
-        int r = rmdir(w->buf) == 0;
-        return ++*pcount, r ? 0 : lp_pusherror(S->L, "rmdir", w->buf);
+        if (unlinkat(fd, lpP_walkname(w), AT_REMOVEDIR) == 0)
+            return ++*pcount, 0;
+        if (w->state == LP_WALKOUT && w->pruned
+                && (errno == ENOTEMPTY || errno == EEXIST))
+            return 0; /* keeps pruned files */
+        return lp_pusherror(S->L, "rmdir", lp_walkpath(S->L, w));
     }
     return 0;
 }
 
 static int lp_unlockdirs(lp_State *S, lp_Walker *w, int *pcount, void *ud) {
     struct stat buf;
+    int fd = lpP_walkfd(w);
     (void)ud;
     if (w->state == LP_WALKFILE) {
-        int r = stat(w->buf, &buf) == 0
-            && chmod(w->buf, buf.st_mode | S_IWUSR) == 0;
-        return ++*pcount, r ? 0 : lp_pusherror(S->L, "unlock", w->buf);
+        int r = fstatat(fd, lpP_walkname(w), &buf, 0) == 0
+            && fchmodat(fd, lpP_walkname(w), buf.st_mode | S_IWUSR, 0) == 0;
+        return ++*pcount, r ? 0 :
+            lp_pusherror(S->L, "unlock", lp_walkpath(S->L, w));
     }
     return 0;
 }
@@ -1351,21 +2664,37 @@ static int lpL_tmpdir(lua_State* L) {
 /* file operations */
 
 static int lp_remove(lp_State *S, const char *s)
-{ return remove(s) ? lp_pusherror(S->L, "remove", s) : 0; }
+{ return lp_cacheinval(S, s, 0), remove(s) ? lp_pusherror(S->L, "remove", s) : 0; }
 
 static int lp_exists(lp_State *S, const char *s)
-{ struct stat buf; return lp_bool(S->L, stat(s, &buf) == 0); }
+{ struct stat buf; return lp_bool(S->L, lpP_stat(S, s, 0, &buf) == 0); }
 
 static int lp_size(lp_State *S, const char *s) {
     struct stat buf;
-    return stat(s, &buf) == 0 ? (lua_pushinteger(S->L, buf.st_size), 1) :
+    return lpP_stat(S, s, 0, &buf) == 0 ? (lua_pushinteger(S->L, buf.st_size), 1) :
         lp_pusherror(S->L, "size", s);
 }
 
+static int lpP_readfile(lp_State *S, const char *s) {
+    int fd = open(s, O_RDONLY|O_CLOEXEC);
+    ssize_t n;
+    if (fd < 0) return errno == ENOENT ? 0 : lp_pusherror(S->L, "open", s);
+    vec_reset(S->buf);
+    while ((n = read(fd, vec_grow(S->L, S->buf, BUFSIZ), BUFSIZ)) > 0)
+        vec_rawlen(S->buf) += (unsigned)n;
+    if (n < 0) {
+        int err = errno;
+        close(fd), errno = err;
+        return lp_pusherror(S->L, "read", s);
+    }
+    return close(fd), 0;
+}
+
 static int lpL_touch(lua_State *L) {
-    const char *s = luaL_checkstring(L, 1);
+    const char *s = lp_checkpath(L, 1, NULL);
     struct utimbuf utb, *buf;
-    int fh = open(s, O_WRONLY|O_CREAT, 0644), err = errno;
+    int fh = (lp_cacheinvalraw(L, s, 0), open(s, O_WRONLY|O_CREAT, 0644));
+    int err = errno;
     if (fh >= 0) close(fh);
     else if (err!=EISDIR) return errno=err, -lp_pusherror(L, "touch", s);
     if (lua_gettop(L) == 1) /* set to current date/time */
@@ -1379,21 +2708,24 @@ static int lpL_touch(lua_State *L) {
 }
 
 static int lpL_rename(lua_State *L) {
-    const char *from = luaL_checkstring(L, 1);
-    const char *to = luaL_checkstring(L, 2);
+    const char *from = lp_checkpath(L, 1, NULL);
+    const char *to = lp_checkpath(L, 2, NULL);
+    lp_cacheinvalraw(L, from, 1), lp_cacheinvalraw(L, to, 1);
     return rename(from, to) == 0 ? lp_bool(L, 1) :
         -lp_pusherror(L, "rename", to);
 }
 
 static int lpL_copy(lua_State *L) {
     lp_State *S = lp_getstate(L);
-    const char *from = luaL_checkstring(L, 1);
-    const char *to = luaL_checkstring(L, 2);
+    const char *from = lp_checkpath(L, 1, NULL);
+    const char *to = lp_checkpath(L, 2, NULL);
     int excl = lua_toboolean(L, 3);
     lua_Integer mode = luaL_optinteger(L, 4, 0644);
-    char *buf = vec_grow(L, S->buf, BUFSIZ);
+    char *buf;
     size_t size;
     int dest, source = open(from, O_RDONLY, 0);
+    lp_cacheinvalraw(L, to, 0);
+    buf = vec_grow(L, S->buf, BUFSIZ);
     if (source < 0) return -lp_pusherror(L, "open", from);
     dest = open(to, O_WRONLY|O_CREAT|(excl ? O_EXCL : O_TRUNC), mode);
     if (dest < 0) return -lp_pusherror(L, "open", to);
@@ -1406,8 +2738,9 @@ static int lpL_copy(lua_State *L) {
 }
 
 static int lpL_symlink(lua_State *L) {
-    const char *from = luaL_checkstring(L, 1);
-    const char *to = luaL_checkstring(L, 2);
+    const char *from = lp_checkpath(L, 1, NULL);
+    const char *to = lp_checkpath(L, 2, NULL);
+    lp_cacheinvalraw(L, to, 0);
     return symlink(from, to) == 0 ? lp_bool(L, 1) :
         -lp_pusherror(L, "symlink", to);
 }
@@ -1421,10 +2754,10 @@ static int lp_realpath(lp_State *S, const char *s) {
         lp_pusherror(S->L, "realpath", s);
 }
 
-#define lpP_isattr(CHECK)                              do { \
-    struct stat buf;                                        \
-    return lstat(s, &buf) == 0 && CHECK(buf.st_mode) ? 0 :  \
-        lp_bool(S->L, 0);                                 } while (0)
+#define lpP_isattr(CHECK)                                    do { \
+    struct stat buf;                                              \
+    return lpP_stat(S, s, 1, &buf) == 0 && CHECK(buf.st_mode) ? 0 : \
+        lp_bool(S->L, 0);                                       } while (0)
 
 static int lp_islink(lp_State *S, const char *s) { lpP_isattr(S_ISLNK); }
 static int lp_isdir(lp_State *S, const char *s)  { lpP_isattr(S_ISDIR); }
@@ -1446,15 +2779,265 @@ static int lp_ismount(lp_State *S, const char *s) {
         lp_bool(S->L, 0);
 }
 
-#define lp_time(L, time) do {                                    \
-    struct stat buf;                                             \
-    if (lstat(s, &buf) < 0) return lp_pusherror(S->L, #time, s); \
+#define lp_time(L, time) do {                                            \
+    struct stat buf;                                                     \
+    if (lpP_stat(S, s, 1, &buf) < 0) return lp_pusherror(S->L, #time, s); \
     return lua_pushinteger(S->L, buf.st_##time), 1; } while (0)
 
 static int lp_ctime(lp_State *S, const char *s) { lp_time(L, ctime); }
 static int lp_mtime(lp_State *S, const char *s) { lp_time(L, mtime); }
 static int lp_atime(lp_State *S, const char *s) { lp_time(L, atime); }
 
+/* dir entry */
+
+typedef struct lp_DirEntry {
+    LP_ENTRY_PUBLIC;
+    unsigned    level, id; /* parent level, 0 for cwd */
+    mode_t      type;      /* S_IFMT bits from d_type, 0 for unknown */
+    ino_t       ino;       /* d_ino, 0 for unknown */
+    int         follow;    /* stat the target of symbolic links */
+    struct stat st;
+} lp_DirEntry;
+
+static void lpP_initentry(lp_Walker *w, lp_DirEntry *e) {
+    unsigned len = vec_len(w->levels);
+    e->level = len, e->id = len ? w->levels[len-1].id : 0;
+    e->type = 0, e->ino = 0, e->follow = w->follow;
+    if (w->ent == NULL) return; /* root or 'out' */
+    e->ino = (ino_t)w->ent->d_ino;
+#if defined(LP_DTYPE) && defined(DTTOIF)
+    e->type = DTTOIF(w->ent->d_type) & S_IFMT;
+#endif
+    if (e->follow && e->type == S_IFLNK) e->type = 0, e->ino = 0;
+}
+
+static int lpE_stat(lua_State *L, lp_DirEntry *e) {
+    lp_Walker *w = e->ref ? e->ref->w : NULL;
+    int r, flags = e->follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    (void)L;
+    if (e->stated) return e->stated > 0;
+    if (w && e->level && e->level <= vec_len(w->levels)
+            && w->levels[e->level-1].id == e->id)
+        r = fstatat(lpP_levelfd(&w->levels[e->level-1]),
+                e->path + e->namepos, &e->st, flags);
+    else /* parent closed, use the whole path */
+        r = fstatat(AT_FDCWD, e->path, &e->st, flags);
+    if (r < 0 && flags == 0 && errno == ENOENT) /* dangling link */
+        e->follow = 0, e->stated = 0, r = lpE_stat(L, e) ? 0 : -1;
+    e->stated = r == 0 ? 1 : -errno;
+    if (r == 0) e->type = e->st.st_mode & S_IFMT, e->ino = e->st.st_ino;
+    return r == 0;
+}
+
+static const char *lpE_type(lua_State *L, lp_DirEntry *e) {
+    if (e->type == 0 && !lpE_stat(L, e)) return NULL;
+    switch (e->type) {
+    case S_IFDIR:  return "dir";
+    case S_IFREG:  return "file";
+    case S_IFLNK:  return "link";
+    case S_IFIFO:  return "fifo";
+    case S_IFSOCK: return "socket";
+    case S_IFCHR:  return "char";
+    case S_IFBLK:  return "block";
+    }
+    return "unknown";
+}
+
+static int lpE_pushfield(lua_State *L, lp_DirEntry *e, int field) {
+    if (field == 'i' && e->ino)
+        return lua_pushinteger(L, (lua_Integer)e->ino), 1;
+    if (!lpE_stat(L, e))
+        return errno = -e->stated, -lp_pusherror(L, "stat", e->path);
+    switch (field) {
+    case 'i': return lua_pushinteger(L, (lua_Integer)e->st.st_ino), 1;
+    case 's': return lua_pushinteger(L, (lua_Integer)e->st.st_size), 1;
+    case 'o': return lua_pushinteger(L, (lua_Integer)e->st.st_mode), 1;
+    case 'c': return lua_pushinteger(L, (lua_Integer)e->st.st_ctime), 1;
+    case 'a': return lua_pushinteger(L, (lua_Integer)e->st.st_atime), 1;
+    default:  return lua_pushinteger(L, (lua_Integer)e->st.st_mtime), 1;
+    }
+}
+
+/* bulk stat */
+
+#define LP_DEFAULT_DEPTH 32
+#define LP_MAX_DEPTH     4096
+
+static void lpP_statsync(lua_State *L, lp_DirEntry **es, int n) {
+    int i;
+    for (i = 0; i < n; ++i) lpE_stat(L, es[i]);
+}
+
+#ifdef LP_URING
+
+typedef struct lp_Ring {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sqtail, *sqmask, *sqarray;
+    unsigned            *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq, *cq;
+    size_t               sqsize, cqsize, sqesize;
+} lp_Ring;
+
+typedef struct lp_RingSlot {
+    struct statx  sx;
+    lp_DirEntry  *e;
+} lp_RingSlot;
+
+static void lpP_closering(lp_Ring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqesize);
+    if (r->cq && r->cq != MAP_FAILED) munmap(r->cq, r->cqsize);
+    if (r->sq && r->sq != MAP_FAILED) munmap(r->sq, r->sqsize);
+    if (r->fd >= 0) close(r->fd);
+}
+
+static int lpP_openring(lp_Ring *r, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+    memset(r, 0, sizeof(lp_Ring)), memset(&p, 0, sizeof(p));
+    if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return 0; /* ENOSYS, or forbidden by seccomp */
+    r->entries = p.sq_entries;
+    r->sqsize  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqsize  = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq = mmap(NULL, r->sqsize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq = mmap(NULL, r->cqsize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqesize,
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+            IORING_OFF_SQES);
+    if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED)
+        return lpP_closering(r), 0;
+    sq = (char*)r->sq, cq = (char*)r->cq;
+    r->sqtail  = (unsigned*)(sq + p.sq_off.tail);
+    r->sqmask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)(sq + p.sq_off.array);
+    r->cqhead  = (unsigned*)(cq + p.cq_off.head);
+    r->cqtail  = (unsigned*)(cq + p.cq_off.tail);
+    r->cqmask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+static void lpP_fromstatx(struct stat *st, const struct statx *sx) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev     = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino     = (ino_t)sx->stx_ino;
+    st->st_mode    = (mode_t)sx->stx_mode;
+    st->st_nlink   = (nlink_t)sx->stx_nlink;
+    st->st_uid     = (uid_t)sx->stx_uid;
+    st->st_gid     = (gid_t)sx->stx_gid;
+    st->st_rdev    = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size    = (off_t)sx->stx_size;
+    st->st_blksize = (blksize_t)sx->stx_blksize;
+    st->st_blocks  = (blkcnt_t)sx->stx_blocks;
+    st->st_atime   = (time_t)sx->stx_atime.tv_sec;
+    st->st_mtime   = (time_t)sx->stx_mtime.tv_sec;
+    st->st_ctime   = (time_t)sx->stx_ctime.tv_sec;
+}
+
+static void lpP_statdone(lua_State *L, lp_RingSlot *slot, int res) {
+    lp_DirEntry *e = slot->e;
+    if (res == -EINVAL || res == -EOPNOTSUPP) /* no IORING_OP_STATX */
+        lpE_stat(L, e);
+    else if (res < 0 && e->follow && res == -ENOENT)
+        lpE_stat(L, e); /* maybe a dangling link */
+    else if (res < 0)
+        e->stated = res;
+    else {
+        lpP_fromstatx(&e->st, &slot->sx);
+        e->type = e->st.st_mode & S_IFMT, e->ino = e->st.st_ino;
+        e->stated = 1;
+    }
+}
+
+static int lpP_enterring(lp_Ring *r, unsigned submit, unsigned wait) {
+    int ret;
+    do ret = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static int lpP_reapring(lua_State *L, lp_Ring *r, lp_RingSlot *slots,
+        int *freelist, int *nfree) {
+    unsigned head = *r->cqhead;
+    int reaped = 0;
+    while (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head++ & *r->cqmask];
+        int id = (int)cqe->user_data;
+        lpP_statdone(L, &slots[id], cqe->res);
+        freelist[(*nfree)++] = id, ++reaped;
+    }
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+static int lpP_staturing(lua_State *L, lp_DirEntry **es, int n, int depth) {
+    lp_RingSlot *slots = (lp_RingSlot*)lua_newuserdata(L,
+            (size_t)depth * sizeof(lp_RingSlot));
+    int *freelist = (int*)lua_newuserdata(L, (size_t)depth * sizeof(int));
+    int i, next = 0, nfree = depth, inflight = 0, queued = 0, ret = 0;
+    lp_Ring r;
+    if (!lpP_openring(&r, (unsigned)depth)) return lua_pop(L, 2), 0;
+    for (i = 0; i < depth; ++i) freelist[i] = depth - 1 - i;
+    while (next < n || queued > 0 || inflight > 0) {
+        unsigned tail = *r.sqtail, submit = 0;
+        while (next < n && nfree > 0 && queued + submit < r.entries) {
+            int id = freelist[--nfree];
+            unsigned idx = (tail + submit++) & *r.sqmask;
+            struct io_uring_sqe *sqe = &r.sqes[idx];
+            lp_RingSlot *slot = &slots[id];
+            slot->e = es[next++];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode      = IORING_OP_STATX;
+            sqe->fd          = AT_FDCWD;
+            sqe->addr        = (uint64_t)(uintptr_t)slot->e->path;
+            sqe->len         = STATX_BASIC_STATS;
+            sqe->off         = (uint64_t)(uintptr_t)&slot->sx;
+            sqe->statx_flags = slot->e->follow ? 0 : AT_SYMLINK_NOFOLLOW;
+            sqe->user_data   = (uint64_t)id;
+            r.sqarray[idx] = idx;
+        }
+        __atomic_store_n(r.sqtail, tail + submit, __ATOMIC_RELEASE);
+        queued += (int)submit; /* the kernel may take only some of them */
+        if ((ret = lpP_enterring(&r, (unsigned)queued, 1)) < 0) break;
+        queued -= ret, inflight += ret;
+        if (queued > 0 && (inflight == 0 || lpP_enterring(&r, 0, 1) < 0)) {
+            ret = -1; /* partial submit: wait for room, or give up if idle */
+            break;
+        }
+        inflight -= lpP_reapring(L, &r, slots, freelist, &nfree);
+    }
+    while (inflight > 0) { /* 'slots' are written until reaped */
+        if (lpP_enterring(&r, 0, 1) < 0) { /* never freed then */
+            lua_pushvalue(L, -2), luaL_ref(L, LUA_REGISTRYINDEX);
+            break;
+        }
+        inflight -= lpP_reapring(L, &r, slots, freelist, &nfree);
+    }
+    lpP_closering(&r), lua_pop(L, 2);
+    if (ret < 0) lpP_statsync(L, es, n); /* finish the rest synchronously */
+    return 1;
+}
+
+#endif /* LP_URING */
+
+static void lpP_statentries(lua_State *L, lp_DirEntry **es, int n, int follow, int depth) {
+    int i;
+    for (i = 0; i < n; ++i) es[i]->follow = follow;
+#ifdef LP_URING
+    if (depth > 1 && n > 1 && lpP_staturing(L, es, n, depth)) return;
+#else
+    (void)depth;
+#endif
+    lpP_statsync(L, es, n);
+}
+
 /* utils */
 
 static int lpL_uname(lua_State *L) {
@@ -1538,11 +3121,328 @@ static int lpL_expandvars(lua_State *L) {
 
 /* dir iterations */
 
+static int lp_optinteger(lua_State *L, int idx, const char *k, int def) {
+    int isint, v;
+    if (idx == 0) return def;
+    lua_getfield(L, idx, k);
+    v = (int)lua_tointegerx(L, -1, &isint);
+    lua_pop(L, 1);
+    return isint ? v : def;
+}
+
+static int lp_walkargs(lua_State *L, int *popts, int *plimit) {
+    int isint = 0, top = lua_gettop(L);
+    *popts = top > 0 && lua_istable(L, top) ? top-- : 0;
+    if (plimit == NULL) return top;
+    *plimit = top > 0 ? (int)lua_tointegerx(L, top, &isint) : 0;
+    *plimit = lp_optinteger(L, *popts, "limit", *plimit);
+    return top - isint;
+}
+
+/* prune rules */
+
+static int  lp_fnmatch(lp_Part s, lp_Part p);
+static void lp_fncompile(lp_FnMatch *m, lp_Part p);
+static int  lp_fnexec(const lp_FnMatch *m, lp_Part s);
+static int  lp_filtered(lua_State *L, lp_Walker *w);
+static void lp_filteropts(lua_State *L, int opts, lp_Walker *w);
+
+static void lp_addrule(lua_State *L, lp_Prune *p, const char *s, size_t len, unsigned flags) {
+    lp_Rule r;
+    if (!(flags & LP_RULE_NAME)) { /* syntax of .gitignore */
+        while (len && (s[len-1] == ' ' || s[len-1] == '\t' || s[len-1] == '\r'))
+            --len;
+        if (len == 0 || *s == '#') return;
+        if (*s == '!') flags |= LP_RULE_NEGATE, ++s, --len;
+        else if (*s == '\\' && len > 1) ++s, --len; /* "\#", "\!" */
+        if (len && lp_isdirsep(s[len-1])) flags |= LP_RULE_DIRONLY, --len;
+        while (len && lp_isdirsep(*s)) flags |= LP_RULE_PATH, ++s, --len;
+        if (len == 0) return;
+        if (memchr(s, '/', len) || memchr(s, LP_DIRSEP[0], len))
+            flags |= LP_RULE_PATH;
+    }
+    r.pos = vec_len(p->text), r.len = (unsigned)len, r.flags = flags;
+    vec_extend(L, p->text, s, len);
+    vec_push(L, p->rules, r);
+}
+
+static void lp_addrules(lua_State *L, lp_Prune *p, const char *s, size_t len) {
+    const char *e = s + len;
+    while (s < e) { /* one pattern per line */
+        const char *nl = (const char*)memchr(s, '\n', e - s);
+        size_t n = (nl ? nl : e) - s;
+        lp_addrule(L, p, s, n, 0);
+        s += n + 1;
+    }
+}
+
+static void lp_optrules(lua_State *L, int opts, const char *k, lp_Prune *p) {
+    int i, n;
+    lua_getfield(L, opts, k);
+    if (lua_type(L, -1) == LUA_TSTRING) { /* a string for a list of one */
+        lua_createtable(L, 1, 0);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 1);
+    }
+    for (i = 1, n = lua_istable(L, -1) ? (int)lua_rawlen(L, -1) : 0; i <= n; ++i) {
+        size_t len;
+        const char *s;
+        lua_rawgeti(L, -1, i);
+        if ((s = lua_tolstring(L, -1, &len)) == NULL)
+            luaL_error(L, "string expected in option '%s'", k);
+        if (k[0] == 'e')
+            lp_addrule(L, p, s, len, LP_RULE_NAME);
+        else if (k[6] == '\0')
+            lp_addrules(L, p, s, len);
+        else {
+            lp_State *S = lp_getstate(L);
+            if (lpP_readfile(S, s) < 0) lua_error(L);
+            lp_addrules(L, p, S->buf, vec_len(S->buf));
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static void lp_pruneopts(lua_State *L, int opts, lp_Prune *p) {
+    unsigned i, n;
+    lua_getfield(L, opts, "xdev");
+    p->xdev = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lp_optrules(L, opts, "exclude", p);
+    lp_optrules(L, opts, "ignore", p);
+    lp_optrules(L, opts, "ignorefile", p);
+    if ((n = vec_len(p->rules)) == 0) return;
+    vec_rawgrow(L, p->fms, n), vec_rawlen(p->fms) = n;
+    for (i = 0; i < n; ++i) { /* 'text' is complete now */
+        lp_Rule *r = &p->rules[i];
+        if (!(r->flags & (LP_RULE_NAME|LP_RULE_PATH)))
+            lp_fncompile(&p->fms[i], lp_part(p->text + r->pos, r->len));
+    }
+}
+
+static int lp_matchrule(lp_Part s, lp_Part p) {
+    for (;;) { /* match parts of path, '**' matches any count of parts */
+        const char *ps = p.s, *ss = s.s;
+        while (p.s < p.e && !lp_isdirsep(*p.s)) ++p.s;
+        if (p.s - ps == 2 && ps[0] == '*' && ps[1] == '*') {
+            if (p.s == p.e) return 1;
+            for (++p.s;; ++s.s) {
+                if (lp_matchrule(s, p)) return 1;
+                while (s.s < s.e && !lp_isdirsep(*s.s)) ++s.s;
+                if (s.s == s.e) return 0;
+            }
+        }
+        while (s.s < s.e && !lp_isdirsep(*s.s)) ++s.s;
+        if (!lp_fnmatch(lp_part(ss, s.s - ss), lp_part(ps, p.s - ps)))
+            return 0;
+        if (p.s == p.e || s.s == s.e) return p.s == p.e && s.s == s.e;
+        ++p.s, ++s.s;
+    }
+}
+
+/* 'rel' is the path relative to the root, computed from 'w' if missing */
+static int lp_prunematch(lua_State *L, lp_Walker *w, lp_Prune *p,
+        lp_Part name, lp_Part rel, int isdir) {
+    unsigned i = vec_len(p->rules);
+    while (i-- > 0) {
+        lp_Rule *r = &p->rules[i];
+        lp_Part pat = lp_part(p->text + r->pos, r->len);
+        int m;
+        if ((r->flags & LP_RULE_DIRONLY) && !isdir) continue;
+        if (r->flags & LP_RULE_NAME)
+            m = lp_len(name) == r->len && memcmp(name.s, pat.s, r->len) == 0;
+        else if (!(r->flags & LP_RULE_PATH))
+            m = lp_fnexec(&p->fms[i], name);
+        else {
+            if (rel.s == NULL) { /* path relative to the root */
+                const char *s = lp_walkpath(L, w);
+                rel = lp_part(s + w->levels[0].pos, strlen(s) - w->levels[0].pos);
+            }
+            m = lp_matchrule(rel, pat);
+        }
+        if (m) return !(r->flags & LP_RULE_NEGATE);
+    }
+    return 0;
+}
+
+static int lp_pruned(lua_State *L, lp_Walker *w, int isdir) {
+    lp_Part rel = {NULL, NULL};
+    return lp_prunematch(L, w, &w->prune,
+            lp_part(w->name, w->namelen), rel, isdir);
+}
+
+static int lp_prunenext(lua_State *L, lp_Walker *w) {
+    int s = w->state;
+    if (vec_len(w->levels) == 0 || (s != LP_WALKIN && s != LP_WALKFILE
+                && s != LP_WALKDIR)) return s;
+    if (w->prune.rules && lp_pruned(L, w, s != LP_WALKFILE))
+        return vec_rawend(w->levels)[-1].pruned = 1, w->state = LP_WALKSYS;
+    if (w->prune.xdev && s == LP_WALKIN && !lpP_samedev(w))
+        vec_rawend(w->levels)[-1].pruned = 1, s = w->state = LP_WALKDIR;
+    if ((w->follow || w->unique) && !lpP_firstvisit(L, w))
+        return w->state = (s == LP_WALKIN ? LP_WALKDIR : LP_WALKSYS);
+    return s;
+}
+
+static void lp_walkopts(lua_State *L, int opts, lp_Walker *w) {
+    int entry;
+    if (opts == 0) return;
+    lp_pruneopts(L, opts, &w->prune);
+    w->bufsize = (unsigned)lp_optinteger(L, opts, "bufsize", 0);
+    lua_getfield(L, opts, "sorted");
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        const char *s = lua_tostring(L, -1);
+        if (strcmp(s, "natural") == 0) w->sort = 'n';
+        else if (strcmp(s, "bytes") == 0) w->sort = 'b';
+        else luaL_error(L, "invalid sort order '%s'", s);
+    } else if (lua_toboolean(L, -1))
+        w->sort = 'b';
+    lua_pop(L, 1);
+    lua_getfield(L, opts, "follow");
+    w->follow = lua_toboolean(L, -1);
+    lua_getfield(L, opts, "unique");
+    w->unique = lua_toboolean(L, -1);
+    lua_getfield(L, opts, "entry");
+    entry = lua_toboolean(L, -1);
+    lua_pop(L, 3);
+    if (entry) {
+        if ((w->ref = (lp_WalkRef*)malloc(sizeof(lp_WalkRef))) == NULL)
+            luaL_error(L, "out of memory");
+        w->ref->w = w, w->ref->refs = 1;
+    }
+}
+
+static lp_DirEntry *lpE_check(lua_State *L)
+{ return (lp_DirEntry*)luaL_checkudata(L, 1, LP_ENTRY_TYPE); }
+
+static int lpE_is(lua_State *L, const char *type) {
+    const char *t = lpE_type(L, lpE_check(L));
+    return lp_bool(L, t != NULL && strcmp(t, type) == 0);
+}
+
+static int lpL_entrygc(lua_State *L) {
+    lp_DirEntry *e = lpE_check(L);
+    lp_unref(e->ref), e->ref = NULL;
+    return 0;
+}
+
+static int lpL_entrypath(lua_State *L) {
+    lp_DirEntry *e = lpE_check(L);
+    return lua_pushlstring(L, e->path, e->len), 1;
+}
+
+static int lpL_entryname(lua_State *L) {
+    lp_DirEntry *e = lpE_check(L);
+    if (e->namepos == e->len) return lpL_entrypath(L);
+    return lua_pushlstring(L, e->path+e->namepos, e->len-e->namepos), 1;
+}
+
+static int lpL_entrytype(lua_State *L) {
+    lp_DirEntry *e = lpE_check(L);
+    const char *t = lpE_type(L, e);
+    return t ? (lua_pushstring(L, t), 1) : lpE_pushfield(L, e, 'o');
+}
+
+static int lpL_entryisdir(lua_State *L)  { return lpE_is(L, "dir");  }
+static int lpL_entryisfile(lua_State *L) { return lpE_is(L, "file"); }
+static int lpL_entryislink(lua_State *L) { return lpE_is(L, "link"); }
+
+static int lpL_entryino(lua_State *L)  { return lpE_pushfield(L, lpE_check(L), 'i'); }
+static int lpL_entrysize(lua_State *L) { return lpE_pushfield(L, lpE_check(L), 's'); }
+static int lpL_entrymode(lua_State *L) { return lpE_pushfield(L, lpE_check(L), 'o'); }
+static int lpL_entryctime(lua_State *L){ return lpE_pushfield(L, lpE_check(L), 'c'); }
+static int lpL_entrymtime(lua_State *L){ return lpE_pushfield(L, lpE_check(L), 'm'); }
+static int lpL_entryatime(lua_State *L){ return lpE_pushfield(L, lpE_check(L), 'a'); }
+
+static void lp_entrymeta(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(n) { #n, lpL_entry##n }
+        ENTRY(path),
+        ENTRY(name),
+        ENTRY(type),
+        ENTRY(isdir),
+        ENTRY(isfile),
+        ENTRY(islink),
+        ENTRY(ino),
+        ENTRY(size),
+        ENTRY(mode),
+        ENTRY(ctime),
+        ENTRY(mtime),
+        ENTRY(atime),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (!luaL_newmetatable(L, LP_ENTRY_TYPE)) return;
+    luaL_newlib(L, libs);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lpL_entrypath);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, lpL_entrygc);
+    lua_setfield(L, -2, "__gc");
+}
+
+static lp_DirEntry *lp_newentry(lua_State *L, const char *s, size_t len) {
+    lp_DirEntry *e = (lp_DirEntry*)lua_newuserdata(L, sizeof(lp_DirEntry)+len+1);
+    size_t pos = len;
+    memset(e, 0, sizeof(lp_DirEntry));
+    e->path = (const char*)memcpy((char*)(e + 1), s, len + 1);
+    while (pos > 0 && !lp_isdirsep(s[pos-1])) --pos;
+    e->len = len, e->namepos = pos;
+    lp_entrymeta(L);
+    lua_setmetatable(L, -2);
+    return e;
+}
+
+static int lp_pushentry(lua_State *L, lp_Walker *w) {
+    const char *s = lp_walkpath(L, w);
+    lp_DirEntry *e;
+    s = *s ? s : LP_CURDIR;
+    e = lp_newentry(L, s, strlen(s));
+    lpP_initentry(w, e);
+    e->ref = w->ref, ++w->ref->refs;
+    return 1;
+}
+
+static int lpL_stats(lua_State *L) {
+    int i, n, follow, depth, uring;
+    lp_DirEntry **es;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int)lua_rawlen(L, 1);
+    follow = lua_istable(L, 2) && (lua_getfield(L, 2, "follow"),
+            lua_toboolean(L, -1));
+    uring = !lua_istable(L, 2) || (lua_getfield(L, 2, "uring"),
+            lua_isnil(L, -1) || lua_toboolean(L, -1));
+    depth = lp_optinteger(L, lua_istable(L, 2) ? 2 : 0, "depth",
+            LP_DEFAULT_DEPTH);
+    depth = !uring || depth < 1 ? 1 : depth > LP_MAX_DEPTH ? LP_MAX_DEPTH : depth;
+    lua_settop(L, 2);
+    es = (lp_DirEntry**)lua_newuserdata(L, (n ? n : 1) * sizeof(lp_DirEntry*));
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; ++i) {
+        size_t len;
+        const char *s;
+        lua_rawgeti(L, 1, i + 1);
+        s = lp_checkitem(L, i + 1, &len);
+        es[i] = lp_newentry(L, *s ? s : LP_CURDIR, *s ? len : strlen(LP_CURDIR));
+        lua_rawseti(L, -3, i + 1);
+        lua_pop(L, 1);
+    }
+    lpP_statentries(L, es, n, follow, depth);
+    return 1;
+}
+
 typedef struct lp_ScanDir {
     lp_Walker w;
     int       inout;
+    int       batch;    /* results per iteration, 0 for one by one */
+    int       done;     /* walked all, nothing to checkpoint */
+    int       left;     /* 'max_entries' left, <0 for unlimited */
+    double    deadline; /* by lpP_clock(), 0 for none */
 } lp_ScanDir;
 
+typedef int lp_IterNext(lua_State *L, void *ud);
+
 static int lp_walknext(lua_State *L, lp_Walker *w) {
     if (w->state == LP_WALKINIT) return lpW_init(L, w);
     for (;;) {
@@ -1552,8 +3452,9 @@ static int lp_walknext(lua_State *L, lp_Walker *w) {
         switch (w->state = lpW_file(L, w)) {
         case LP_WALKOUT: if ((r = lpW_out(L, w)) < 0) return r; break;
         case LP_WALKSYS: continue; /* '.' or '..' */
-        default: break;
+        default: if (lp_prunenext(L, w) == LP_WALKSYS) continue; break;
         }
+        if (w->prune.filter && lp_filtered(L, w)) continue;
         return w->state;
     }
 }
@@ -1566,277 +3467,2804 @@ static int lpL_dirclose(lua_State *L) {
 
 static int lp_pushdirresult(lua_State* L, lp_Walker* w) {
     const char *states[] = {"init", "in", "file", "out", "dir"};
-    lua_pushstring(L, vec_len(w->buf) ? w->buf : LP_CURDIR);
+    const char *s;
+    if (w->ref) lp_pushentry(L, w);
+    else lua_pushstring(L, *(s = lp_walkpath(L, w)) ? s : LP_CURDIR);
     lua_pushstring(L, states[w->state]);
     return 2;
 }
 
-static int lpL_diriter(lua_State *L) {
-    lp_ScanDir *ds = (lp_ScanDir*)luaL_checkudata(L, 1, LP_WALKER_TYPE);
-    for (;;) {
-        int ret = lp_walknext(L, &ds->w);
-        if (ret < 0) lua_error(L);
-        if (ret == 0) return 0;
-        if (ds->inout || (ret != LP_WALKIN && ret != LP_WALKOUT))
-            return lp_pushdirresult(L, &ds->w);
+static int lp_pushbatch(lua_State *L, int batch, lp_Walker *w, lp_IterNext *f, void *ud) {
+    int i, r, n = 0, len;
+    lua_getuservalue(L, 1);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    len = (int)lua_rawlen(L, -2);
+    while (n < batch && (r = f(L, ud)) != 0) {
+        if (r < 0) return lua_error(L);
+        lp_pushdirresult(L, w);
+        lua_rawseti(L, -3, ++n);
+        lua_rawseti(L, -3, n);
+    }
+    for (i = n + 1; i <= len; ++i) {
+        lua_pushnil(L), lua_rawseti(L, -3, i);
+        lua_pushnil(L), lua_rawseti(L, -2, i);
+    }
+    return n ? (lua_pushinteger(L, n), 3) : 0;
+}
+
+static void lp_batchopts(lua_State *L, int opts, int *pbatch) {
+    /* the userdata of iterator is on the top of stack */
+    if ((*pbatch = lp_optinteger(L, opts, "batch", 0)) <= 0)
+        return (void)(*pbatch = 0);
+    lua_createtable(L, 2, 0);
+    lua_getfield(L, opts, "paths");
+    if (!lua_istable(L, -1)) lua_pop(L, 1), lua_createtable(L, *pbatch, 0);
+    lua_rawseti(L, -2, 1);
+    lua_getfield(L, opts, "states");
+    if (!lua_istable(L, -1)) lua_pop(L, 1), lua_createtable(L, *pbatch, 0);
+    lua_rawseti(L, -2, 2);
+    lua_setuservalue(L, -2);
+}
+
+static int lp_dirnext(lua_State *L, void *ud) {
+    lp_ScanDir *ds = (lp_ScanDir*)ud;
+    for (;;) {
+        int ret;
+        if (ds->done || ds->left == 0
+                || (ds->deadline > 0 && lpP_clock() >= ds->deadline))
+            return 0; /* budget runs out, see checkpoint() */
+        if ((ret = lp_walknext(L, &ds->w)) <= 0)
+            return ds->done = (ret == 0), ret;
+        if (ds->inout || (ret != LP_WALKIN && ret != LP_WALKOUT))
+            return ds->left -= (ds->left > 0), ret;
+    }
+}
+
+static int lpL_diriter(lua_State *L) {
+    lp_ScanDir *ds = (lp_ScanDir*)luaL_checkudata(L, 1, LP_WALKER_TYPE);
+    int ret;
+    if (ds->batch) return lp_pushbatch(L, ds->batch, &ds->w, lp_dirnext, ds);
+    if ((ret = lp_dirnext(L, ds)) < 0) return lua_error(L);
+    return ret ? lp_pushdirresult(L, &ds->w) : 0;
+}
+
+static int lpL_dircheckpoint(lua_State *L) {
+    lp_ScanDir *ds = (lp_ScanDir*)luaL_checkudata(L, 1, LP_WALKER_TYPE);
+    if (ds->w.buf == NULL) return luaL_error(L, "walker is closed");
+    return ds->done ? 0 : lpP_checkpoint(L, &ds->w);
+}
+
+static void lp_budgetopts(lua_State *L, int opts, lp_ScanDir *ds) {
+    size_t len;
+    const char *s;
+    ds->done = 0, ds->deadline = 0;
+    ds->left = lp_optinteger(L, opts, "max_entries", -1);
+    if (opts == 0) return;
+    lua_getfield(L, opts, "deadline");
+    if (lua_isnumber(L, -1))
+        ds->deadline = lpP_clock() + lua_tonumber(L, -1);
+    lua_getfield(L, opts, "resume");
+    if ((s = lua_tolstring(L, -1, &len)) != NULL)
+        ds->done = lpP_resume(L, &ds->w, s, len) < 0;
+    lua_pop(L, 2);
+}
+
+static void lp_walkermeta(lua_State *L) {
+    if (luaL_newmetatable(L, LP_WALKER_TYPE)) {
+        lua_pushcfunction(L, lpL_dirclose);
+        lua_pushvalue(L, -1); lua_setfield(L, -3, "__gc");
+        lua_setfield(L, -2, "__close");
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, lpL_dircheckpoint);
+        lua_setfield(L, -2, "checkpoint");
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+}
+
+static int lp_pushdir(lp_State *S, lp_ScanDir *ds, int limit, int opts) {
+    lua_State *L = S->L;
+    if (vec_len(S->p.parts) > 1)
+        lp_applyparts(L, &S->buf, &S->p);
+    else
+        *vec_grow(L, S->buf, 1) = 0;
+    lp_initwalker(S, &ds->w, S->buf, limit);
+    lp_walkermeta(L);
+    S->buf = NULL, lp_resetpath(&S->p);
+    lp_walkopts(L, opts, &ds->w);
+    lp_filteropts(L, opts, &ds->w);
+    lp_budgetopts(L, opts, ds);
+    lua_pushcfunction(L, lpL_diriter);
+    lua_pushvalue(L, -2);
+    lua_pushnil(L);
+    lua_pushvalue(L, -2);
+    return 4;
+}
+
+static int lpL_dir(lua_State *L) {
+    int opts, top = lp_walkargs(L, &opts, NULL);
+    lp_State *S = lp_joinargs(L, 1, top);
+    lp_ScanDir *ds = lua_newuserdata(L, sizeof(lp_ScanDir));
+    ds->inout = 0;
+    lp_batchopts(L, opts, &ds->batch);
+    return lp_pushdir(S, ds, 1, opts);
+}
+
+static int lpL_scandir(lua_State *L) {
+    int opts, limit, top = lp_walkargs(L, &opts, &limit);
+    lp_State *S = lp_joinargs(L, 1, top);
+    lp_ScanDir *ds = lua_newuserdata(L, sizeof(lp_ScanDir));
+    ds->inout = 1;
+    lp_batchopts(L, opts, &ds->batch);
+    return lp_pushdir(S, ds, limit ? limit : -1, opts);
+}
+
+/* parallel scandir */
+
+#ifndef _WIN32
+#include <pthread.h>
+
+#define LP_PSCAN_TYPE    "lpath.PScanDir"
+#define LP_PCHUNK_SIZE   (16*1024)
+#define LP_PQUEUE_SIZE   64
+#define LP_MAX_THREADS   64
+
+enum lp_PState { LP_PIN = 'i', LP_PFILE = 'f', LP_POUT = 'o', LP_PDIR = 'd',
+                 LP_PERROR = 'e' };
+
+typedef struct lp_PChunk {
+    struct lp_PChunk *next;
+    size_t len, cap;
+    char   data[1]; /* list of [state][path]'\0' */
+} lp_PChunk;
+
+typedef struct lp_PJob {
+    struct lp_PJob *parent, *next; /* 'next' links children not queued yet */
+    unsigned left;  /* itself and its unfinished children, by 'ps->lock' */
+    int      in;    /* "in" reported, so "out" is due */
+    int      limit;
+    int      depth; /* for du */
+    unsigned tree;  /* for du, index of the subtree to sum into */
+    size_t   len;
+    char     path[1];
+} lp_PJob;
+
+typedef struct lp_PDeque {
+    pthread_mutex_t lock;
+    lp_PJob **jobs;
+    size_t    head, tail, cap; /* owner uses tail, thieves use head */
+    size_t    lim;             /* thieves only take jobs below it */
+} lp_PDeque;
+
+typedef struct lp_PScan lp_PScan;
+typedef struct lp_Du    lp_Du;
+
+typedef struct lp_PWorker {
+    lp_PScan  *ps;
+    pthread_t  thread;
+    lp_PDeque  deque;
+    lp_PChunk *chunk;   /* results not published yet */
+    char      *dents;   /* private read buffer */
+    char      *path;    /* private path buffer */
+    size_t     pathcap;
+    lp_PJob   *later;   /* finished, parents are told once published */
+    unsigned   id;
+    int        stopped; /* private copy of 'ps->stop' */
+    int        nomem;
+} lp_PWorker;
+
+struct lp_PScan {
+    pthread_mutex_t lock; /* protects all fields below except 'cur' */
+    pthread_cond_t  hasjob, hasresult, hasroom;
+    lp_PChunk  *first, *last;    /* published results */
+    unsigned    queued, maxqueue;
+    unsigned    pending, jobseq; /* jobs not finished, jobs stealable */
+    unsigned    nworkers, nthreads, running, idle;
+    int         stop, grouped;
+    unsigned    bufsize;
+    lp_PWorker *workers;
+    lp_PChunk  *cur;             /* chunk read by Lua */
+    size_t      pos;
+    lp_Du      *du;              /* sums sizes instead of yielding paths */
+};
+
+static int lpP_pushjob(lp_PDeque *d, lp_PJob *job, int stealable) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->jobs, d->jobs + d->head,
+                    (d->tail - d->head) * sizeof(lp_PJob*));
+            d->tail -= d->head, d->lim -= d->head, d->head = 0;
+        } else {
+            size_t cap = d->cap ? d->cap * 2 : 64;
+            lp_PJob **jobs = (lp_PJob**)realloc(d->jobs, cap*sizeof(lp_PJob*));
+            if (jobs == NULL) return pthread_mutex_unlock(&d->lock), 0;
+            d->jobs = jobs, d->cap = cap;
+        }
+    }
+    d->jobs[d->tail++] = job;
+    if (stealable) d->lim = d->tail;
+    return pthread_mutex_unlock(&d->lock), 1;
+}
+
+static lp_PJob *lpP_popjob(lp_PDeque *d, int steal) {
+    lp_PJob *job = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < (steal ? d->lim : d->tail))
+        job = steal ? d->jobs[d->head++] : d->jobs[--d->tail];
+    if (d->lim > d->tail) d->lim = d->tail;
+    if (d->head == d->tail) d->head = d->tail = d->lim = 0;
+    return pthread_mutex_unlock(&d->lock), job;
+}
+
+static lp_PJob *lpP_newjob(const char *s, size_t len, int limit) {
+    lp_PJob *job = (lp_PJob*)malloc(sizeof(lp_PJob) + len);
+    if (job == NULL) return NULL;
+    job->parent = job->next = NULL, job->left = 1, job->in = 0;
+    job->limit = limit, job->depth = 0, job->tree = 0, job->len = len;
+    memcpy(job->path, s, len), job->path[len] = '\0';
+    return job;
+}
+
+static void lpP_finish(lp_PWorker *w, lp_PJob *job);
+
+static void lpP_publish(lp_PWorker *w) {
+    /* publishes the results, then lets others take the children queued,
+     * and tells the parents of finished jobs, their "out" follows these */
+    lp_PScan *ps = w->ps;
+    lp_PChunk *c = w->chunk;
+    lp_PJob *job, *done = NULL;
+    if (c != NULL && c->len != 0) w->chunk = NULL, c->next = NULL;
+    else c = NULL;
+    pthread_mutex_lock(&ps->lock);
+    while (c && ps->queued >= ps->maxqueue && !ps->stop)
+        pthread_cond_wait(&ps->hasroom, &ps->lock);
+    if (c && (w->stopped = ps->stop)) free(c);
+    else if (c) {
+        if (ps->last) ps->last->next = c; else ps->first = c;
+        ps->last = c, ps->queued += 1;
+        pthread_cond_signal(&ps->hasresult);
+    }
+    pthread_mutex_lock(&w->deque.lock);
+    if (w->deque.lim < w->deque.tail) {
+        w->deque.lim = w->deque.tail, ps->jobseq += 1;
+        pthread_cond_broadcast(&ps->hasjob);
+    }
+    pthread_mutex_unlock(&w->deque.lock);
+    while ((job = w->later) != NULL) {
+        lp_PJob *parent = job->parent;
+        w->later = job->next, free(job);
+        if (parent && --parent->left == 0) parent->next = done, done = parent;
+    }
+    pthread_mutex_unlock(&ps->lock);
+    while ((job = done) != NULL)
+        done = job->next, lpP_finish(w, job);
+}
+
+static void lpP_stop(lp_PScan *ps) {
+    pthread_mutex_lock(&ps->lock);
+    ps->stop = 1;
+    pthread_cond_broadcast(&ps->hasjob);
+    pthread_cond_broadcast(&ps->hasroom);
+    pthread_cond_broadcast(&ps->hasresult);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+static int lpP_emit(lp_PWorker *w, int state, const char *s, size_t len) {
+    lp_PChunk *c = w->chunk;
+    if (c && !w->ps->grouped && c->len + len + 2 > c->cap)
+        lpP_publish(w), c = w->chunk; /* may have new "out"s */
+    if (c == NULL || c->len + len + 2 > c->cap) {
+        size_t cap = c ? c->cap : LP_PCHUNK_SIZE;
+        while (cap < (c ? c->len : 0) + len + 2) cap *= 2;
+        c = (lp_PChunk*)realloc(c, sizeof(lp_PChunk) + cap);
+        if (c == NULL) return 0;
+        if (w->chunk == NULL) c->len = 0;
+        w->chunk = c, c->cap = cap;
+    }
+    c->data[c->len++] = (char)state;
+    memcpy(c->data + c->len, s, len), c->len += len;
+    c->data[c->len++] = '\0';
+    return 1;
+}
+
+static int lpP_emiterror(lp_PWorker *w, const char *title, const char *s) {
+    char msg[1024];
+    int len = snprintf(msg, sizeof(msg), "%s:%s:(errno=%d): %s",
+            title, s, errno, strerror(errno));
+    if (len >= (int)sizeof(msg)) len = (int)sizeof(msg) - 1;
+    return lpP_emit(w, LP_PERROR, msg, (size_t)len);
+}
+
+static char *lpP_childpath(lp_PWorker *w, lp_PJob *job, const char *name) {
+    size_t len = strlen(name), need = job->len + len + 2;
+    char *p = w->path;
+    int sep = job->len && !lp_isdirsep(job->path[job->len-1]);
+    if (w->pathcap < need) {
+        if ((p = (char*)realloc(w->path, need)) == NULL) return NULL;
+        w->path = p, w->pathcap = need;
+    }
+    memcpy(p, job->path, job->len);
+    if (sep) p[job->len] = LP_DIRSEP[0];
+    memcpy(p + job->len + sep, name, len + 1);
+    return p;
+}
+
+static int lpP_scanjob(lp_PWorker *w, lp_PJob *job) {
+    lp_PScan *ps = w->ps;
+    lp_PJob *kids = NULL, *child;
+    lp_DirReader r;
+    lp_Dirent64 *ent;
+    int ok = 1, idle;
+#ifdef LP_GETDENTS
+    r.buf = w->dents, r.size = ps->bufsize;
+#endif
+    if (!lpP_openreader(&r, AT_FDCWD, job->path, O_NOFOLLOW))
+        return lpP_emiterror(w, "walkin", job->path);
+    ok = job->in = lpP_emit(w, LP_PIN, job->path, job->len);
+    while (ok && !w->stopped && (ent = lpP_nextentry(&r)) != NULL) {
+        char *s = lpP_childpath(w, job, ent->d_name);
+        size_t len = s ? job->len + strlen(s + job->len) : 0;
+        int isdir;
+        if (s == NULL) { ok = 0; break; }
+        isdir = lpP_entryisdir(&r, ent);
+        if (isdir && job->limit != 1) {
+            child = lpP_newjob(s, len,
+                    job->limit < 0 ? job->limit : job->limit - 1);
+            if (child == NULL) { ok = 0; break; }
+            child->parent = job, child->next = kids, kids = child;
+        } else
+            ok = lpP_emit(w, isdir ? LP_PDIR : LP_PFILE, s, len);
+    }
+    lpP_closereader(&r);
+    pthread_mutex_lock(&ps->lock);
+    while ((child = kids) != NULL) { /* others can take them once published */
+        kids = child->next;
+        if (!ok || !lpP_pushjob(&w->deque, child, 0)) free(child), ok = 0;
+        else job->left += 1, ps->pending += 1;
+    }
+    idle = ps->idle != 0;
+    pthread_mutex_unlock(&ps->lock);
+    if (ok && (ps->grouped || idle)) lpP_publish(w);
+    return ok;
+}
+
+static void lpP_finish(lp_PWorker *w, lp_PJob *job) {
+    /* all items under the job are reported */
+    if (job->in && !w->stopped && !w->nomem)
+        w->nomem = !lpP_emit(w, LP_POUT, job->path, job->len);
+    job->next = w->later, w->later = job;
+}
+
+static void lpP_leave(lp_PWorker *w, lp_PJob *job) {
+    /* children finished after their results are published, so the last
+     * one reports the "out" after all items under the folder */
+    lp_PScan *ps = w->ps;
+    int done;
+    pthread_mutex_lock(&ps->lock);
+    done = --job->left == 0;
+    pthread_mutex_unlock(&ps->lock);
+    if (done) lpP_finish(w, job);
+}
+
+static void lpP_dropjob(lp_PJob *job) {
+    /* frees a job not run, after all threads are joined */
+    while (job != NULL && --job->left == 0) {
+        lp_PJob *parent = job->parent;
+        free(job), job = parent;
+    }
+}
+
+/* disk usage */
+
+typedef struct lp_DuSum {
+    uint64_t bytes, blocks; /* apparent size, and allocated bytes */
+    uint64_t files, dirs;
+} lp_DuSum;
+
+typedef struct lp_DuTree {
+    lp_DuSum sum;
+    unsigned parent;
+    char    *path;
+} lp_DuTree;
+
+typedef struct lp_DuExt {
+    char     ext[32]; /* with the dot, "" for none or too long */
+    uint64_t bytes, files;
+} lp_DuExt;
+
+typedef struct lp_DuExts { /* per worker, no lock needed */
+    lp_DuExt *slots;
+    size_t    mask, count;
+} lp_DuExts;
+
+struct lp_Du {
+    pthread_mutex_t idlock;
+    lp_IdSet   ids;         /* hard linked files seen, by 'idlock' */
+    lp_DuTree *trees;       /* folders to report, by 'ps->lock' */
+    unsigned   ntrees, treecap;
+    uint64_t   errors;      /* by 'ps->lock' */
+    lp_DuExts *exts;        /* NULL if not wanted */
+    unsigned   nexts;
+    int        depth, xdev;
+    dev_t      dev;
+};
+
+static void lpP_dusum(lp_DuSum *d, const lp_DuSum *s) {
+    d->bytes += s->bytes, d->blocks += s->blocks;
+    d->files += s->files, d->dirs += s->dirs;
+}
+
+static int lpP_duext(lp_DuExts *t, const char *name, uint64_t size) {
+    size_t i, len = strlen(name);
+    const char *ext = lp_splitext(lp_part(name, len));
+    size_t elen = (size_t)(name + len - ext);
+    uint32_t h = 2166136261u;
+    if (elen >= sizeof(t->slots->ext)) ext += elen, elen = 0;
+    for (i = 0; i < elen; ++i) h = (h ^ (unsigned char)ext[i]) * 16777619u;
+    if (t->slots == NULL || t->count >= (t->mask >> 1)) {
+        size_t j, cap = t->slots ? (t->mask + 1) << 1 : 64;
+        lp_DuExt *slots = (lp_DuExt*)calloc(cap, sizeof(lp_DuExt));
+        if (slots == NULL) return 0;
+        for (j = 0; t->slots && j <= t->mask; ++j) {
+            lp_DuExt *e = &t->slots[j];
+            uint32_t eh = 2166136261u;
+            const char *p;
+            if (e->files == 0) continue;
+            for (p = e->ext; *p; ++p) eh = (eh ^ (unsigned char)*p) * 16777619u;
+            for (i = eh & (cap-1); slots[i].files; i = (i+1) & (cap-1))
+                ;
+            slots[i] = *e;
+        }
+        free(t->slots), t->slots = slots, t->mask = cap - 1;
+    }
+    for (i = h & t->mask; t->slots[i].files; i = (i+1) & t->mask)
+        if (strlen(t->slots[i].ext) == elen
+                && memcmp(t->slots[i].ext, ext, elen) == 0)
+            break;
+    if (t->slots[i].files == 0)
+        memcpy(t->slots[i].ext, ext, elen), t->slots[i].ext[elen] = 0, ++t->count;
+    t->slots[i].bytes += size, t->slots[i].files += 1;
+    return 1;
+}
+
+static int lpP_dupush(lp_PWorker *w, lp_PJob *job, const char *name) {
+    lp_PScan *ps = w->ps;
+    lp_Du *du = ps->du;
+    char *s = lpP_childpath(w, job, name);
+    lp_PJob *child = s ? lpP_newjob(s, strlen(s), -1) : NULL;
+    int ok = child != NULL;
+    if (!ok) return 0;
+    child->depth = job->depth + 1, child->tree = job->tree;
+    pthread_mutex_lock(&ps->lock);
+    if (child->depth <= du->depth) { /* a subtree to report */
+        lp_DuTree *t = du->trees;
+        if (du->ntrees == du->treecap) {
+            unsigned cap = du->treecap * 2;
+            if ((t = (lp_DuTree*)realloc(t, cap * sizeof(lp_DuTree))) != NULL)
+                du->trees = t, du->treecap = cap;
+        }
+        if (t == NULL || (s = strdup(child->path)) == NULL) ok = 0;
+        else {
+            t = &du->trees[child->tree = du->ntrees++];
+            memset(&t->sum, 0, sizeof(lp_DuSum));
+            t->parent = job->tree, t->path = s;
+        }
+    }
+    if (!ok || !lpP_pushjob(&w->deque, child, 1))
+        free(child), ok = 0;
+    else {
+        ps->pending += 1, ps->jobseq += 1;
+        pthread_cond_signal(&ps->hasjob);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return ok;
+}
+
+static int lpP_dulink(lp_Du *du, const struct stat *st) {
+    int r;
+    if (st->st_nlink <= 1) return 1;
+    pthread_mutex_lock(&du->idlock);
+    r = lpP_addid(NULL, &du->ids, st->st_dev, st->st_ino);
+    pthread_mutex_unlock(&du->idlock);
+    return r;
+}
+
+static int lpP_dujob(lp_PWorker *w, lp_PJob *job) {
+    lp_PScan *ps = w->ps;
+    lp_Du *du = ps->du;
+    lp_DuSum sum = { 0, 0, 0, 0 };
+    uint64_t errors = 0;
+    lp_DirReader r;
+    lp_Dirent64 *ent;
+    struct stat st;
+    int ok = 1, fd;
+#ifdef LP_GETDENTS
+    r.buf = w->dents, r.size = ps->bufsize;
+#endif
+    if (!lpP_openreader(&r, AT_FDCWD, job->path, O_NOFOLLOW))
+        errors = 1;
+    else if (fstat(fd = lpP_readerfd(&r), &st) < 0)
+        errors = 1, lpP_closereader(&r);
+    else if (du->xdev && st.st_dev != du->dev)
+        lpP_closereader(&r);
+    else {
+        sum.dirs = 1, sum.bytes = (uint64_t)st.st_size;
+        sum.blocks = (uint64_t)st.st_blocks * 512;
+        while (ok && !w->stopped && (ent = lpP_nextentry(&r)) != NULL) {
+            int first;
+            if (lpP_entryisdir(&r, ent)) {
+                ok = lpP_dupush(w, job, ent->d_name);
+                continue;
+            }
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                ++errors;
+                continue;
+            }
+            if ((first = lpP_dulink(du, &st)) <= 0) { /* counted already */
+                ok = first == 0;
+                continue;
+            }
+            sum.files += 1, sum.bytes += (uint64_t)st.st_size;
+            sum.blocks += (uint64_t)st.st_blocks * 512;
+            if (du->exts)
+                ok = lpP_duext(&du->exts[w->id], ent->d_name,
+                        (uint64_t)st.st_size);
+        }
+        lpP_closereader(&r);
+    }
+    pthread_mutex_lock(&ps->lock);
+    lpP_dusum(&du->trees[job->tree].sum, &sum);
+    du->errors += errors;
+    pthread_mutex_unlock(&ps->lock);
+    return ok;
+}
+
+static lp_PJob *lpP_findjob(lp_PWorker *w) {
+    lp_PScan *ps = w->ps;
+    for (;;) {
+        unsigned i, seq;
+        lp_PJob *job = lpP_popjob(&w->deque, 0);
+        if (job) return job;
+        pthread_mutex_lock(&ps->lock);
+        seq = ps->jobseq;
+        pthread_mutex_unlock(&ps->lock);
+        for (i = 1; i < ps->nworkers; ++i) {
+            lp_PWorker *victim = &ps->workers[(w->id + i) % ps->nworkers];
+            if ((job = lpP_popjob(&victim->deque, 1)) != NULL) return job;
+        }
+        do lpP_publish(w); /* flush results before sleeping */
+        while (w->later && !w->nomem);
+        pthread_mutex_lock(&ps->lock);
+        if (ps->stop || ps->pending == 0 || w->nomem)
+            return pthread_mutex_unlock(&ps->lock), NULL;
+        if (seq == ps->jobseq) {
+            ps->idle += 1;
+            pthread_cond_wait(&ps->hasjob, &ps->lock);
+            ps->idle -= 1;
+        }
+        pthread_mutex_unlock(&ps->lock);
+    }
+}
+
+static void *lpP_worker(void *ud) {
+    lp_PWorker *w = (lp_PWorker*)ud;
+    lp_PScan *ps = w->ps;
+    lp_PJob *job;
+    while (!w->nomem && (job = lpP_findjob(w)) != NULL) {
+        int ok = ps->du ? lpP_dujob(w, job) : lpP_scanjob(w, job);
+        if (ps->du) free(job);
+        else lpP_leave(w, job);
+        if (!ok) w->nomem = 1;
+        pthread_mutex_lock(&ps->lock);
+        if (--ps->pending == 0) pthread_cond_broadcast(&ps->hasjob);
+        pthread_mutex_unlock(&ps->lock);
+    }
+    if (w->nomem) lpP_emit(w, LP_PERROR, "out of memory", 13);
+    lpP_publish(w);
+    if (w->nomem) lpP_stop(ps);
+    pthread_mutex_lock(&ps->lock);
+    if (--ps->running == 0) pthread_cond_broadcast(&ps->hasresult);
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+static void lpP_freepscan(lp_PScan *ps) {
+    unsigned i;
+    if (ps->workers == NULL) return;
+    lpP_stop(ps);
+    for (i = 0; i < ps->nthreads; ++i)
+        pthread_join(ps->workers[i].thread, NULL);
+    for (i = 0; i < ps->nworkers; ++i) {
+        lp_PWorker *w = &ps->workers[i];
+        lp_PJob *job;
+        while ((job = lpP_popjob(&w->deque, 0)) != NULL) lpP_dropjob(job);
+        while ((job = w->later) != NULL)
+            w->later = job->next, lpP_dropjob(job->parent), free(job);
+        pthread_mutex_destroy(&w->deque.lock);
+        free(w->deque.jobs), free(w->chunk), free(w->dents), free(w->path);
+    }
+    while (ps->first) {
+        lp_PChunk *next = ps->first->next;
+        free(ps->first), ps->first = next;
+    }
+    free(ps->cur), free(ps->workers);
+    ps->cur = NULL;
+    pthread_mutex_destroy(&ps->lock);
+    pthread_cond_destroy(&ps->hasjob);
+    pthread_cond_destroy(&ps->hasresult);
+    pthread_cond_destroy(&ps->hasroom);
+    memset(ps, 0, sizeof(lp_PScan));
+}
+
+static int lpL_pscanclose(lua_State *L) {
+    lp_PScan *ps = (lp_PScan*)luaL_checkudata(L, 1, LP_PSCAN_TYPE);
+    free(ps->cur), ps->cur = NULL;
+    return lpP_freepscan(ps), 0;
+}
+
+static int lpL_psciter(lua_State *L) {
+    lp_PScan *ps = (lp_PScan*)luaL_checkudata(L, 1, LP_PSCAN_TYPE);
+    for (;;) {
+        lp_PChunk *c = ps->cur;
+        if (c && ps->pos < c->len) {
+            const char *s = c->data + ps->pos + 1;
+            size_t len = strlen(s);
+            int state = c->data[ps->pos];
+            ps->pos += len + 2;
+            if (state == LP_PERROR) return luaL_error(L, "%s", s);
+            lua_pushlstring(L, len ? s : LP_CURDIR, len ? len : 1);
+            lua_pushstring(L, state == LP_PIN ? "in" : state == LP_POUT ? "out"
+                    : state == LP_PDIR ? "dir" : "file");
+            return 2;
+        }
+        free(c), ps->cur = NULL, ps->pos = 0;
+        if (ps->workers == NULL) return 0;
+        pthread_mutex_lock(&ps->lock);
+        while (ps->first == NULL && ps->running != 0)
+            pthread_cond_wait(&ps->hasresult, &ps->lock);
+        if ((c = ps->first) != NULL) {
+            if ((ps->first = c->next) == NULL) ps->last = NULL;
+            ps->queued -= 1;
+            pthread_cond_signal(&ps->hasroom);
+        }
+        pthread_mutex_unlock(&ps->lock);
+        if ((ps->cur = c) == NULL) return 0;
+    }
+}
+
+static int lpP_startpscan(lua_State *L, lp_PScan *ps, lp_PJob *root, unsigned n) {
+    unsigned i;
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->hasjob, NULL);
+    pthread_cond_init(&ps->hasresult, NULL);
+    pthread_cond_init(&ps->hasroom, NULL);
+    ps->workers = (lp_PWorker*)calloc(n, sizeof(lp_PWorker));
+    if (ps->workers == NULL) return free(root), luaL_error(L, "out of memory");
+    for (i = 0; i < n; ++i) {
+        lp_PWorker *w = &ps->workers[i];
+        w->ps = ps, w->id = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+#ifdef LP_GETDENTS
+        if ((w->dents = (char*)malloc(ps->bufsize)) == NULL) break;
+#endif
+    }
+    ps->nworkers = i;
+    if (i != n || !lpP_pushjob(&ps->workers[0].deque, root, 1))
+        return free(root), lpP_freepscan(ps), luaL_error(L, "out of memory");
+    ps->pending = 1;
+    pthread_mutex_lock(&ps->lock);
+    for (i = 0; i < n; ++i) {
+        int err = pthread_create(&ps->workers[i].thread, NULL,
+                lpP_worker, &ps->workers[i]);
+        if (err != 0 && i == 0) {
+            pthread_mutex_unlock(&ps->lock), lpP_freepscan(ps);
+            return luaL_error(L, "pscandir: can not create thread (errno=%d)",
+                    err);
+        }
+        if (err != 0) break;
+        ps->nthreads += 1, ps->running += 1;
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return 1;
+}
+
+static int lpL_pscandir(lua_State *L) {
+    int opts, limit, top = lp_walkargs(L, &opts, &limit);
+    lp_State *S = lp_joinargs(L, 1, top);
+    lp_PScan *ps = (lp_PScan*)lua_newuserdata(L, sizeof(lp_PScan));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = lp_optinteger(L, opts, "threads", ncpu > 0 ? (int)ncpu : 1);
+    const char *s;
+    struct stat buf;
+    memset(ps, 0, sizeof(lp_PScan));
+    if (luaL_newmetatable(L, LP_PSCAN_TYPE)) {
+        lua_pushcfunction(L, lpL_pscanclose);
+        lua_pushvalue(L, -1); lua_setfield(L, -3, "__gc");
+        lua_setfield(L, -2, "__close");
+    }
+    lua_setmetatable(L, -2);
+    top = lua_gettop(L);
+    if (vec_len(S->p.parts) > 1)
+        s = lp_applyparts(L, &S->buf, &S->p);
+    else
+        s = (*vec_grow(L, S->buf, 1) = 0, S->buf);
+    ps->grouped  = opts && (lua_getfield(L, opts, "grouped"),
+            lua_toboolean(L, -1));
+    ps->bufsize  = (unsigned)lp_optinteger(L, opts, "bufsize", LP_DEFAULT_BUFSIZE);
+    ps->maxqueue = (unsigned)lp_optinteger(L, opts, "queue", LP_PQUEUE_SIZE);
+    if (ps->bufsize < LP_MIN_BUFSIZE) ps->bufsize = LP_MIN_BUFSIZE;
+    if (ps->maxqueue < 1) ps->maxqueue = 1;
+    threads = threads < 1 ? 1 : threads > LP_MAX_THREADS ? LP_MAX_THREADS : threads;
+    lua_settop(L, top);
+    if (fstatat(AT_FDCWD, *s ? s : LP_CURDIR, &buf, AT_SYMLINK_NOFOLLOW) < 0)
+        ; /* not exists, yields nothing */
+    else if (*s && !S_ISDIR(buf.st_mode)) {
+        ps->cur = (lp_PChunk*)malloc(sizeof(lp_PChunk) + vec_len(S->buf) + 2);
+        if (ps->cur == NULL) return luaL_error(L, "out of memory");
+        ps->cur->data[0] = LP_PFILE;
+        memcpy(ps->cur->data + 1, s, vec_len(S->buf) + 1);
+        ps->cur->len = vec_len(S->buf) + 2;
+    } else {
+        lp_PJob *root = lpP_newjob(s, strlen(s), limit ? limit : -1);
+        if (root == NULL) return luaL_error(L, "out of memory");
+        lpP_startpscan(L, ps, root, (unsigned)threads);
+    }
+    lua_pushcfunction(L, lpL_psciter);
+    lua_pushvalue(L, -2);
+    lua_pushnil(L);
+    lua_pushvalue(L, -2);
+    return 4;
+}
+
+#define LP_DU_TYPE       "lpath.Du"
+
+typedef struct lp_DuScan {
+    lp_PScan ps;
+    lp_Du    du;
+} lp_DuScan;
+
+static void lpP_freedu(lp_DuScan *d) {
+    unsigned i;
+    lpP_freepscan(&d->ps);
+    if (d->du.treecap == 0) return;
+    for (i = 0; i < d->du.ntrees; ++i) free(d->du.trees[i].path);
+    for (i = 0; i < d->du.nexts; ++i) free(d->du.exts[i].slots);
+    free(d->du.trees), free(d->du.exts), free(d->du.ids.ids);
+    pthread_mutex_destroy(&d->du.idlock);
+    memset(&d->du, 0, sizeof(lp_Du));
+}
+
+static int lpL_dugc(lua_State *L)
+{ return lpP_freedu((lp_DuScan*)luaL_checkudata(L, 1, LP_DU_TYPE)), 0; }
+
+static void lp_pushdusum(lua_State *L, const lp_DuSum *sum) {
+    /* the table is on the top */
+    lua_pushinteger(L, (lua_Integer)sum->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)sum->blocks);
+    lua_setfield(L, -2, "blocks");
+    lua_pushinteger(L, (lua_Integer)sum->files);
+    lua_setfield(L, -2, "files");
+    lua_pushinteger(L, (lua_Integer)sum->dirs);
+    lua_setfield(L, -2, "dirs");
+}
+
+static void lp_pushduexts(lua_State *L, lp_Du *du) {
+    unsigned i;
+    size_t j;
+    lua_newtable(L);
+    for (i = 0; i < du->nexts; ++i) {
+        lp_DuExts *t = &du->exts[i];
+        for (j = 0; t->slots && j <= t->mask; ++j) {
+            lp_DuExt *e = &t->slots[j];
+            lua_Integer bytes = 0, files = 0;
+            if (e->files == 0) continue;
+            lua_getfield(L, -1, e->ext);
+            if (lua_istable(L, -1)) {
+                lua_getfield(L, -1, "bytes"), bytes = lua_tointeger(L, -1);
+                lua_getfield(L, -2, "files"), files = lua_tointeger(L, -1);
+                lua_pop(L, 2);
+            } else
+                lua_pop(L, 1), lua_createtable(L, 0, 2);
+            lua_pushinteger(L, bytes + (lua_Integer)e->bytes);
+            lua_setfield(L, -2, "bytes");
+            lua_pushinteger(L, files + (lua_Integer)e->files);
+            lua_setfield(L, -2, "files");
+            lua_setfield(L, -2, e->ext);
+        }
+    }
+}
+
+static int lpL_du(lua_State *L) {
+    int opts, exts, top = lp_walkargs(L, &opts, NULL);
+    lp_State *S = lp_joinargs(L, 1, top);
+    lp_DuScan *d = (lp_DuScan*)lua_newuserdata(L, sizeof(lp_DuScan));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = lp_optinteger(L, opts, "threads", ncpu > 0 ? (int)ncpu : 1);
+    lp_Du *du = &d->du;
+    const char *s;
+    struct stat st;
+    unsigned i;
+    memset(d, 0, sizeof(lp_DuScan));
+    if (luaL_newmetatable(L, LP_DU_TYPE)) {
+        lua_pushcfunction(L, lpL_dugc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    top = lua_gettop(L);
+    if (vec_len(S->p.parts) > 1)
+        s = lp_applyparts(L, &S->buf, &S->p);
+    else
+        s = (*vec_grow(L, S->buf, 1) = 0, S->buf);
+    du->depth = lp_optinteger(L, opts, "depth", 0);
+    exts = opts && (lua_getfield(L, opts, "exts"), lua_toboolean(L, -1));
+    du->xdev = opts && (lua_getfield(L, opts, "xdev"), lua_toboolean(L, -1));
+    threads = threads < 1 ? 1 : threads > LP_MAX_THREADS ? LP_MAX_THREADS : threads;
+    lua_settop(L, top);
+    if (fstatat(AT_FDCWD, *s ? s : LP_CURDIR, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -lp_pusherror(L, "du", s);
+    if ((du->trees = (lp_DuTree*)calloc(16, sizeof(lp_DuTree))) == NULL
+            || (exts && (du->exts = (lp_DuExts*)calloc((size_t)threads,
+                        sizeof(lp_DuExts))) == NULL))
+        return free(du->trees), du->trees = NULL, luaL_error(L, "out of memory");
+    pthread_mutex_init(&du->idlock, NULL);
+    du->treecap = 16, du->ntrees = 1, du->dev = st.st_dev;
+    du->nexts = exts ? (unsigned)threads : 0;
+    if (!S_ISDIR(st.st_mode)) {
+        lp_DuSum *sum = &du->trees[0].sum;
+        const char *name = s + strlen(s);
+        while (name > s && !lp_isdirsep(name[-1])) --name;
+        sum->files = 1, sum->bytes = (uint64_t)st.st_size;
+        sum->blocks = (uint64_t)st.st_blocks * 512;
+        if (exts && !lpP_duext(&du->exts[0], name, sum->bytes))
+            return luaL_error(L, "out of memory");
+    } else {
+        lp_PJob *root = lpP_newjob(s, strlen(s), -1);
+        if (root == NULL) return luaL_error(L, "out of memory");
+        d->ps.du = du, d->ps.bufsize = LP_DEFAULT_BUFSIZE, d->ps.maxqueue = 1;
+        lpP_startpscan(L, &d->ps, root, (unsigned)threads);
+        pthread_mutex_lock(&d->ps.lock);
+        while (d->ps.running != 0)
+            pthread_cond_wait(&d->ps.hasresult, &d->ps.lock);
+        pthread_mutex_unlock(&d->ps.lock);
+        if (d->ps.first != NULL) return luaL_error(L, "out of memory");
+    }
+    for (i = du->ntrees - 1; i > 0; --i) /* parents are created first */
+        lpP_dusum(&du->trees[du->trees[i].parent].sum, &du->trees[i].sum);
+    lua_createtable(L, 0, 7);
+    lp_pushdusum(L, &du->trees[0].sum);
+    lua_pushinteger(L, (lua_Integer)du->errors);
+    lua_setfield(L, -2, "errors");
+    if (exts) lp_pushduexts(L, du), lua_setfield(L, -2, "exts");
+    if (du->depth > 0) {
+        lua_createtable(L, 0, (int)du->ntrees - 1);
+        for (i = 1; i < du->ntrees; ++i) {
+            lua_createtable(L, 0, 4);
+            lp_pushdusum(L, &du->trees[i].sum);
+            lua_setfield(L, -2, du->trees[i].path);
+        }
+        lua_setfield(L, -2, "tree");
+    }
+    lpP_freedu(d);
+    return 1;
+}
+
+#else
+
+static int lpL_pscandir(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "pscandir not support on Windows");
+    return 2;
+}
+
+static int lpL_du(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "du not support on Windows");
+    return 2;
+}
+
+#endif
+
+/* incremental changes */
+
+#ifndef _WIN32
+
+#define LP_CHANGES_TYPE  "lpath.Changes"
+#define LP_CHANGES_MAGIC "LPCH1"
+#define LP_CHANGES_DEPTH 4096
+#define LP_CHANGES_SIZE  0xF0000000u /* record sizes are u32 */
+
+#ifdef O_PATH /* only for fstatat() of unchanged folders */
+# define LP_CHANGES_OPEN (O_PATH|O_DIRECTORY|O_CLOEXEC)
+#else
+# define LP_CHANGES_OPEN (O_RDONLY|O_DIRECTORY|O_CLOEXEC)
+#endif
+
+#ifdef __APPLE__
+# define lpC_mtim(st) (&(st)->st_mtimespec)
+# define lpC_ctim(st) (&(st)->st_ctimespec)
+#else
+# define lpC_mtim(st) (&(st)->st_mtim)
+# define lpC_ctim(st) (&(st)->st_ctim)
+#endif
+
+/* state: magic, then the record of root:
+ *   record: u32 size, ino, mtime (0 to read again), ctime, count,
+ *           children sorted by name, and records of child folders;
+ *   child:  type, name length, name, and ino, size, mtime if not a folder.
+ * numbers except 'size' are varints, times are in nanoseconds. */
+
+typedef struct lp_ChEntry {
+    size_t      name; /* offset in 'names', or in the old state if 'old' */
+    unsigned    len;
+    int         type; /* 'd'ir, 'f'ile, 'l'ink or 'o'ther */
+    int         old;
+    uint64_t    ino, size, mtime;
+    const char *rec;  /* old record of folder, NULL for new folders */
+    const char *s;    /* name, only valid while merging */
+} lp_ChEntry;
+
+typedef struct lp_Changes {
+    char       *path;  /* current path, zero terminated */
+    char       *out;   /* the new state */
+    char       *log;   /* kind, path and '\0' of every change */
+    char       *names; /* names read, a stack of levels */
+    lp_ChEntry *ents;  /* children, a stack of levels */
+#ifdef LP_GETDENTS
+    char       *dents; /* getdents64 buffer */
+#endif
+    const char *base;  /* the old state */
+    uint64_t    racy;  /* folders changed since then are read again */
+    int         files; /* stat files in unchanged folders */
+    size_t      rootlen;
+    dev_t       dev;   /* device of root, for 'xdev' */
+    lp_Prune    prune;
+} lp_Changes;
+
+static int lpL_changesgc(lua_State *L) {
+    lp_Changes *c = (lp_Changes*)luaL_checkudata(L, 1, LP_CHANGES_TYPE);
+    vec_free(c->path), vec_free(c->out), vec_free(c->log);
+    vec_free(c->names), vec_free(c->ents);
+#ifdef LP_GETDENTS
+    vec_free(c->dents);
+#endif
+    lp_freeprune(&c->prune);
+    return 0;
+}
+
+static uint64_t lpC_ns(const struct timespec *ts)
+{ return (uint64_t)ts->tv_sec * 1000000000u + (uint64_t)ts->tv_nsec; }
+
+static uint32_t lpC_getu32(const char *p) {
+    const unsigned char *u = (const unsigned char*)p;
+    return u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static uint64_t lpC_getvar(const char **pp) {
+    const unsigned char *p = (const unsigned char*)*pp;
+    uint64_t v = 0;
+    unsigned shift = 0;
+    do v |= (uint64_t)(*p & 0x7F) << shift, shift += 7; while (*p++ & 0x80);
+    return *pp = (const char*)p, v;
+}
+
+static void lpC_putvar(lua_State *L, lp_Changes *c, uint64_t v) {
+    char buf[10];
+    int n = 0;
+    do buf[n++] = (char)((v & 0x7F) | (v > 0x7F ? 0x80 : 0)); while (v >>= 7);
+    vec_extend(L, c->out, buf, n);
+}
+
+static const char *lpC_checkvar(const char *p, const char *e, uint64_t *pv) {
+    unsigned shift = 0;
+    uint64_t v = 0;
+    for (; p < e && shift < 64; shift += 7) {
+        unsigned char ch = (unsigned char)*p++;
+        v |= (uint64_t)(ch & 0x7F) << shift;
+        if (!(ch & 0x80)) return *pv = v, p;
+    }
+    return NULL;
+}
+
+static const char *lpC_check(const char *p, const char *e, int depth) {
+    uint64_t i, n, v, dirs = 0;
+    const char *end;
+    if (depth > LP_CHANGES_DEPTH || e - p < 4
+            || lpC_getu32(p) > (uint64_t)(e - p - 4))
+        return NULL;
+    end = p + 4 + lpC_getu32(p), p += 4;
+    for (i = 0; i < 4; ++i)
+        if ((p = lpC_checkvar(p, end, &n)) == NULL) return NULL;
+    for (i = 0; i < n; ++i) {
+        int type;
+        if (p >= end) return NULL;
+        type = *p++;
+        if ((p = lpC_checkvar(p, end, &v)) == NULL
+                || v > (uint64_t)(end - p))
+            return NULL;
+        p += v;
+        if (type == 'd') ++dirs;
+        else if ((p = lpC_checkvar(p, end, &v)) == NULL
+                || (p = lpC_checkvar(p, end, &v)) == NULL
+                || (p = lpC_checkvar(p, end, &v)) == NULL)
+            return NULL;
+    }
+    while (dirs--)
+        if ((p = lpC_check(p, end, depth + 1)) == NULL) return NULL;
+    return p == end ? end : NULL;
+}
+
+static const char *lpC_skip(const char *rec)
+{ return rec + 4 + lpC_getu32(rec); }
+
+static const char *lpC_header(const char *rec, uint64_t *h) {
+    int i;
+    for (rec += 4, i = 0; i < 4; ++i) h[i] = lpC_getvar(&rec);
+    return rec; /* ino, mtime, ctime, count */
+}
+
+static void lpC_child(lp_Changes *c, const char **pp, lp_ChEntry *e) {
+    const char *p = *pp;
+    e->type = *p++, e->old = 1, e->rec = NULL;
+    e->len  = (unsigned)lpC_getvar(&p);
+    e->s    = p, e->name = (size_t)(p - c->base), p += e->len;
+    e->ino  = e->size = e->mtime = 0;
+    if (e->type != 'd') {
+        e->ino   = lpC_getvar(&p);
+        e->size  = lpC_getvar(&p);
+        e->mtime = lpC_getvar(&p);
+    }
+    *pp = p;
+}
+
+static const char *lpC_children(lp_Changes *c, const char *p, uint64_t n) {
+    lp_ChEntry e;
+    while (n--) lpC_child(c, &p, &e);
+    return p; /* records of child folders */
+}
+
+static unsigned lpC_pushname(lua_State *L, lp_Changes *c, const char *s, unsigned len) {
+    unsigned old = vec_len(c->path);
+    if (old && !lp_isdirsep(c->path[old-1])) vec_push(L, c->path, LP_DIRSEP[0]);
+    vec_extend(L, c->path, s, len);
+    return *vec_grow(L, c->path, 1) = 0, old;
+}
+
+static void lpC_popname(lp_Changes *c, unsigned len)
+{ vec_rawlen(c->path) = len, c->path[len] = 0; }
+
+static void lpC_emit(lua_State *L, lp_Changes *c, int kind) {
+    vec_push(L, c->log, (char)kind);
+    vec_extend(L, c->log, c->path, vec_len(c->path));
+    vec_push(L, c->log, '\0');
+}
+
+static void lpC_removed(lua_State *L, lp_Changes *c, const char *rec) {
+    uint64_t h[4], i;
+    const char *p = lpC_header(rec, h), *sub = lpC_children(c, p, h[3]);
+    for (i = 0; i < h[3]; ++i) {
+        lp_ChEntry e;
+        unsigned len;
+        lpC_child(c, &p, &e);
+        len = lpC_pushname(L, c, e.s, e.len);
+        if (e.type == 'd') lpC_removed(L, c, sub), sub = lpC_skip(sub);
+        lpC_emit(L, c, '-');
+        lpC_popname(c, len);
+    }
+}
+
+static int lpC_type(mode_t mode) {
+    return S_ISDIR(mode) ? 'd' : S_ISREG(mode) ? 'f' :
+           S_ISLNK(mode) ? 'l' : 'o';
+}
+
+static int lpC_stated(lp_ChEntry *e, struct stat *st) {
+    uint64_t ino = (uint64_t)st->st_ino, size = (uint64_t)st->st_size;
+    uint64_t mtime = lpC_ns(lpC_mtim(st));
+    int changed = e->ino != ino || e->size != size || e->mtime != mtime;
+    e->ino = ino, e->size = size, e->mtime = mtime;
+    return changed;
+}
+
+static int lpC_limit(lua_State *L, lp_Changes *c, const char *msg) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "changes:%s: %s", c->path, msg);
+    return -2;
+}
+
+static int lpC_pruned(lua_State *L, lp_Changes *c, int isdir) {
+    /* the item is the last name of 'path' */
+    const char *s = c->path + c->rootlen, *e = vec_rawend(c->path), *name = e;
+    while (s < e && lp_isdirsep(*s)) ++s;
+    while (name > s && !lp_isdirsep(name[-1])) --name;
+    return lp_prunematch(L, NULL, &c->prune, lp_part(name, e - name),
+            lp_part(s, e - s), isdir);
+}
+
+static void lpC_same(lua_State *L, lp_Changes *c, int fd, const char *p, uint64_t n) {
+    const char *sub = lpC_children(c, p, n), *rec = NULL;
+    while (n--) {
+        lp_ChEntry e;
+        struct stat st;
+        lpC_child(c, &p, &e);
+        if (e.type == 'd') rec = sub, sub = lpC_skip(sub);
+        if (c->prune.rules) { /* the options may differ from the last call */
+            unsigned len = lpC_pushname(L, c, e.s, e.len);
+            int pruned = lpC_pruned(L, c, e.type == 'd');
+            if (pruned && e.type == 'd') lpC_removed(L, c, rec);
+            if (pruned) lpC_emit(L, c, '-');
+            lpC_popname(c, len);
+            if (pruned) continue;
+        }
+        if (e.type == 'd')
+            e.rec = rec;
+        else if (c->files) {
+            unsigned len = lpC_pushname(L, c, e.s, e.len);
+            int r = fstatat(fd, vec_rawend(c->path) - e.len, &st,
+                    AT_SYMLINK_NOFOLLOW);
+            if (r == 0 && lpC_stated(&e, &st)) lpC_emit(L, c, '~');
+            if (r != 0) lpC_emit(L, c, '-');
+            lpC_popname(c, len);
+            if (r != 0) continue;
+        }
+        vec_push(L, c->ents, e);
+    }
+}
+
+static int lpC_cmp(const void *lhs, const void *rhs) {
+    const lp_ChEntry *a = (const lp_ChEntry*)lhs, *b = (const lp_ChEntry*)rhs;
+    int r = memcmp(a->s, b->s, a->len < b->len ? a->len : b->len);
+    return r ? r : a->len < b->len ? -1 : a->len > b->len;
+}
+
+static int lpC_read(lua_State *L, lp_Changes *c, lp_DirReader *r, unsigned base) {
+    lp_Dirent64 *ent;
+    unsigned i, end;
+    for (errno = 0; (ent = lpP_nextentry(r)) != NULL; errno = 0) {
+        lp_ChEntry e;
+        struct stat st;
+        memset(&e, 0, sizeof(e));
+        e.len = (unsigned)strlen(ent->d_name), e.type = 'd';
+#ifdef LP_DTYPE
+        if (ent->d_type != DT_DIR)
+#endif
+        {
+            if (fstatat(lpP_readerfd(r), ent->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) < 0)
+                continue; /* just removed */
+            if ((e.type = lpC_type(st.st_mode)) != 'd') lpC_stated(&e, &st);
+        }
+        if (c->prune.rules) {
+            unsigned len = lpC_pushname(L, c, ent->d_name, e.len);
+            int pruned = lpC_pruned(L, c, e.type == 'd');
+            lpC_popname(c, len);
+            if (pruned) continue;
+        }
+        e.name = vec_len(c->names);
+        vec_extend(L, c->names, ent->d_name, e.len);
+        vec_push(L, c->ents, e);
+    }
+    if (errno) return lp_pusherror(L, "changes", c->path);
+    for (i = base, end = vec_len(c->ents); i < end; ++i)
+        c->ents[i].s = c->names + c->ents[i].name;
+    if (end > base)
+        qsort(c->ents + base, end - base, sizeof(lp_ChEntry), lpC_cmp);
+    return 0;
+}
+
+static void lpC_merge(lua_State *L, lp_Changes *c, unsigned base, const char *p, uint64_t n) {
+    unsigned i = base, end = vec_len(c->ents), len;
+    const char *sub = p ? lpC_children(c, p, n) : NULL;
+    lp_ChEntry o;
+    int cmp, loaded = 0;
+    while (i < end || n > 0) {
+        lp_ChEntry *e = i < end ? &c->ents[i] : NULL;
+        if (n > 0 && !loaded) lpC_child(c, &p, &o), loaded = 1;
+        cmp = e == NULL ? 1 : n == 0 ? -1 : lpC_cmp(e, &o);
+        if (cmp <= 0 && (cmp < 0 || e->type != o.type)) {
+            if (cmp == 0) { /* type changed, remove the old one first */
+                len = lpC_pushname(L, c, o.s, o.len);
+                if (o.type == 'd') lpC_removed(L, c, sub);
+                lpC_emit(L, c, '-'), lpC_popname(c, len);
+            }
+            len = lpC_pushname(L, c, e->s, e->len);
+            lpC_emit(L, c, '+'), lpC_popname(c, len);
+        } else if (cmp > 0) {
+            len = lpC_pushname(L, c, o.s, o.len);
+            if (o.type == 'd') lpC_removed(L, c, sub);
+            lpC_emit(L, c, '-'), lpC_popname(c, len);
+        } else if (e->type == 'd')
+            e->rec = sub;
+        else if (e->ino != o.ino || e->size != o.size || e->mtime != o.mtime) {
+            len = lpC_pushname(L, c, e->s, e->len);
+            lpC_emit(L, c, '~'), lpC_popname(c, len);
+        }
+        if (cmp >= 0) {
+            if (o.type == 'd') sub = lpC_skip(sub);
+            --n, loaded = 0;
+        }
+        if (cmp <= 0) ++i;
+    }
+}
+
+static int lpC_dir(lua_State *L, lp_Changes *c, int pfd, unsigned namelen,
+        const char *rec, struct stat *st, int depth) {
+    /* the folder is the last 'namelen' bytes of 'path', opened by 'pfd' */
+    unsigned base = vec_len(c->ents), nbase = vec_len(c->names);
+    unsigned start = vec_len(c->out), i, end;
+    uint64_t h[4], mtime = lpC_ns(lpC_mtim(st));
+    const char *p = rec ? lpC_header(rec, h) : NULL;
+    const char *name = namelen ? vec_rawend(c->path) - namelen : LP_CURDIR;
+    int same = p && h[0] == (uint64_t)st->st_ino && h[1] == mtime && h[1] != 0
+        && h[2] == lpC_ns(lpC_ctim(st));
+    int nofollow = depth ? O_NOFOLLOW : 0; /* the root may be a link */
+    int fd = -1, reader = 0, r = 0;
+    lp_DirReader dr;
+    if (depth > LP_CHANGES_DEPTH) return lpC_limit(L, c, "nested too deep");
+    if (start > LP_CHANGES_SIZE) return lpC_limit(L, c, "state too large");
+#ifdef LP_GETDENTS
+    vec_rawgrow(L, c->dents, LP_DEFAULT_BUFSIZE);
+    dr.buf = c->dents, dr.size = LP_DEFAULT_BUFSIZE;
+#endif
+    vec_extend(L, c->out, "\0\0\0", 4);
+    lpC_putvar(L, c, (uint64_t)st->st_ino);
+    lpC_putvar(L, c, mtime >= c->racy ? 0 : mtime);
+    lpC_putvar(L, c, lpC_ns(lpC_ctim(st)));
+    if (c->prune.xdev && st->st_dev != c->dev)
+        ; /* not entered, as the walker does */
+    else if (same && (h[3] == 0 || (fd = openat(pfd, name,
+                        LP_CHANGES_OPEN|nofollow)) >= 0))
+        lpC_same(L, c, fd, p, h[3]);
+    else if (lpP_openreader(&dr, pfd, name, nofollow)) {
+        fd = lpP_readerfd(&dr), reader = 1;
+        if ((r = lpC_read(L, c, &dr, base)) < 0) goto out;
+        lpC_merge(L, c, base, p, p ? h[3] : 0);
+    } else if (errno == ENOENT || errno == ENOTDIR) /* just removed */
+        lpC_merge(L, c, base, p, p ? h[3] : 0);
+    else
+        return lp_pusherror(L, "changes", c->path);
+    end = vec_len(c->ents);
+    lpC_putvar(L, c, end - base);
+    for (i = base; i < end; ++i) {
+        lp_ChEntry *e = &c->ents[i];
+        vec_push(L, c->out, (char)e->type);
+        lpC_putvar(L, c, e->len);
+        vec_extend(L, c->out, (e->old ? c->base : c->names) + e->name, e->len);
+        if (e->type == 'd') continue;
+        lpC_putvar(L, c, e->ino);
+        lpC_putvar(L, c, e->size);
+        lpC_putvar(L, c, e->mtime);
+    }
+    for (i = base; i < end; ++i) {
+        lp_ChEntry e = c->ents[i]; /* 'ents' may move */
+        struct stat cst;
+        unsigned len;
+        if (e.type != 'd') continue;
+        len = lpC_pushname(L, c, (e.old ? c->base : c->names) + e.name, e.len);
+        if (fd < 0 || fstatat(fd, vec_rawend(c->path) - e.len, &cst,
+                    AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(cst.st_mode)) {
+            memset(&cst, 0, sizeof(cst)); /* read again */
+            cst.st_mode = S_IFDIR, cst.st_dev = c->dev;
+        }
+        if ((r = lpC_dir(L, c, fd, e.len, e.rec, &cst, depth + 1)) < 0) goto out;
+        lpC_popname(c, len);
+    }
+    end = vec_len(c->out) - start - 4;
+    for (i = 0; i < 4; ++i) c->out[start + i] = (char)(end >> (i * 8));
+    vec_setlen(c->ents, base), vec_setlen(c->names, nbase);
+out:
+    if (reader) lpP_closereader(&dr);
+    else if (fd >= 0) close(fd);
+    return r;
+}
+
+static int lpL_changes(lua_State *L) {
+    const char *kinds[] = { "added", "removed", "modified" };
+    size_t len = 0;
+    const char *root = lp_checkpath(L, 1, NULL);
+    const char *old = luaL_optlstring(L, 2, NULL, &len), *rec = NULL, *s, *e;
+    lp_Changes *c = (lp_Changes*)lua_newuserdata(L, sizeof(lp_Changes));
+    size_t mlen = sizeof(LP_CHANGES_MAGIC) - 1;
+    struct timespec now;
+    struct stat st;
+    int i = 0, isdir;
+    memset(c, 0, sizeof(lp_Changes));
+    if (luaL_newmetatable(L, LP_CHANGES_TYPE)) {
+        lua_pushcfunction(L, lpL_changesgc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    if (old && (len < mlen || memcmp(old, LP_CHANGES_MAGIC, mlen) != 0
+                || (len > mlen && lpC_check(old + mlen, old + len, 0) == NULL)))
+        return luaL_argerror(L, 2, "invalid state");
+    if (old && len > mlen) rec = old + mlen;
+    c->base  = old;
+    if (lua_istable(L, 3)) {
+        lp_pruneopts(L, 3, &c->prune);
+        lua_getfield(L, 3, "files");
+        c->files = lua_toboolean(L, -1);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    c->racy = lpC_ns(&now) - 1000000000u; /* timestamps may be coarse */
+    vec_concat(L, c->out, LP_CHANGES_MAGIC);
+    vec_concat(L, c->path, root);
+    *vec_grow(L, c->path, 1) = 0;
+    c->rootlen = vec_len(c->path);
+    isdir = stat(*root ? root : LP_CURDIR, &st) == 0 && S_ISDIR(st.st_mode);
+    if (isdir) c->dev = st.st_dev;
+    if (isdir && rec == NULL) lpC_emit(L, c, '+');
+    if (isdir && lpC_dir(L, c, AT_FDCWD, (unsigned)c->rootlen, rec, &st, 0) < 0)
+        return 2;
+    if (!isdir && rec) lpC_removed(L, c, rec), lpC_emit(L, c, '-');
+    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, 0);
+    for (s = c->log, e = vec_end(c->log); s < e; s += strlen(s) + 1) {
+        lua_pushstring(L, s + 1);
+        lua_rawseti(L, -3, ++i);
+        lua_pushstring(L, kinds[*s == '+' ? 0 : *s == '-' ? 1 : 2]);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushlstring(L, c->out, vec_len(c->out));
+    return 3;
+}
+
+#else
+
+static int lpL_changes(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "changes not support on Windows");
+    return 2;
+}
+
+#endif
+
+/* watch */
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define LP_WATCH_TYPE    "lpath.Watch"
+#define LP_WATCH_BUFSIZE (64*1024)
+#define LP_WATCH_WINDOW  0.1
+#define LP_WATCH_MASK    (IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB \
+        |IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF \
+        |IN_MOVE_SELF|IN_ONLYDIR|IN_EXCL_UNLINK)
+
+/* pending flags of a path, coalesced from its events */
+#define LP_WATCH_BEFORE   1 /* existed before the first event */
+#define LP_WATCH_NOW      2 /* exists after the last event */
+#define LP_WATCH_OVERFLOW 4 /* events lost, the root should be rescanned */
+
+/* uservalue: wd -> folder, folder -> wd, path -> flags, path -> time of
+ * the last event, paths in the order of the first event, and the root */
+enum lp_WatchTable { LP_WDS = 1, LP_DIRS, LP_FLAGS, LP_TIMES, LP_ORDER,
+                     LP_ROOT };
+
+typedef struct lp_Watch {
+    int      fd;      /* inotify instance, -1 if closed */
+    int      rootwd;
+    size_t   rootlen;
+    double   window;  /* seconds to wait for more events of a path */
+    lp_Prune prune;
+    union { uint32_t align; char buf[LP_WATCH_BUFSIZE]; } u; /* events */
+} lp_Watch;
+
+static lp_Watch *lpI_check(lua_State *L) {
+    lp_Watch *W = (lp_Watch*)luaL_checkudata(L, 1, LP_WATCH_TYPE);
+    if (W->fd < 0) luaL_error(L, "watch is closed");
+    return W;
+}
+
+static int lpL_watchclose(lua_State *L) {
+    lp_Watch *W = (lp_Watch*)luaL_checkudata(L, 1, LP_WATCH_TYPE);
+    if (W->fd >= 0) close(W->fd), W->fd = -1;
+    lp_freeprune(&W->prune);
+    return 0;
+}
+
+static int lpI_tables(lua_State *L, int idx) {
+    int i, uv;
+    lua_getuservalue(L, idx);
+    uv = lua_gettop(L);
+    for (i = 1; i <= LP_ROOT; ++i)
+        lua_rawgeti(L, uv, i);
+    return uv; /* 'uv + LP_xxx' is the table */
+}
+
+static lp_Part lpI_rel(lp_Watch *W, const char *s, size_t len) {
+    lp_Part rel = lp_part(s + W->rootlen, len - W->rootlen);
+    while (rel.s < rel.e && lp_isdirsep(*rel.s)) ++rel.s;
+    return rel;
+}
+
+static int lpI_pruned(lua_State *L, lp_Watch *W, const char *s, size_t len,
+        lp_Part name, int isdir) {
+    return W->prune.rules && lp_prunematch(L, NULL, &W->prune, name,
+            lpI_rel(W, s, len), isdir);
+}
+
+static void lpI_pending(lua_State *L, int t, double now, int ev) {
+    int flags; /* the path is on the top, and popped */
+    lua_pushvalue(L, -1);
+    lua_rawget(L, t + LP_FLAGS);
+    if (lua_isnil(L, -1)) {
+        flags = ev == '+' ? 0 : LP_WATCH_BEFORE;
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, t + LP_ORDER, (int)lua_rawlen(L, t + LP_ORDER) + 1);
+    } else
+        flags = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    flags = ev == '-' ? flags & ~LP_WATCH_NOW :
+            ev == '!' ? flags | LP_WATCH_NOW | LP_WATCH_OVERFLOW :
+            flags | LP_WATCH_NOW;
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, flags);
+    lua_rawset(L, t + LP_FLAGS);
+    lua_pushnumber(L, now);
+    lua_rawset(L, t + LP_TIMES);
+}
+
+static void lpI_addwd(lua_State *L, int t, int wd, const char *s, size_t len) {
+    lua_pushlstring(L, s, len);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, t + LP_WDS, wd);
+    lua_pushinteger(L, wd);
+    lua_rawset(L, t + LP_DIRS);
+}
+
+static void lpI_unwatch(lua_State *L, lp_Watch *W, int t, const char *s, size_t len) {
+    lua_pushnil(L); /* drop the watches of a folder moved away */
+    while (lua_next(L, t + LP_DIRS)) {
+        size_t klen;
+        const char *k = lua_tolstring(L, -2, &klen);
+        if (klen >= len && memcmp(k, s, len) == 0
+                && (klen == len || lp_isdirsep(k[len]))) {
+            int wd = (int)lua_tointeger(L, -1);
+            inotify_rm_watch(W->fd, wd);
+            lua_pushnil(L), lua_rawseti(L, t + LP_WDS, wd);
+            lua_pushvalue(L, -2), lua_pushnil(L), lua_rawset(L, t + LP_DIRS);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static int lpI_walk(lua_State *L, lp_Watch *W, int t, const char *s, double now) {
+    /* watch the folders of a new subtree, and report its items if 'now' */
+    lp_ScanDir *ds = (lp_ScanDir*)lua_newuserdata(L, sizeof(lp_ScanDir));
+    lp_Walker *w = &ds->w;
+    int r, wd;
+    lp_initwalker(NULL, w, NULL, -1);
+    lp_walkermeta(L);
+    vec_concat(L, w->buf, s);
+    *vec_grow(L, w->buf, 1) = 0;
+    w->prune.xdev = W->prune.xdev;
+    for (;;) {
+        size_t len;
+        int top;
+        if ((r = lp_walknext(L, w)) < 0 && w->state == LP_WALKIN
+                && (errno == ENOENT || errno == ENOTDIR || errno == EACCES)) {
+            lua_pop(L, 2), w->state = LP_WALKDIR; /* removed already */
+            continue;
+        }
+        if (r <= 0) break;
+        if (r == LP_WALKOUT) continue;
+        top = vec_len(w->levels) == 0;
+        s = lp_walkpath(L, w), len = strlen(s);
+        if (!top && lpI_pruned(L, W, s, len, lp_part(w->name, w->namelen),
+                    r != LP_WALKFILE)) {
+            if (r == LP_WALKIN) w->state = LP_WALKDIR; /* skip it */
+            continue;
+        }
+        if (r == LP_WALKIN) {
+            wd = inotify_add_watch(W->fd, s, LP_WATCH_MASK|IN_DONT_FOLLOW);
+            if (wd < 0 && (errno == ENOENT || errno == ENOTDIR
+                        || errno == EACCES)) {
+                w->state = LP_WALKDIR; /* removed already, or unreadable */
+                continue;
+            }
+            if (wd < 0) return lp_freewalker(w), lp_pusherror(L, "watch", s);
+            lpI_addwd(L, t, wd, s, len);
+        }
+        if (!top && now > 0)
+            lua_pushlstring(L, s, len), lpI_pending(L, t, now, '+');
+    }
+    lp_freewalker(w);
+    if (r == 0) lua_pop(L, 1);
+    return r;
+}
+
+static int lpI_event(lua_State *L, lp_Watch *W, int t, double now,
+        const struct inotify_event *ev) {
+    size_t len, plen;
+    const char *dir, *path;
+    int r = 0, isdir = (ev->mask & IN_ISDIR) != 0;
+    if (ev->mask & IN_Q_OVERFLOW) {
+        lua_pushvalue(L, t + LP_ROOT);
+        return lpI_pending(L, t, now, '!'), 0;
+    }
+    lua_rawgeti(L, t + LP_WDS, ev->wd);
+    if ((dir = lua_tolstring(L, -1, &len)) == NULL)
+        return lua_pop(L, 1), 0; /* watch removed */
+    if (ev->mask & IN_IGNORED) {
+        lua_pushnil(L), lua_rawseti(L, t + LP_WDS, ev->wd);
+        lua_pushvalue(L, -1), lua_rawget(L, t + LP_DIRS);
+        if (lua_tointeger(L, -1) == ev->wd)
+            lua_pushvalue(L, -2), lua_pushnil(L), lua_rawset(L, t + LP_DIRS);
+        return lua_pop(L, 2), 0;
+    }
+    if (ev->len == 0) { /* folder itself, others are reported by parents */
+        if (ev->wd == W->rootwd)
+            lua_pushvalue(L, t + LP_ROOT), lpI_pending(L, t, now,
+                    (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) ? '-' : '~');
+        return lua_pop(L, 1), 0;
+    }
+    if (len && !lp_isdirsep(dir[len-1])) lua_pushstring(L, LP_DIRSEP);
+    else lua_pushliteral(L, "");
+    lua_pushstring(L, ev->name);
+    lua_concat(L, 3);
+    path = lua_tolstring(L, -1, &plen);
+    if (lpI_pruned(L, W, path, plen, lp_part(ev->name, strlen(ev->name)),
+                isdir))
+        return lua_pop(L, 1), 0;
+    lua_pushvalue(L, -1);
+    if (ev->mask & (IN_CREATE|IN_MOVED_TO)) {
+        lpI_pending(L, t, now, '+');
+        if (isdir) r = lpI_walk(L, W, t, path, now);
+    } else if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+        lpI_pending(L, t, now, '-');
+        if (isdir && (ev->mask & IN_MOVED_FROM)) lpI_unwatch(L, W, t, path, plen);
+    } else
+        lpI_pending(L, t, now, '~');
+    if (r == 0) lua_pop(L, 1);
+    return r;
+}
+
+static int lpI_drain(lua_State *L, lp_Watch *W, int t) {
+    double now = lpP_clock();
+    for (;;) {
+        ssize_t n = read(W->fd, W->u.buf, sizeof(W->u.buf));
+        const struct inotify_event *ev;
+        char *p;
+        int r, err = 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        if (n <= 0) return lp_pusherror(L, "watch", NULL);
+        for (p = W->u.buf; p < W->u.buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if ((r = lpI_event(L, W, t, now, ev)) >= 0) continue;
+            if (err) lua_pop(L, -r); /* reports the first error */
+            else err = r; /* the rest of the batch is read already */
+        }
+        if (err) return err;
+    }
+}
+
+static double lpI_next(lua_State *L, lp_Watch *W, int t, double now) {
+    double next = -1; /* seconds before a pending path is ready */
+    int i, n = (int)lua_rawlen(L, t + LP_ORDER);
+    for (i = 1; i <= n && next != 0; ++i) {
+        double d;
+        lua_rawgeti(L, t + LP_ORDER, i);
+        lua_rawget(L, t + LP_TIMES);
+        d = lua_tonumber(L, -1) + W->window - now;
+        lua_pop(L, 1);
+        if (d <= 0) d = 0;
+        if (next < 0 || d < next) next = d;
+    }
+    return next;
+}
+
+static int lpI_deliver(lua_State *L, lp_Watch *W, int t, double now) {
+    int i, j = 0, k = 0, n = (int)lua_rawlen(L, t + LP_ORDER);
+    double next = -1;
+    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, 0); /* new order */
+    for (i = 1; i <= n; ++i) {
+        double d;
+        int flags;
+        lua_rawgeti(L, t + LP_ORDER, i);
+        lua_pushvalue(L, -1), lua_rawget(L, t + LP_TIMES);
+        d = lua_tonumber(L, -1) + W->window - now;
+        lua_pop(L, 1);
+        if (d > 0) {
+            if (next < 0 || d < next) next = d;
+            lua_rawseti(L, -2, ++k);
+            continue;
+        }
+        lua_pushvalue(L, -1), lua_rawget(L, t + LP_FLAGS);
+        flags = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1), lua_pushnil(L), lua_rawset(L, t + LP_FLAGS);
+        lua_pushvalue(L, -1), lua_pushnil(L), lua_rawset(L, t + LP_TIMES);
+        if (!(flags & (LP_WATCH_BEFORE|LP_WATCH_NOW))) {
+            lua_pop(L, 1); /* created and removed */
+            continue;
+        }
+        lua_rawseti(L, -4, ++j);
+        lua_pushstring(L, (flags & LP_WATCH_OVERFLOW) ? "overflow" :
+                !(flags & LP_WATCH_BEFORE) ? "added" :
+                !(flags & LP_WATCH_NOW) ? "removed" : "modified");
+        lua_rawseti(L, -3, j);
+    }
+    lua_getuservalue(L, 1);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, LP_ORDER);
+    lua_pop(L, 1);
+    if (next < 0) return 2;
+    lua_pushnumber(L, next);
+    return 3;
+}
+
+static int lpL_watchread(lua_State *L) {
+    lp_Watch *W = lpI_check(L);
+    double timeout = luaL_optnumber(L, 2, 0), end, now, next;
+    int t;
+    lua_settop(L, 2);
+    t = lpI_tables(L, 1);
+    end = lpP_clock() + timeout;
+    for (;;) {
+        struct pollfd pfd;
+        double left;
+        if (lpI_drain(L, W, t) < 0) return 2;
+        now = lpP_clock();
+        if ((next = lpI_next(L, W, t, now)) == 0) break;
+        left = timeout < 0 ? -1 : end - now;
+        if (timeout >= 0 && left <= 0) break;
+        if (next < 0 || (left >= 0 && left < next)) next = left;
+        pfd.fd = W->fd, pfd.events = POLLIN, pfd.revents = 0;
+        if (poll(&pfd, 1, next < 0 ? -1 : (int)(next * 1000) + 1) < 0
+                && errno != EINTR)
+            return -lp_pusherror(L, "poll", NULL);
+    }
+    return lpI_deliver(L, W, t, now);
+}
+
+static int lpL_watchfd(lua_State *L)
+{ return lua_pushinteger(L, lpI_check(L)->fd), 1; }
+
+static int lpL_watch(lua_State *L) {
+    const char *root = lp_checkpath(L, 1, NULL);
+    int i, t, opts = lua_istable(L, 2) ? 2 : 0;
+    lp_Watch *W;
+    if (*root == '\0') root = LP_CURDIR;
+    lua_settop(L, 2);
+    W = (lp_Watch*)lua_newuserdata(L, sizeof(lp_Watch));
+    memset(W, 0, offsetof(lp_Watch, u));
+    W->fd = -1, W->window = LP_WATCH_WINDOW;
+    if (luaL_newmetatable(L, LP_WATCH_TYPE)) {
+        luaL_Reg libs[] = {
+            { "read",  lpL_watchread  },
+            { "fd",    lpL_watchfd    },
+            { "close", lpL_watchclose },
+            { NULL, NULL }
+        };
+        lua_pushcfunction(L, lpL_watchclose);
+        lua_pushvalue(L, -1); lua_setfield(L, -3, "__gc");
+        lua_setfield(L, -2, "__close");
+        luaL_newlib(L, libs);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    lua_createtable(L, LP_ROOT, 0);
+    for (i = 1; i < LP_ROOT; ++i)
+        lua_createtable(L, 0, 0), lua_rawseti(L, -2, i);
+    lua_pushstring(L, root), lua_rawseti(L, -2, LP_ROOT);
+    lua_setuservalue(L, 3);
+    if (opts) {
+        lp_pruneopts(L, opts, &W->prune);
+        lua_getfield(L, opts, "window");
+        if (lua_isnumber(L, -1)) W->window = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    if ((W->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
+        return -lp_pusherror(L, "watch", NULL);
+    if ((W->rootwd = inotify_add_watch(W->fd, root, LP_WATCH_MASK)) < 0)
+        return -lp_pusherror(L, "watch", root);
+    W->rootlen = strlen(root);
+    t = lpI_tables(L, 3);
+    lpI_addwd(L, t, W->rootwd, root, W->rootlen);
+    if (lpI_walk(L, W, t, root, 0) < 0) return 2;
+    lua_settop(L, 3);
+    return 1;
+}
+
+#else
+
+static int lpL_watch(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "watch not support on this platform");
+    return 2;
+}
+
+#endif
+
+/* fnmatch & glob */
+
+static int lp_matchone(int ch, lp_Part *p) {
+    const char *s = p->s, *e = p->e;
+    int inv = 0, res = 0;
+    if (*s == '?' || (*s != '[' && lp_normchar(*s) == ch))
+        return (p->s = s + 1, 1);
+    if (*s != '[') return 0;
+    if (*++s == '!') inv = 1, ++s;
+    if (*s == ']') res = (ch == ']'), ++s;
+    for (; !res && s < e && *s != ']'; ++s) {
+        int range = s+1 < e && s[1] == '-'
+                 && s+2 < e && s[2] != ']';
+        res = range ? lp_normchar(*s) <= ch && ch <= lp_normchar(s[2]) :
+            ch == lp_normchar(*s);
+        if (range) s += 2;
+    }
+    while (s < e && *s != ']') ++s;
+    if (s == e) s = p->s, res = (ch == '['), inv = 0;
+    return res != inv ? (p->s = s + 1, 1) : 0;
+}
+
+static int lp_fnmatch(lp_Part s, lp_Part p) {
+    const char *start = NULL, *match = NULL;
+    if (p.s >= p.e) return s.s >= s.e;
+    if (lp_len(p) == 1 && *p.s == '*') return 1;
+    while (s.s < s.e) {
+        if (p.s < p.e && *p.s == '*')
+            match = s.s, start = ++p.s;
+        else if (p.s < p.e && lp_matchone(lp_normchar(*s.s), &p))
+            ++s.s;
+        else if (start != NULL)
+            s.s = ++match, p.s = start;
+        else return 0;
+    }
+    while (p.s < p.e && *p.s == '*') ++p.s;
+    return p.s == p.e;
+}
+
+/* compiled fnmatch: each char of pattern is a position of a bit-parallel
+ * NFA (Shift-And), '*' loops on the position before it. literals anchored
+ * at start/end and the longest literal between them are checked first. */
+
+#define LP_FNMAXPOS 64
+#define LP_FNSLOTS  16
+
+struct lp_FnSlot {
+    char      *text;  /* copy of the pattern */
+    unsigned   seen;  /* compiled on the second use */
+    lp_FnMatch m;
+};
+
+static const char *lpF_token(const char *s, const char *e, uint64_t set[4]) {
+    /* char set of the pattern char at 's', as lp_matchone() */
+    const char *p = s + 1, *end;
+    int ch, inv = 0;
+    memset(set, 0, 4*sizeof(uint64_t));
+    if (*s == '[') {
+        if (p < e && *p == '!') inv = 1, ++p;
+        end = p < e && *p == ']' ? p + 1 : p;
+        while (end < e && *end != ']') ++end;
+        if (end < e) {
+            for (ch = 0; ch < 256; ++ch) {
+                const char *q = p;
+                int nch = lp_normchar(ch), res = (*q == ']' && ch == ']');
+                if (*q == ']') ++q;
+                for (; !res && q < end; ++q) {
+                    int range = q+2 < end && q[1] == '-';
+                    res = range ? lp_normchar(*q) <= nch
+                        && nch <= lp_normchar(q[2]) : nch == lp_normchar(*q);
+                    if (range) q += 2;
+                }
+                if (res != inv) set[ch>>6] |= (uint64_t)1 << (ch&63);
+            }
+            return end + 1;
+        }
+    }
+    for (ch = 0; ch < 256; ++ch)
+        if (lp_charequal(ch, *s)) set[ch>>6] |= (uint64_t)1 << (ch&63);
+    return s + 1;
+}
+
+static void lp_fncompile(lp_FnMatch *m, lp_Part p) {
+    const char *s = p.s, *e, *run = p.s;
+    memset(m, 0, sizeof(*m));
+    m->pat = p;
+    for (; s < p.e; s = e) {
+        uint64_t set[4], bit = (uint64_t)1 << (m->npos & 63);
+        int ch, literal = 0;
+        if (*s == '*') {
+            if (m->npos == 0) m->lead = 1;
+            else if (m->npos <= LP_FNMAXPOS)
+                m->loop |= (uint64_t)1 << (m->npos-1);
+            m->star = 1, e = s + 1;
+        } else if (*s == '?')
+            m->any |= m->npos < LP_FNMAXPOS ? bit : 0, e = s + 1;
+        else {
+            e = lpF_token(s, p.e, set);
+            literal = (e == s + 1);
+            for (ch = 0; m->npos < LP_FNMAXPOS && ch < 256; ++ch)
+                if (set[ch>>6] & ((uint64_t)1 << (ch&63))) m->B[ch] |= bit;
+        }
+        if (*s != '*') ++m->npos;
+        if (!literal) {
+            unsigned len = (unsigned)(s - run);
+            if (run == p.s) m->prefix = len;
+            else if (len > m->litlen)
+                m->litpos = (unsigned)(run - p.s), m->litlen = len;
+            run = e;
+        }
+    }
+    m->suffix = (unsigned)(s - run);
+    if (run == p.s) m->prefix = m->suffix;
+}
+
+static int lpF_equal(const char *s, const char *p, size_t n) {
+#ifdef _WIN32
+    for (; n > 0; --n) if (!lp_charequal(*s++, *p++)) return 0;
+    return 1;
+#else
+    return memcmp(s, p, n) == 0;
+#endif
+}
+
+static int lpF_contains(const char *s, const char *e, const char *lit, size_t n) {
+    for (e -= n - 1; s < e; ++s) {
+#ifndef _WIN32
+        if ((s = (const char*)memchr(s, *lit, e - s)) == NULL) return 0;
+#endif
+        if (lpF_equal(s, lit, n)) return 1;
+    }
+    return 0;
+}
+
+static int lp_fnexec(const lp_FnMatch *m, lp_Part s) {
+    size_t len = lp_len(s);
+    uint64_t d = 0, last;
+    if (len < m->npos || (!m->star && len != m->npos)
+            || !lpF_equal(s.s, m->pat.s, m->prefix)
+            || !lpF_equal(s.e - m->suffix, m->pat.e - m->suffix, m->suffix))
+        return 0;
+    if (m->prefix + m->suffix >= m->npos) return 1; /* all literal */
+    if (m->litlen && !lpF_contains(s.s + m->prefix, s.e - m->suffix,
+                m->pat.s + m->litpos, m->litlen))
+        return 0;
+    if (m->npos > LP_FNMAXPOS) return lp_fnmatch(s, m->pat);
+    if (m->prefix) s.s += m->prefix, d = (uint64_t)1 << (m->prefix-1);
+    else if (s.s < s.e) /* first char */
+        d = 1 & (m->B[(unsigned char)*s.s++] | m->any);
+    last = (uint64_t)1 << (m->npos-1);
+    for (; s.s < s.e; ++s.s) {
+        uint64_t in = (d << 1) | (uint64_t)m->lead;
+        d = (in & (m->B[(unsigned char)*s.s] | m->any)) | (d & m->loop);
+        if (d == 0 && !m->lead) return 0;
+    }
+    return (d & last) != 0;
+}
+
+static void lp_freefns(lp_State *S) {
+    unsigned i;
+    for (i = 0; i < vec_len(S->fns); ++i) vec_free(S->fns[i].text);
+    vec_free(S->fns);
+}
+
+static int lp_fnmatchS(lp_State *S, lp_Part s, lp_Part p) {
+    /* patterns used repeatedly are compiled and cached in state */
+    size_t i, len = lp_len(p), h = len;
+    lp_FnSlot *slot;
+    if (S->fns == NULL) {
+        vec_rawgrow(S->L, S->fns, LP_FNSLOTS);
+        memset(S->fns, 0, LP_FNSLOTS*sizeof(lp_FnSlot));
+        vec_rawlen(S->fns) = LP_FNSLOTS;
+    }
+    for (i = 0; i < len; ++i) h = h*31 + (unsigned char)p.s[i];
+    slot = &S->fns[h % LP_FNSLOTS];
+    if (vec_len(slot->text) != len
+            || (len && memcmp(slot->text, p.s, len) != 0)) {
+        vec_reset(slot->text), slot->seen = 0;
+        vec_extend(S->L, slot->text, p.s, len);
+    }
+    if (slot->seen++ == 0) return lp_fnmatch(s, p);
+    if (slot->seen == 2)
+        lp_fncompile(&slot->m, lp_part(slot->text ? slot->text : "", len));
+    return lp_fnexec(&slot->m, s);
+}
+
+/* brace expansion: "a{b,c}d" is "abd" or "acd", groups without ',' and
+ * braces in char class are literal */
+
+#define LP_MAXALTS 1024
+
+static const char *lpG_class(const char *s, const char *e) {
+    /* the ']' closes the char class at 's', or 's' if not closed */
+    const char *p = s + 1;
+    if (p < e && *p == '!') ++p;
+    if (p < e && *p == ']') ++p;
+    while (p < e && *p != ']') ++p;
+    return p < e ? p : s;
+}
+
+static const char *lpG_brace(const char *s, const char *e, int *pcomma) {
+    /* the '}' closes the '{' at 's', or NULL */
+    int depth = 0;
+    for (*pcomma = 0, ++s; s < e; ++s) {
+        if (*s == '[') s = lpG_class(s, e);
+        else if (*s == '{') ++depth;
+        else if (*s == '}' && depth-- == 0) return s;
+        else if (*s == ',' && depth == 0) *pcomma = 1;
+    }
+    return NULL;
+}
+
+static unsigned lpG_expand(lua_State *L, char **pb, size_t pos, unsigned n) {
+    /* replaces the pattern from 'pos' to the end of '*pb' by its
+     * alternatives, each '\0' terminated; 'n' counts all alternatives */
+    size_t len = vec_len(*pb) - pos, open, close, a, b;
+    const char *s = *pb + pos, *i, *c = NULL;
+    int comma = 0, depth = 0;
+    for (i = s; i < s + len; ++i) {
+        if (*i == '[') i = lpG_class(i, s + len);
+        else if (*i == '{' && (c = lpG_brace(i, s + len, &comma)) && comma)
+            break;
+    }
+    if (i == s + len) {
+        if (n >= LP_MAXALTS) luaL_error(L, "too many alternatives in pattern");
+        return vec_push(L, *pb, '\0'), n + 1;
+    }
+    open = (size_t)(i - s), close = (size_t)(c - s);
+    for (a = b = open + 1; b <= close; ++b) {
+        const char *t = *pb + pos;
+        if (b < close && t[b] == '[') b = (size_t)(lpG_class(t+b, t+close) - t);
+        else if (b < close && t[b] == '{') ++depth;
+        else if (b < close && t[b] == '}') --depth;
+        else if (b == close || (t[b] == ',' && depth == 0)) {
+            size_t at = vec_len(*pb), alen = open + (b-a) + (len-close-1);
+            char *d = (vec_rawgrow(L, *pb, alen), *pb + at);
+            t = *pb + pos; /* prefix, the alternative, then suffix */
+            memcpy(d, t, open);
+            memcpy(d + open, t + a, b - a);
+            memcpy(d + open + (b-a), t + close + 1, len - close - 1);
+            vec_rawlen(*pb) += (unsigned)alen;
+            n = lpG_expand(L, pb, at, n), a = b + 1;
+        }
+    }
+    memmove(*pb + pos, *pb + pos + len, vec_len(*pb) - pos - len);
+    vec_rawlen(*pb) -= (unsigned)len;
+    return n;
+}
+
+static unsigned lpG_expandS(lp_State *S, const char **pp, size_t *plen) {
+    /* alternatives of '*pp' in 'S->buf', or itself if nothing to expand */
+    unsigned n;
+    if (memchr(*pp, '{', *plen) == NULL) return 1;
+    vec_reset(S->buf), vec_extend(S->L, S->buf, *pp, *plen);
+    n = lpG_expand(S->L, &S->buf, 0, 0);
+    *pp = S->buf, *plen = strlen(S->buf);
+    return n;
+}
+
+static int lpL_fnmatch(lua_State *L) {
+    lp_State *S = lp_getstate(L);
+    size_t slen, plen;
+    const char *s = lp_checkpath(L, 1, &slen);
+    const char *p = luaL_checklstring(L, 2, &plen);
+    unsigned n = lpG_expandS(S, &p, &plen);
+    for (;; p += plen + 1, plen = strlen(p)) {
+        if (lp_fnmatchS(S, lp_part(s, slen), lp_part(p, plen)))
+            return lp_bool(L, 1);
+        if (--n == 0) return lp_bool(L, 0);
+    }
+}
+
+static int lp_pathmatch(lp_State *S, const char *s, const char *p) {
+    lua_State *L = S->L;
+    unsigned i, j;
+    lp_resetpath(&S->p), lp_resetpath(&S->pp);
+    lp_joinparts(L, s, &S->p), lp_joinparts(L, p, &S->pp);
+    i = vec_rawlen(S->pp.parts), j = vec_rawlen(S->p.parts);
+    if (lp_len(*S->pp.parts) != 0 /* pattern drive (if exists) must equal */
+            && !lp_driveequal(*S->p.parts, *S->pp.parts)) return 0;
+    if (S->pp.dots > 0) { /* has pattern '..' prefixed? */
+        if (S->pp.dots != S->p.dots || i != j) return 0;
+    } else if (S->pp.dots < 0) { /* is pattern absolute? */
+        if (S->p.dots >= 0 || i != j) return 0; /* parts must be equal */
+    } else if (i > j) return 0; /* pattern parts must be less than path */
+    while (--i > 0 && --j > 0)
+        if (!lp_fnmatchS(S, S->p.parts[j], S->pp.parts[i])) return 0;
+    return 1;
+}
+
+static int lpL_match(lua_State *L) {
+    lp_State *S = lp_getstate(L);
+    const char *s = lp_checkpath(L, 1, NULL);
+    size_t plen;
+    const char *p = luaL_checklstring(L, 2, &plen);
+    unsigned n;
+    luaL_argcheck(L, *p != '\0', 2, "empty pattern");
+    for (n = lpG_expandS(S, &p, &plen); n > 0; --n, p += strlen(p) + 1)
+        if (*p != '\0' && lp_pathmatch(S, s, p)) return lua_settop(L, 1), 1;
+    return 0;
+}
+
+#define LP_GLOBANY 1 /* an alternative ends here */
+#define LP_GLOBDIR 2 /* an alternative 'pattern/' ends here */
+#define LP_GLOBSUB 4 /* an alternative ends with '**' here */
+
+typedef struct lp_GlobNode {
+    lp_FnMatch m;      /* compiled part, only 'm.pat' for '**' */
+    unsigned   child;  /* first child, 0 for none */
+    unsigned   next;   /* next sibling, 0 for none */
+    char       dstar;  /* part is '**' */
+    char       accept; /* LP_GLOB* flags of alternatives end here */
+} lp_GlobNode;
+
+typedef struct lp_GlobRun {
+    unsigned *states; /* nodes reached by a path, a set per level */
+    unsigned *send;   /* end of 'states' of each level */
+    unsigned *marks;  /* stamp of the set a node was added last */
+    unsigned  stamp;  /* stamp of the set in building */
+} lp_GlobRun;
+
+typedef struct lp_GlobPattern {
+    lp_Path      p;     /* parts of the first alternative */
+    char        *pat;   /* normalized pattern */
+    char        *alts;  /* alternatives of 'pat', '\0' terminated */
+    lp_GlobNode *nodes; /* prefix tree of parts after root, empty for
+                           a literal path */
+    unsigned     first; /* parts of 'p' before it are the root */
+    lp_GlobRun   run;   /* states of c:match() */
+} lp_GlobPattern;
+
+typedef struct lp_Glob {
+    lp_Walker       w;
+    lp_GlobPattern  own;    /* compiled pattern of fs.glob() */
+    lp_GlobPattern *gp;     /* 'own', or of a path.glob_compile() */
+    lp_GlobRun      run;    /* states of the entry and its folders */
+    int             batch;  /* results per iteration */
+} lp_Glob;
+
+static int lpG_ismagic(lp_Part p) {
+    const char *s = p.s, *e = p.e;
+    for (; s < e; ++s) if (*s == '?' || *s == '*' || *s == '[') return 1;
+    return 0;
+}
+
+static int lpG_isdstar(lp_Part p)
+{ return lp_len(p) == 2 && p.s[0] == '*' && p.s[1] == '*'; }
+
+static int lpG_samepart(lp_Part a, lp_Part b)
+{ return lp_len(a) == lp_len(b) && lpF_equal(a.s, b.s, lp_len(a)); }
+
+static void lpG_freerun(lp_GlobRun *run) {
+    vec_free(run->states), vec_free(run->send), vec_free(run->marks);
+    run->stamp = 0;
+}
+
+static void lpG_freepattern(lp_GlobPattern *gp) {
+    lp_freepath(&gp->p), vec_free(gp->pat), vec_free(gp->alts);
+    vec_free(gp->nodes), lpG_freerun(&gp->run);
+}
+
+static unsigned lpG_addnode(lua_State *L, lp_GlobPattern *gp,
+        unsigned parent, lp_Part part) {
+    /* the child of 'parent' matches 'part', created if not exists */
+    unsigned i, last = 0, id = vec_len(gp->nodes);
+    int dstar = lpG_isdstar(part);
+    lp_GlobNode *n;
+    for (i = gp->nodes[parent].child; i; last = i, i = gp->nodes[i].next)
+        if (gp->nodes[i].dstar == dstar
+                && (dstar || lpG_samepart(gp->nodes[i].m.pat, part)))
+            return i;
+    n = vec_grow(L, gp->nodes, 1), vec_rawlen(gp->nodes) += 1;
+    memset(n, 0, sizeof(*n)), n->dstar = (char)dstar;
+    if (dstar) n->m.pat = part;
+    else lp_fncompile(&n->m, part);
+    if (last) gp->nodes[last].next = id;
+    else gp->nodes[parent].child = id;
+    return id;
+}
+
+static unsigned lpG_parts(lua_State *L, const char *s, lp_Path *p) {
+    /* parts of alternative 's', without the trailing '/' */
+    unsigned n;
+    lp_resetpath(p), lp_joinparts(L, s, p);
+    n = vec_rawlen(p->parts);
+    return n > 1 && lp_len(p->parts[n-1]) == 0 ? n - 1 : n;
+}
+
+static void lpG_compile(lua_State *L, lp_GlobPattern *gp) {
+    /* expands 'pat', literal parts shared by all alternatives are the root,
+     * other parts go to the prefix tree */
+    lp_Path q = {NULL, 0};
+    lp_GlobNode *root;
+    const char *s;
+    unsigned i, k, len, nalts, first = ~0u, minlen = ~0u;
+    vec_extend(L, gp->alts, gp->pat, strlen(gp->pat));
+    nalts = lpG_expand(L, &gp->alts, 0, 0);
+    for (s = gp->alts, k = 0; k < nalts; ++k, s += strlen(s) + 1) {
+        if ((len = lpG_parts(L, s, &q)) <= 1) continue; /* empty */
+        if (first == ~0u) lpG_parts(L, s, &gp->p), first = len;
+        if (q.dots != gp->p.dots
+                || !lpG_samepart(q.parts[0], gp->p.parts[0])) {
+            lp_freepath(&q);
+            luaL_error(L, "alternatives in pattern have different roots");
+        }
+        for (i = 1; i < first && i < len && !lpG_ismagic(q.parts[i])
+                && lpG_samepart(q.parts[i], gp->p.parts[i]); ++i)
+            ;
+        first = i, minlen = len < minlen ? len : minlen;
+    }
+    if (first == ~0u) lpG_parts(L, "", &gp->p), first = 1, minlen = 2;
+    if (nalts == 1 && first == minlen) { /* literal path */
+        gp->first = vec_len(gp->p.parts);
+        return lp_freepath(&q);
+    }
+    gp->first = first < minlen ? first : minlen - 1;
+    root = vec_grow(L, gp->nodes, 1), vec_rawlen(gp->nodes) += 1;
+    memset(root, 0, sizeof(*root));
+    for (s = gp->alts, k = 0; k < nalts; ++k, s += strlen(s) + 1) {
+        unsigned node = 0;
+        if ((len = lpG_parts(L, s, &q)) <= 1) continue;
+        for (i = gp->first; i < len; ++i)
+            if (!gp->nodes[node].dstar || !lpG_isdstar(q.parts[i]))
+                node = lpG_addnode(L, gp, node, q.parts[i]);
+        gp->nodes[node].accept |= len < vec_rawlen(q.parts) ? LP_GLOBDIR :
+            gp->nodes[node].dstar ? LP_GLOBSUB : LP_GLOBANY;
+    }
+    lp_freepath(&q);
+}
+
+static void lpG_root(lua_State *L, lp_GlobPattern *gp, char **pb) {
+    /* the folder to walk: drive, then the literal parts before 'first' */
+    lp_Part *i, *s = &gp->p.parts[1], *e = &gp->p.parts[gp->first];
+    int d;
+    vec_extend(L, *pb, gp->p.parts[0].s, lp_len(gp->p.parts[0]));
+    for (d = gp->p.dots; d < 0; ++d) vec_push(L, *pb, LP_DIRSEP[0]);
+    for (d = 0; d < gp->p.dots; ++d) {
+        if (d > 0) vec_push(L, *pb, LP_DIRSEP[0]);
+        vec_concat(L, *pb, LP_PARDIR);
+    }
+    for (i = s; i < e; ++i) {
+        if (i > s || gp->p.dots > 0) vec_push(L, *pb, LP_DIRSEP[0]);
+        vec_extend(L, *pb, i->s, lp_len(*i));
+    }
+    *vec_grow(L, *pb, 1) = 0;
+}
+
+static void lpG_addstate(lua_State *L, const lp_GlobNode *nodes,
+        lp_GlobRun *run, unsigned i) {
+    /* adds node 'i' to the last set once, and '**' after it, as '**'
+     * matches no part */
+    unsigned c;
+    if (run->marks[i] == run->stamp) return;
+    run->marks[i] = run->stamp;
+    vec_push(L, run->states, i);
+    for (c = nodes[i].child; c; c = nodes[c].next)
+        if (nodes[c].dstar) lpG_addstate(L, nodes, run, c);
+}
+
+static void lpG_step(lua_State *L, const lp_GlobPattern *gp, lp_GlobRun *run,
+        int level, lp_Part name) {
+    /* states at 'level' from the states of the level above and 'name', a
+     * set of nodes instead of backtracking, so works are bounded by the
+     * count of nodes */
+    const lp_GlobNode *nodes = gp->nodes;
+    unsigned i, c, n = vec_len(nodes), from = level > 1 ? run->send[level-2] : 0;
+    unsigned start = level > 0 ? run->send[level-1] : 0;
+    if (vec_len(run->marks) < n) {
+        vec_rawgrow(L, run->marks, n - vec_len(run->marks));
+        memset(run->marks, 0, n*sizeof(unsigned));
+        vec_rawlen(run->marks) = n, run->stamp = 0;
+    }
+    if (++run->stamp == 0) /* wrapped */
+        memset(run->marks, 0, n*sizeof(unsigned)), run->stamp = 1;
+    vec_setlen(run->states, start), vec_setlen(run->send, level);
+    if (level == 0) lpG_addstate(L, nodes, run, 0);
+    for (i = from; i < start; ++i) {
+        unsigned k = run->states[i];
+        if (nodes[k].dstar) lpG_addstate(L, nodes, run, k);
+        for (c = nodes[k].child; c; c = nodes[c].next)
+            if (!nodes[c].dstar && lp_fnexec(&nodes[c].m, name))
+                lpG_addstate(L, nodes, run, c);
+    }
+    vec_push(L, run->send, vec_len(run->states));
+}
+
+static void lpG_probe(lp_Glob *g, unsigned start, unsigned end) {
+    /* if all children to match have the same literal name, it is looked
+     * up directly */
+    const lp_GlobNode *nodes = g->gp->nodes;
+    const lp_Part *name = NULL;
+    unsigned i, c;
+    for (i = start; i < end; ++i) {
+        if (nodes[g->run.states[i]].dstar) return;
+        for (c = nodes[g->run.states[i]].child; c; c = nodes[c].next) {
+            const lp_FnMatch *m = &nodes[c].m;
+            if (nodes[c].dstar || m->star || m->prefix != m->npos
+                    || (name && !lpG_samepart(*name, m->pat)))
+                return;
+            name = &m->pat;
+        }
+    }
+    if (name) g->w.probe = *name;
+}
+
+static int lpG_match(lua_State *L, lp_Glob *g, int level, int r) {
+    /* whether the entry matches, and skips folders nothing to match in */
+    const lp_GlobNode *nodes = g->gp->nodes;
+    unsigned i, start, end;
+    int ok = r == LP_WALKFILE ? LP_GLOBANY :
+        LP_GLOBANY|LP_GLOBDIR|LP_GLOBSUB, m = 0, alive = 0;
+    if (r != LP_WALKOUT) /* only the entry is new, its folders are known */
+        lpG_step(L, g->gp, &g->run, level, lp_part(g->w.name, g->w.namelen));
+    start = level > 0 ? g->run.send[level-1] : 0, end = g->run.send[level];
+    for (i = start; i < end; ++i) {
+        const lp_GlobNode *n = &nodes[g->run.states[i]];
+        m |= (n->accept & ok) != 0;
+        alive |= n->dstar || n->child;
+    }
+    if (r == LP_WALKIN && !alive) g->w.state = LP_WALKDIR;
+    if (g->w.state == LP_WALKIN) lpG_probe(g, start, end);
+    return m;
+}
+
+static int lpL_globclose(lua_State *L) {
+    lp_Glob *g = (lp_Glob*)luaL_checkudata(L, 1, LP_GLOB_TYPE);
+    if (g->gp) {
+        lp_freewalker(&g->w);
+        lpG_freepattern(&g->own);
+        lpG_freerun(&g->run);
+        g->gp = NULL;
+    }
+    return 0;
+}
+
+static void lpG_init(lp_State *S, lp_Glob *g, int limit) {
+    lua_State *L = S->L;
+    g->gp = &g->own;
+    g->own.pat = lp_applyparts(L, &S->buf, &S->p), S->buf = NULL;
+    lpG_compile(L, &g->own);
+    lpG_root(L, &g->own, &g->w.buf);
+    lp_initwalker(S, &g->w, g->w.buf, limit);
+}
+
+static int lpG_next(lua_State *L, void *ud) {
+    lp_Glob *g = (lp_Glob*)ud;
+    for (;;) {
+        int r = lp_walknext(L, &g->w);
+        int level = (int)vec_len(g->w.levels);
+        if (r <= 0) return r;
+        if (vec_len(g->gp->nodes) == 0) {
+            if (r == LP_WALKIN) g->w.state = LP_WALKDIR;
+            assert(r==LP_WALKIN || r==LP_WALKFILE || r==LP_WALKDIR);
+            return g->w.state;
+        }
+        if (lpG_match(L, g, level, r)) return g->w.state;
+    }
+}
+
+static int lpL_globiter(lua_State *L) {
+    lp_Glob *g = luaL_checkudata(L, 1, LP_GLOB_TYPE);
+    int r;
+    if (g->batch) return lp_pushbatch(L, g->batch, &g->w, lpG_next, g);
+    if ((r = lpG_next(L, g)) < 0) return lua_error(L);
+    return r ? lp_pushdirresult(L, &g->w) : 0;
+}
+
+static void lp_globmeta(lua_State *L) {
+    if (luaL_newmetatable(L, LP_GLOB_TYPE)) {
+        lua_pushcfunction(L, lpL_globclose);
+        lua_pushvalue(L, -1); lua_setfield(L, -3, "__gc");
+        lua_setfield(L, -2, "__close");
+    }
+    lua_setmetatable(L, -2);
+}
+
+static int lpL_glob(lua_State *L) {
+    int opts, limit, top = lp_walkargs(L, &opts, &limit);
+    lp_State *S = lp_joinargs(L, 1, top);
+    lp_Glob *g = (luaL_argcheck(L, vec_len(S->p.parts) > 1,
+                1, "Unacceptable pattern: ''"),
+            lua_newuserdata(L, sizeof(lp_Glob)));
+    memset(g, 0, sizeof(*g));
+    lp_globmeta(L);
+    lpG_init(S, g, limit ? limit : -1);
+    lp_walkopts(L, opts, &g->w);
+    lp_batchopts(L, opts, &g->batch);
+    lua_pushcfunction(L, lpL_globiter);
+    lua_pushvalue(L, -2);
+    lua_pushnil(L);
+    lua_pushvalue(L, -2); /* __close */
+    return 4;
+}
+
+static lp_GlobPattern *lpG_checkpattern(lua_State *L, int idx)
+{ return (lp_GlobPattern*)luaL_checkudata(L, idx, LP_GLOBPAT_TYPE); }
+
+static int lpL_patterngc(lua_State *L)
+{ return lpG_freepattern(lpG_checkpattern(L, 1)), 0; }
+
+static int lpL_patterntostring(lua_State *L)
+{ return lua_pushstring(L, lpG_checkpattern(L, 1)->pat), 1; }
+
+static int lpG_backtrack(const lp_Part *s, const lp_Part *se,
+        const lp_Part *p, const lp_Part *pe, const lp_FnMatch *m) {
+    for (; p < pe; ++p, ++s, ++m) {
+        if (lpG_isdstar(*p)) { /* matches any count of parts */
+            for (++p, ++m;; ++s) {
+                if (lpG_backtrack(s, se, p, pe, m)) return 1;
+                if (s == se) return 0;
+            }
+        }
+        if (s == se || !lp_fnexec(m, *s)) return 0;
+    }
+    return s == se;
+}
+
+static int lpG_matchparts(const lp_Part *s, const lp_Part *se,
+        const lp_Part *p, const lp_Part *pe, const lp_FnMatch *m) {
+    /* bit i is set if parts matched p[0..i), '**' keeps its bit */
+    uint64_t d = 1, t, dstar = 0;
+    unsigned i, n = (unsigned)(pe - p);
+    if (n >= 64) return lpG_backtrack(s, se, p, pe, m);
+    for (i = 0; i < n; ++i)
+        if (lpG_isdstar(p[i])) dstar |= (uint64_t)1 << i;
+    for (;; ++s) {
+        while ((t = d | (d & dstar) << 1) != d) d = t; /* '**' of no part */
+        if (s == se || d == 0) break;
+        for (t = d & dstar, i = 0; i < n; ++i)
+            if (((d & ~dstar) >> i & 1) && lp_fnexec(&m[i], *s))
+                t |= (uint64_t)1 << (i+1);
+        d = t;
+    }
+    return s == se && (d >> n & 1);
+}
+
+static int lpG_matchpath(lua_State *L, lp_GlobPattern *gp, lp_Path *p) {
+    /* 'p' must be in the root, then the rest matches the tree; a trailing
+     * '/' marks a folder */
+    const lp_Part *s = p->parts + 1, *se = vec_rawend(p->parts);
+    const lp_Part *r = gp->p.parts + 1, *re = gp->p.parts + gp->first;
+    lp_GlobRun *run = &gp->run;
+    unsigned i;
+    int level = 0, ok = LP_GLOBANY|LP_GLOBSUB;
+    if (!lp_driveequal(p->parts[0], gp->p.parts[0]) || p->dots != gp->p.dots)
+        return 0;
+    for (; r < re; ++r, ++s)
+        if (s == se || !lpG_samepart(*s, *r)) return 0;
+    if (vec_len(gp->nodes) == 0) return s == se;
+    if (s < se && lp_len(se[-1]) == 0) --se, ok |= LP_GLOBDIR;
+    lpG_step(L, gp, run, 0, lp_part("", 0));
+    for (; s < se && vec_len(run->states) > (level ? run->send[level-1] : 0);
+            ++s)
+        lpG_step(L, gp, run, ++level, *s);
+    for (i = level ? run->send[level-1] : 0; i < run->send[level]; ++i)
+        if (gp->nodes[run->states[i]].accept & ok) return s == se;
+    return 0;
+}
+
+static int lpL_patternmatch(lua_State *L) {
+    lp_GlobPattern *gp = lpG_checkpattern(L, 1);
+    lp_State *S = lp_getstate(L);
+    lp_joinarg(L, 2, &S->p);
+    return lpG_matchpath(L, gp, &S->p) ? (lua_settop(L, 2), 1) : 0;
+}
+
+static int lpL_patternfilter(lua_State *L) {
+    lp_GlobPattern *gp = lpG_checkpattern(L, 1);
+    lp_State *S = lp_getstate(L);
+    int i, j = 0, n = (luaL_checktype(L, 2, LUA_TTABLE),
+            (int)lua_rawlen(L, 2));
+    lua_createtable(L, 0, 0);
+    for (i = 1; i <= n; ++i) {
+        const char *s;
+        lua_rawgeti(L, 2, i);
+        s = lp_checkitem(L, i, NULL);
+        lp_resetpath(&S->p), lp_joinparts(L, s, &S->p);
+        if (lpG_matchpath(L, gp, &S->p)) lua_rawseti(L, -2, ++j);
+        else lua_pop(L, 1);
     }
+    return 1;
 }
 
-static int lp_pushdir(lp_State *S, lp_Walker *w, int limit) {
-    lua_State *L = S->L;
-    if (vec_len(S->p.parts) > 1)
-        lp_applyparts(L, &S->buf, &S->p);
-    else
-        *vec_grow(L, S->buf, 1) = 0;
-    lp_initwalker(S, w, S->buf, limit);
-    if (luaL_newmetatable(L, LP_WALKER_TYPE)) {
-        lua_pushcfunction(L, lpL_dirclose);
-        lua_pushvalue(L, -1); lua_setfield(L, -3, "__gc");
-        lua_setfield(L, -2, "__close");
+static int lpL_patternwalk(lua_State *L) {
+    lp_GlobPattern *gp = lpG_checkpattern(L, 1);
+    const char *root = lp_optpath(L, 2, NULL);
+    int opts = lua_istable(L, 3) ? 3 : 0;
+    lp_State *S = lp_getstate(L);
+    lp_Glob *g;
+    lp_Part *i;
+    luaL_argcheck(L, root == NULL || (gp->p.dots == 0
+                && lp_len(gp->p.parts[0]) == 0), 2,
+            "pattern is not relative");
+    lua_settop(L, 3);
+    g = (lp_Glob*)lua_newuserdata(L, sizeof(lp_Glob));
+    memset(g, 0, sizeof(*g));
+    lp_globmeta(L);
+    g->gp = gp;
+    if (root == NULL) lpG_root(L, gp, &g->w.buf);
+    else { /* root, then literal parts of pattern */
+        vec_concat(L, g->w.buf, root);
+        for (i = &gp->p.parts[1]; i < &gp->p.parts[gp->first]; ++i) {
+            if (vec_len(g->w.buf) && !lp_isdirsep(vec_rawend(g->w.buf)[-1]))
+                vec_push(L, g->w.buf, LP_DIRSEP[0]);
+            vec_extend(L, g->w.buf, i->s, lp_len(*i));
+        }
+        *vec_grow(L, g->w.buf, 1) = 0;
     }
-    lua_setmetatable(L, -2);
-    S->buf = NULL, lp_resetpath(&S->p);
-    lua_pushcfunction(L, lpL_diriter);
+    lp_initwalker(S, &g->w, g->w.buf, -1);
+    g->w.limit = lp_optinteger(L, opts, "limit", -1);
+    if (g->w.limit == 0) g->w.limit = -1;
+    lp_walkopts(L, opts, &g->w);
+    lp_batchopts(L, opts, &g->batch);
+    if (!g->batch) lua_newtable(L), lua_setuservalue(L, -2);
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, 1), lua_rawseti(L, -2, 3); /* keeps the pattern alive */
+    lua_pop(L, 1);
+    lua_pushcfunction(L, lpL_globiter);
     lua_pushvalue(L, -2);
     lua_pushnil(L);
-    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2); /* __close */
     return 4;
 }
 
-static int lpL_dir(lua_State *L) {
+static int lpL_glob_compile(lua_State *L) {
     lp_State *S = lp_joinargs(L, 1, lua_gettop(L));
-    lp_ScanDir *ds = lua_newuserdata(L, sizeof(lp_ScanDir));
-    ds->inout = 0;
-    return lp_pushdir(S, &ds->w, 1);
+    lp_GlobPattern *gp = (luaL_argcheck(L, vec_len(S->p.parts) > 1,
+                1, "Unacceptable pattern: ''"),
+            (lp_GlobPattern*)lua_newuserdata(L, sizeof(lp_GlobPattern)));
+    memset(gp, 0, sizeof(*gp));
+    if (luaL_newmetatable(L, LP_GLOBPAT_TYPE)) {
+        luaL_Reg libs[] = {
+            { "walk",   lpL_patternwalk   },
+            { "match",  lpL_patternmatch  },
+            { "filter", lpL_patternfilter },
+            { NULL, NULL }
+        };
+        lua_pushcfunction(L, lpL_patterngc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushcfunction(L, lpL_patterntostring);
+        lua_setfield(L, -2, "__tostring");
+        luaL_newlib(L, libs);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    gp->pat = lp_applyparts(L, &S->buf, &S->p), S->buf = NULL;
+    lpG_compile(L, gp);
+    return 1;
 }
 
-static int lpL_scandir(lua_State *L) {
-    int isint, limit = (int)lua_tointegerx(L, -1, &isint);
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L) - isint);
-    lp_ScanDir *ds = lua_newuserdata(L, sizeof(lp_ScanDir));
-    ds->inout = 1;
-    return lp_pushdir(S, &ds->w, limit ? limit : -1);
+/* glob set */
+
+typedef struct lp_SetPat {
+    unsigned idx;          /* index in the source list */
+    unsigned pos, len;     /* pattern in 'text' */
+    unsigned part, nparts; /* in 'parts' and 'fms' */
+    unsigned next;         /* next pattern in bucket, from 1 */
+    char     dironly;      /* 'pattern/' */
+    char     path;         /* 'a/pattern', matches parts of the path */
+} lp_SetPat;
+
+typedef struct lp_SetKey {
+    lp_Part  key;
+    unsigned pat; /* first pattern in bucket, from 1 */
+} lp_SetKey;
+
+typedef struct lp_SetGroup { /* name patterns in one Shift-And NFA */
+    uint64_t B[256], any, loop;
+    uint64_t first, lead, last; /* positions of each pattern */
+    unsigned used;
+    unsigned pats[64]; /* pattern by its last position, from 1 */
+} lp_SetGroup;
+
+struct lp_GlobSet {
+    unsigned     refs;   /* the userdata and walkers */
+    unsigned     haspath;
+    char        *text;   /* patterns, '\0' terminated */
+    lp_SetPat   *pats;
+    lp_Part     *parts;  /* name, or parts of path pattern */
+    lp_FnMatch  *fms;    /* compiled 'parts' */
+    lp_SetKey   *names;  /* literal names */
+    lp_SetKey   *exts;   /* '*.ext', by the last suffix */
+    lp_SetGroup *groups; /* other short name patterns */
+    unsigned    *rest;   /* long name patterns and path patterns */
+    unsigned    *ids;    /* result of lpS_match() */
+    lp_Path      sp;     /* parts of the subject */
+};
+
+static void lp_unrefset(lp_GlobSet *gs) {
+    if (gs == NULL || --gs->refs != 0) return;
+    vec_free(gs->text), vec_free(gs->pats), vec_free(gs->parts);
+    vec_free(gs->fms), vec_free(gs->names), vec_free(gs->exts);
+    vec_free(gs->groups), vec_free(gs->rest), vec_free(gs->ids);
+    lp_freepath(&gs->sp);
+    free(gs);
 }
 
-/* fnmatch & glob */
+static size_t lpS_hash(lp_Part s) {
+    size_t h = lp_len(s);
+    for (; s.s < s.e; ++s.s) h = h*31 + (unsigned char)lp_normchar(*s.s);
+    return h;
+}
 
-static int lp_matchone(int ch, lp_Part *p) {
-    const char *s = p->s, *e = p->e;
-    int inv = 0, res = 0;
-    if (*s == '?' || (*s != '[' && lp_normchar(*s) == ch))
-        return (p->s = s + 1, 1);
-    if (*s != '[') return 0;
-    if (*++s == '!') inv = 1, ++s;
-    if (*s == ']') res = (ch == ']'), ++s;
-    for (; !res && s < e && *s != ']'; ++s) {
-        int range = s+1 < e && s[1] == '-'
-                 && s+2 < e && s[2] != ']';
-        res = range ? lp_normchar(*s) <= ch && ch <= lp_normchar(*s+2) :
-            ch == lp_normchar(*s);
-        if (range) s += 2;
-    }
-    while (s < e && *s != ']') ++s;
-    if (s == e) s = p->s, res = (ch == '['), inv = 0;
-    return res != inv ? (p->s = s + 1, 1) : 0;
+static lp_SetKey *lpS_find(lp_SetKey *t, lp_Part key) {
+    size_t mask = vec_len(t) - 1, i = lpS_hash(key) & mask;
+    for (; t[i].key.s != NULL; i = (i + 1) & mask)
+        if (lp_len(t[i].key) == lp_len(key)
+                && lpF_equal(t[i].key.s, key.s, lp_len(key)))
+            break;
+    return &t[i];
 }
 
-static int lp_fnmatch(lp_Part s, lp_Part p) {
-    const char *start = NULL, *match = NULL;
-    if (p.s >= p.e) return s.s >= s.e;
-    if (lp_len(p) == 1 && *p.s == '*') return 1;
-    while (s.s < s.e) {
-        if (p.s < p.e && lp_matchone(lp_normchar(*s.s), &p))
-            ++s.s;
-        else if (p.s < p.e && *p.s == '*')
-            match = s.s, start = ++p.s;
-        else if (start != NULL)
-            s.s = ++match, p.s = start;
-        else return 0;
+static const char *lpS_lastdot(lp_Part name) {
+    const char *s = name.e;
+    while (s > name.s && *--s != '.')
+        ;
+    return s < name.e && *s == '.' ? s : NULL;
+}
+
+static lp_Part lpS_ext(lp_GlobSet *gs, lp_SetPat *p) {
+    /* the last suffix if 'p' is '*.ext', or NULL */
+    const char *s = gs->text + p->pos, *e = s + p->len, *dot = NULL;
+    lp_Part r = {NULL, NULL};
+    if (p->path || p->len < 2 || s[0] != '*' || s[1] != '.') return r;
+    for (++s; s < e; ++s) {
+        if (*s == '?' || *s == '*' || *s == '[') return r;
+        if (*s == '.') dot = s;
     }
-    while (p.s < p.e && *p.s == '*') ++p.s;
-    return p.s == p.e;
+    return lp_part(dot + 1, e - dot - 1);
 }
 
-static int lpL_fnmatch(lua_State *L) {
-    size_t slen, plen;
-    const char *s = luaL_checklstring(L, 1, &slen);
-    const char *p = luaL_checklstring(L, 2, &plen);
-    return lp_bool(L, lp_fnmatch(lp_part(s, slen), lp_part(p, plen)));
+static void lpS_table(lua_State *L, lp_SetKey **pt, unsigned n) {
+    unsigned size = 4;
+    while (size < n*2) size <<= 1;
+    vec_rawgrow(L, *pt, size), vec_rawlen(*pt) = size;
+    memset(*pt, 0, size*sizeof(lp_SetKey));
 }
 
-static int lpL_match(lua_State *L) {
-    lp_State *S = lp_getstate(L);
-    const char *s = luaL_checkstring(L, 1);
-    const char *p = luaL_checkstring(L, 2);
-    unsigned i, j;
-    luaL_argcheck(L, *p != '\0', 2, "empty pattern");
-    lp_joinparts(L, s, &S->p), lp_joinparts(L, p, &S->pp);
-    i = vec_rawlen(S->pp.parts), j = vec_rawlen(S->p.parts);
-    if (lp_len(*S->pp.parts) != 0 /* pattern drive (if exists) must equal */
-            && !lp_driveequal(*S->p.parts, *S->pp.parts)) return 0;
-    if (S->pp.dots > 0) { /* has pattern '..' prefixed? */
-        if (S->pp.dots != S->p.dots || i != j) return 0;
-    } else if (S->pp.dots < 0) { /* is pattern absolute? */
-        if (S->p.dots >= 0 || i != j) return 0; /* parts must be equal */
-    } else if (i > j) return 0; /* pattern parts must be less than path */
-    while (--i > 0 && --j > 0)
-        if (!lp_fnmatch(S->p.parts[j], S->pp.parts[i])) return 0;
-    return lua_settop(L, 1), 1;
+static void lpS_insert(lp_GlobSet *gs, lp_SetKey *t, lp_Part key, unsigned i) {
+    lp_SetKey *k = lpS_find(t, key);
+    if (k->key.s == NULL) k->key = key;
+    gs->pats[i].next = k->pat, k->pat = i + 1;
 }
 
-typedef struct lp_GlobLevel {
-    lp_Part *pat;   /* parts after '**' */
-    int      len;   /* parts length */
-    int      start; /* current match start level */
-    int      match; /* current matched parts index, ==len -> complete match */
-} lp_GlobLevel;
+static int lpS_group(lua_State *L, lp_GlobSet *gs, unsigned i) {
+    const lp_FnMatch *m = &gs->fms[gs->pats[i].part];
+    lp_SetGroup *g = vec_len(gs->groups) ? vec_rawend(gs->groups) - 1 : NULL;
+    unsigned ch, shift;
+    if (m->npos == 0 || m->npos > LP_FNMAXPOS) return 0;
+    if (g == NULL || g->used + m->npos > 64) {
+        g = vec_grow(L, gs->groups, 1), vec_rawlen(gs->groups) += 1;
+        memset(g, 0, sizeof(*g));
+    }
+    shift = g->used, g->used += m->npos;
+    for (ch = 0; ch < 256; ++ch) g->B[ch] |= m->B[ch] << shift;
+    g->any  |= m->any << shift;
+    g->loop |= m->loop << shift;
+    g->first |= (uint64_t)1 << shift;
+    g->lead |= (uint64_t)m->lead << shift;
+    g->last |= (uint64_t)1 << (g->used - 1);
+    g->pats[g->used - 1] = i + 1;
+    return 1;
+}
 
-typedef struct lp_Glob {
-    lp_Walker     w;
-    lp_Path       p;               /* pattern path */
-    char         *pat;             /* pattern buffer */
-    lp_GlobLevel *stack;           /* '**' stack */
-    lp_GlobLevel *current;         /* current level */
-    char          dironly;         /* only match dir */
-} lp_Glob;
+static void lpS_build(lua_State *L, lp_GlobSet *gs) {
+    /* 'text' is complete now, compiles and buckets the patterns */
+    unsigned i, n = vec_len(gs->pats), nnames = 0, nexts = 0;
+    lp_Path p = {NULL, 0};
+    for (i = 0; i < n; ++i) {
+        lp_SetPat *sp = &gs->pats[i];
+        const char *s = gs->text + sp->pos;
+        lp_Part *j;
+        sp->part = vec_len(gs->parts);
+        if (!sp->path) vec_push(L, gs->parts, lp_part(s, sp->len));
+        else {
+            lp_resetpath(&p), lp_joinparts(L, s, &p);
+            for (j = &p.parts[1]; j < vec_rawend(p.parts); ++j)
+                vec_push(L, gs->parts, *j);
+        }
+        sp->nparts = vec_len(gs->parts) - sp->part;
+    }
+    lp_freepath(&p);
+    vec_rawgrow(L, gs->fms, vec_len(gs->parts));
+    for (i = 0; i < vec_len(gs->parts); ++i)
+        lp_fncompile(&gs->fms[i], gs->parts[i]);
+    vec_setlen(gs->fms, vec_len(gs->parts));
+    for (i = 0; i < n; ++i) {
+        const lp_FnMatch *m = &gs->fms[gs->pats[i].part];
+        if (gs->pats[i].path) continue;
+        if (!m->star && m->prefix == m->npos) ++nnames;
+        else if (lpS_ext(gs, &gs->pats[i]).s) ++nexts;
+    }
+    if (nnames) lpS_table(L, &gs->names, nnames);
+    if (nexts) lpS_table(L, &gs->exts, nexts);
+    for (i = 0; i < n; ++i) {
+        lp_SetPat *sp = &gs->pats[i];
+        const lp_FnMatch *m = &gs->fms[sp->part];
+        lp_Part ext = lpS_ext(gs, sp);
+        if (sp->path) gs->haspath = 1;
+        else if (!m->star && m->prefix == m->npos)
+            lpS_insert(gs, gs->names, m->pat, i);
+        else if (ext.s) lpS_insert(gs, gs->exts, ext, i);
+        if (!sp->path && ((!m->star && m->prefix == m->npos) || ext.s))
+            continue;
+        if (sp->path || !lpS_group(L, gs, i)) vec_push(L, gs->rest, i + 1);
+    }
+}
 
-static int lpG_ismagic(lp_Part p) {
-    const char *s = p.s, *e = p.e;
-    for (; s < e; ++s) if (*s == '?' || *s == '*' || *s == '[') return 1;
-    return 0;
+static uint64_t lpS_groupexec(const lp_SetGroup *g, lp_Part s) {
+    uint64_t d = 0, in = g->first;
+    for (; s.s < s.e; ++s.s, in = g->lead) {
+        in |= (d << 1) & ~g->first;
+        d = (in & (g->B[(unsigned char)*s.s] | g->any)) | (d & g->loop);
+        if (d == 0 && g->lead == 0) return 0;
+    }
+    return d & g->last;
 }
 
-static lp_Part lpG_part(lp_Glob *g, unsigned idx) {
-    lp_WalkLevel *wp = g->w.levels;
-    size_t pos = (assert(idx < vec_len(g->w.levels)), wp[idx].pos);
-    size_t end = idx+1 < vec_rawlen(wp) ?
-        wp[idx+1].pos-1 : vec_rawlen(g->w.buf);
-    return lp_part(g->w.buf + pos, (size_t)end - pos);
+static int lpS_add(lua_State *L, lp_GlobSet *gs, unsigned i, int isdir) {
+    /* records pattern 'i' (from 1), returns 1 to stop */
+    if (gs->pats[i-1].dironly && !isdir) return 0;
+    if (L == NULL) return 1;
+    vec_push(L, gs->ids, gs->pats[i-1].idx);
+    return 0;
 }
 
-static int lpL_globclose(lua_State *L) {
-    lp_Glob *g = (lp_Glob*)luaL_checkudata(L, 1, LP_GLOB_TYPE);
-    if (g->pat) {
-        lp_freewalker(&g->w);
-        lp_freepath(&g->p);
-        vec_free(g->stack);
-        vec_free(g->pat);
+static int lpS_match(lua_State *L, lp_GlobSet *gs, lp_Part name,
+        const lp_Part *ps, const lp_Part *pe, int isdir) {
+    /* collects matched patterns into 'ids', or tests only if L is NULL */
+    unsigned i, j;
+    const char *dot;
+    vec_reset(gs->ids);
+    if (gs->names) {
+        for (i = lpS_find(gs->names, name)->pat; i; i = gs->pats[i-1].next)
+            if (lpS_add(L, gs, i, isdir)) return 1;
     }
-    return 0;
+    if (gs->exts && (dot = lpS_lastdot(name)) != NULL) {
+        lp_Part ext = lp_part(dot + 1, name.e - dot - 1);
+        for (i = lpS_find(gs->exts, ext)->pat; i; i = gs->pats[i-1].next)
+            if (lp_fnexec(&gs->fms[gs->pats[i-1].part], name)
+                    && lpS_add(L, gs, i, isdir)) return 1;
+    }
+    for (j = 0; j < vec_len(gs->groups); ++j) {
+        uint64_t acc = lpS_groupexec(&gs->groups[j], name);
+        for (i = 0; acc; ++i, acc >>= 1)
+            if ((acc & 1) && lpS_add(L, gs, gs->groups[j].pats[i], isdir))
+                return 1;
+    }
+    for (j = 0; j < vec_len(gs->rest); ++j) {
+        lp_SetPat *sp = &gs->pats[gs->rest[j]-1];
+        int m = !sp->path ? lp_fnexec(&gs->fms[sp->part], name) :
+            ps != NULL && lpG_matchparts(ps, pe, &gs->parts[sp->part],
+                    &gs->parts[sp->part + sp->nparts], &gs->fms[sp->part]);
+        if (m && lpS_add(L, gs, gs->rest[j], isdir)) return 1;
+    }
+    return vec_len(gs->ids) != 0;
 }
 
-static void lpG_init(lp_State *S, lp_Glob *g, int limit) {
-    lua_State *L = S->L;
-    lp_Part *i, *s, *e, *ps;
-    lp_GlobLevel gl = {NULL, 0, 0, 0};
-    g->pat = lp_applyparts(L, &S->buf, &S->p), S->buf = NULL;
-    lp_joinparts(L, g->pat, &g->p);
-    s = &g->p.parts[1], e = vec_rawend(g->p.parts);
-    vec_extend(L, g->w.buf, g->pat, lp_len(g->p.parts[0]));
-    for (i = s; i < e && !lpG_ismagic(*i); ++i) {
-        if (i > s || g->p.dots < 0) vec_push(L, g->w.buf, LP_DIRSEP[0]);
-        vec_extend(L, g->w.buf, i->s, lp_len(*i));
-    }
-    *vec_grow(L, g->w.buf, 1) = 0;
-    lp_initwalker(S, &g->w, g->w.buf, limit);
-    if (i == e) return;
-    for (s = ps = i; i < e; ++i) {
-        if (lp_len(*i) != 2 || i->s[0] != '*' || i->s[1] != '*') continue;
-        if (i == s || i != ps) /* first, or not empty */
-            gl.pat = ps, gl.len = (int)(i-ps), vec_push(L, g->stack, gl);
-        ps = i + 1; /* ps points to pattern next to '**' */
+static int lp_filtered(lua_State *L, lp_Walker *w) {
+    lp_GlobSet *gs = w->prune.filter;
+    const lp_Part *ps = NULL, *pe = NULL;
+    if (vec_len(w->levels) == 0) return 0;
+    if (gs->haspath) { /* path relative to the root */
+        lp_resetpath(&gs->sp);
+        lp_joinparts(L, lp_walkpath(L, w) + w->levels[0].pos, &gs->sp);
+        ps = gs->sp.parts + 1, pe = vec_rawend(gs->sp.parts);
     }
-    if (lp_len(i[-1]) == 0) i -= 1, g->dironly = 1;
-    gl.pat = ps, gl.len = (int)(i-ps), vec_push(L, g->stack, gl);
-    g->current = (assert(vec_len(g->stack) >= 1), &g->stack[0]);
+    return !lpS_match(NULL, gs, lp_part(w->name, w->namelen), ps, pe,
+            w->state != LP_WALKFILE);
 }
 
-static int lpG_match(lp_Glob *g, int level, int r);
+static lp_GlobSet *lpS_check(lua_State *L, int idx)
+{ return *(lp_GlobSet**)luaL_checkudata(L, idx, LP_GLOBSET_TYPE); }
 
-static int lpG_matchcurrent(lp_Glob *g, lp_GlobLevel *cur) {
-    int level = (int)vec_len(g->w.levels);
-    if (cur->start+cur->match >= level) cur->match = level-cur->start-1;
-    for (; cur->match < cur->len; ++cur->match) {
-        int r = lp_fnmatch(lpG_part(g, cur->start+cur->match),
-                cur->pat[cur->match]);
-        if (!r) return 0;
+static void lp_filteropts(lua_State *L, int opts, lp_Walker *w) {
+    lp_GlobSet **pgs;
+    if (opts == 0) return;
+    lua_getfield(L, opts, "filter");
+    if (!lua_isnil(L, -1)) {
+        if ((pgs = (lp_GlobSet**)luaL_testudata(L, -1, LP_GLOBSET_TYPE)) == NULL)
+            luaL_error(L, "globset expected in option 'filter'");
+        ++(w->prune.filter = *pgs)->refs;
     }
-    return 1;
+    lua_pop(L, 1);
 }
 
-static int lpG_matchstart(lp_Glob *g, int level, int r) {
-    lp_GlobLevel *cur = g->current;
-    if (cur->len == 0) {
-        g->current += 1;
-        g->current->start = cur->start + cur->len;
-        g->current->match = 0;
-        return lpG_match(g, level, r);
-    }
-    if (level < cur->len) return 0;
-    if (vec_rawlen(g->stack) == 1 && level == cur->len && r == LP_WALKIN)
-        g->w.state = LP_WALKDIR;
-    return lpG_matchcurrent(g, cur);
-}
-
-static int lpG_match(lp_Glob *g, int level, int r) {
-    lp_GlobLevel *cur = g->current;
-    int start, islast = (cur+1 == vec_rawend(g->stack));
-    if (cur == g->stack) return lpG_matchstart(g, level, r);
-    start = g->current[-1].start + g->current[-1].len;
-    if (level < start) /* back to previous match */
-        return g->current -= 1, lpG_match(g, level, r);
-    if (islast && cur->len == 0) /* ends with '**' */
-        return r != LP_WALKFILE;
-    if (level < start+cur->len) /* has not enough room to match */
-        return 0;
-    if (cur->start != level - cur->len) {
-        cur->start = level - cur->len;
-        cur->match = 0;
-    }
-    if (lpG_matchcurrent(g, cur)) {
-        if (islast) return !g->dironly || r != LP_WALKFILE;
-        g->current += 1;
-        g->current->start = cur->start + cur->len;
-        g->current->match = 0;
-        return lpG_match(g, level, r);
-    }
-    return 0;
+static int lpS_subject(lua_State *L, lp_GlobSet *gs, int *pisdir) {
+    size_t len;
+    const char *s = lp_checkpath(L, 2, &len);
+    lp_resetpath(&gs->sp), lp_joinarg(L, 2, &gs->sp);
+    *pisdir = len > 0 && lp_isdirsep(s[len-1]);
+    if (vec_rawlen(gs->sp.parts) > 1 && lp_len(vec_rawend(gs->sp.parts)[-1]) == 0)
+        vec_rawlen(gs->sp.parts) -= 1;
+    return lpS_match(L, lpS_check(L, 1), vec_rawlen(gs->sp.parts) > 1 ?
+            vec_rawend(gs->sp.parts)[-1] : lp_part(s, 0), gs->sp.parts + 1,
+            vec_rawend(gs->sp.parts), *pisdir);
+}
+
+static int lpL_setmatch(lua_State *L) {
+    lp_GlobSet *gs = lpS_check(L, 1);
+    unsigned i, first = ~0u;
+    int isdir;
+    if (!lpS_subject(L, gs, &isdir)) return 0;
+    for (i = 0; i < vec_len(gs->ids); ++i)
+        if (gs->ids[i] < first) first = gs->ids[i];
+    return lua_pushinteger(L, first), 1;
+}
+
+static int lpS_cmp(const void *l, const void *r) {
+    unsigned a = *(const unsigned*)l, b = *(const unsigned*)r;
+    return a < b ? -1 : a > b;
+}
+
+static int lpL_setmatches(lua_State *L) {
+    lp_GlobSet *gs = lpS_check(L, 1);
+    unsigned i, j, n;
+    int isdir;
+    lpS_subject(L, gs, &isdir);
+    n = vec_len(gs->ids);
+    if (n > 1) qsort(gs->ids, n, sizeof(unsigned), lpS_cmp);
+    for (i = j = 1; i < n; ++i) /* alternatives of a pattern match once */
+        if (gs->ids[i] != gs->ids[j-1]) gs->ids[j++] = gs->ids[i];
+    n = n ? j : 0;
+    lua_createtable(L, (int)n, 0);
+    for (i = 0; i < n; ++i)
+        lua_pushinteger(L, gs->ids[i]), lua_rawseti(L, -2, i + 1);
+    return 1;
 }
 
-static int lpL_globiter(lua_State *L) {
-    lp_Glob *g = luaL_checkudata(L, 1, LP_GLOB_TYPE);
-    for (;;) {
-        int r = lp_walknext(L, &g->w);
-        int level = (int)vec_len(g->w.levels);
-        if (r <= 0) return r ? lua_error(L) : 0;
-        if (vec_len(g->stack) == 0) {
-            if (r == LP_WALKIN) g->w.state = LP_WALKDIR;
-            assert(r==LP_WALKIN || r==LP_WALKFILE || r==LP_WALKDIR); 
-            return lp_pushdirresult(L, &g->w);
-        }
-        if (lpG_match(g, level, r)) return lp_pushdirresult(L, &g->w);
-    }
+static int lpL_setgc(lua_State *L) {
+    lp_GlobSet **pgs = (lp_GlobSet**)luaL_checkudata(L, 1, LP_GLOBSET_TYPE);
+    lp_unrefset(*pgs), *pgs = NULL;
+    return 0;
 }
 
-static int lpL_glob(lua_State *L) {
-    int isint, limit = (int)lua_tointegerx(L, -1, &isint);
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L) - isint);
-    lp_Glob *g = (luaL_argcheck(L, vec_len(S->p.parts) > 1,
-                1, "Unacceptable pattern: ''"),
-            lua_newuserdata(L, sizeof(lp_Glob)));
-    memset(g, 0, sizeof(*g));
-    if (luaL_newmetatable(L, LP_GLOB_TYPE)) {
-        lua_pushcfunction(L, lpL_globclose);
-        lua_pushvalue(L, -1); lua_setfield(L, -3, "__gc");
-        lua_setfield(L, -2, "__close");
+static int lpL_globset(lua_State *L) {
+    lp_GlobSet *gs, **pgs;
+    int i, n = (luaL_checktype(L, 1, LUA_TTABLE), (int)lua_rawlen(L, 1));
+    pgs = (lp_GlobSet**)lua_newuserdata(L, sizeof(lp_GlobSet*));
+    *pgs = NULL;
+    if (luaL_newmetatable(L, LP_GLOBSET_TYPE)) {
+        luaL_Reg libs[] = {
+            { "match",   lpL_setmatch   },
+            { "matches", lpL_setmatches },
+            { NULL, NULL }
+        };
+        lua_pushcfunction(L, lpL_setgc);
+        lua_setfield(L, -2, "__gc");
+        luaL_newlib(L, libs);
+        lua_setfield(L, -2, "__index");
     }
     lua_setmetatable(L, -2);
-    lpG_init(S, g, limit ? limit : -1);
-    lua_pushcfunction(L, lpL_globiter);
-    lua_pushvalue(L, -2);
-    lua_pushnil(L);
-    lua_pushvalue(L, -2); /* __close */
-    return 4;
+    if ((gs = *pgs = (lp_GlobSet*)malloc(sizeof(lp_GlobSet))) == NULL)
+        return luaL_error(L, "out of memory");
+    memset(gs, 0, sizeof(*gs)), gs->refs = 1;
+    for (i = 1; i <= n; ++i) {
+        size_t len, pos = vec_len(gs->text);
+        unsigned k, nalts;
+        const char *s;
+        lua_rawgeti(L, 1, i);
+        if ((s = lua_tolstring(L, -1, &len)) == NULL)
+            return luaL_error(L, "string expected at index %d, got %s",
+                    i, luaL_typename(L, -1));
+        vec_extend(L, gs->text, s, len);
+        nalts = lpG_expand(L, &gs->text, pos, 0);
+        for (k = 0; k < nalts; ++k, pos += strlen(gs->text + pos) + 1) {
+            char *a = gs->text + pos;
+            lp_SetPat sp;
+            memset(&sp, 0, sizeof(sp)), sp.idx = (unsigned)i;
+            len = strlen(a);
+            if (len && lp_isdirsep(a[len-1])) sp.dironly = 1, a[--len] = 0;
+            while (len && lp_isdirsep(*a)) sp.path = 1, ++a, --len;
+            if (len == 0)
+                return luaL_error(L, "empty pattern at index %d", i);
+            if (memchr(a, '/', len) || memchr(a, LP_DIRSEP[0], len))
+                sp.path = 1;
+            sp.pos = (unsigned)(a - gs->text), sp.len = (unsigned)len;
+            vec_push(L, gs->pats, sp);
+        }
+        lua_pop(L, 1);
+    }
+    lpS_build(L, gs);
+    return 1;
 }
 
 /* dir & file */
@@ -1851,8 +6279,10 @@ typedef struct lp_DirOp {
 } lp_DirOp;
 
 static int lp_dirop_walker(lua_State *L) {
-    lp_State *S = lp_getstate(L);
     lp_DirOp *op = (lp_DirOp*)lua_touserdata(L, 1);
+    lp_State *S;
+    if (lua_istable(L, 2)) lp_pruneopts(L, 2, &op->w.prune);
+    S = lp_getstate(L);
     while (lp_walknext(L, &op->w)) {
         int ret = op->f(S, &op->w, &op->count, op->ud);
         if (ret < 0) return lua_error(L);
@@ -1862,15 +6292,18 @@ static int lp_dirop_walker(lua_State *L) {
 }
 
 static int lp_dirop(lua_State* L, lp_DirOper *f, void *ud) {
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L));
+    int opts, top = lp_walkargs(L, &opts, NULL);
+    lp_State *S = lp_joinargs(L, 1, top);
     lp_DirOp dirop;
     int ret;
     dirop.count = 0, dirop.f = f, dirop.ud = ud;
     lp_initwalker(S, &dirop.w, lp_applyparts(L, &S->buf, &S->p), -1);
+    lp_cacheinval(S, S->buf, 1);
     S->buf = NULL;
     lua_pushcfunction(L, lp_dirop_walker);
     lua_pushlightuserdata(L, &dirop);
-    ret = lua_pcall(L, 1, 0, 0);
+    if (opts) lua_pushvalue(L, opts); else lua_pushnil(L);
+    ret = lua_pcall(L, 2, 0, 0);
     lp_freewalker(&dirop.w);
     if (ret != LUA_OK) return lua_error(L);
     return lua_pushinteger(L, dirop.count), 1;
@@ -1911,7 +6344,7 @@ static int lpL_abs(lua_State* L) {
     return lp_abs(S, lp_applyparts(L, &S->buf, &S->p));
 }
 
-static int lp_rel(lp_State *S, const char *p, const char *s) {
+static int lp_relto(lua_State *L, char **pb, const char *p, const char *s) {
     lp_Part pd, sd;
     const char *pp = (lp_splitdrive(p, &pd), pd.e);
     const char *sp = (lp_splitdrive(s, &sd), sd.e);
@@ -1921,24 +6354,28 @@ static int lp_rel(lp_State *S, const char *p, const char *s) {
     while (*pp != '\0' && *sp != '\0' && lp_charequal(*sp, *pp))
         ++pp, ++sp;                               /* find common prefix, */
     if (*pp == '\0' && *sp == '\0')      /* return '.' when all the same */
-        return lua_pushstring(S->L, LP_CURDIR), 1;
+        return vec_concat(L, *pb, LP_CURDIR), 1;
     while (p < pp && !(lp_isdirend(*pp) && lp_isdirend(*sp)))
         --pp, --sp;       /* find the beginning of first different part, */
     while (*sp) dots += lp_isdirsep(*sp), ++sp;    /* count remain parts */
     dots -= (s < sp && lp_isdirsep(sp[-1]));      /* remove trailing '/' */
     pp += (dots == 0 || !pp[1]);                   /* remove leading '/' */
-    vec_reset(S->buf);
-    if (dots) vec_concat(S->L, S->buf, LP_PARDIR);  /* write first '..'s */
+    if (dots) vec_concat(L, *pb, LP_PARDIR);        /* write first '..'s */
     for (i = 1; i < dots; ++i)                       /* and other '/..'s */
-        vec_concat(S->L, S->buf, LP_DIRSEP LP_PARDIR);
-    vec_concat(S->L, S->buf, pp);
-    return lp_pushresult(S);
+        vec_concat(L, *pb, LP_DIRSEP LP_PARDIR);
+    vec_concat(L, *pb, pp);
+    return 1;
+}
+
+static int lp_rel(lp_State *S, const char *p, const char *s) {
+    vec_reset(S->buf);
+    return lp_relto(S->L, &S->buf, p, s) ? lp_pushresult(S) : 0;
 }
 
 static int lpL_rel(lua_State *L) {
     lp_State *S = lp_getstate(L);
-    const char *s = luaL_checkstring(L, 1);
-    const char *start = luaL_optstring(L, 2, NULL);
+    const char *s = lp_checkpath(L, 1, NULL);
+    const char *start = lp_optpath(L, 2, NULL);
     int ret = (start ? lp_abs(S, start) : lpL_getcwd(L));
     start = lua_tostring(L, -1);
     if ((ret = lp_abs(lp_resetstate(S), s)) < 0) return -ret;
@@ -1951,6 +6388,115 @@ static int lpL_rel(lua_State *L) {
     return 1;
 }
 
+/* bulk operations */
+
+typedef struct lp_Bulk lp_Bulk;
+typedef int lp_BulkOp(lp_Bulk *B, const char *s);
+
+struct lp_Bulk {
+    lp_State   *S;
+    lp_BulkOp  *f;      /* appends the result of 's' to 'out' */
+    const char *cwd;    /* current folder, got once */
+    const char *start;  /* absolute folder of rel_all() */
+    char       *in;     /* item of a string list */
+    char       *tmp;
+    char       *out;
+    int         packed; /* list is a string */
+    int         sep;    /* separator of the string list */
+};
+
+static int lp_normalizeop(lp_Bulk *B, const char *s) {
+    lp_State *S = B->S;
+    lp_resetpath(&S->p), lp_joinparts(S->L, s, &S->p);
+    return lp_applyparts(S->L, &B->out, &S->p), 0;
+}
+
+static int lp_absop(lp_Bulk *B, const char *s) {
+    lp_State *S = B->S;
+    lp_resetpath(&S->p), lp_joinparts(S->L, s, &S->p);
+    vec_reset(B->tmp), lp_applyparts(S->L, &B->tmp, &S->p);
+    if ((s = lp_absbuf(S, B->cwd, B->tmp)) == NULL) return 2;
+    return vec_extend(S->L, B->out, s, vec_len(S->buf)), 0;
+}
+
+static int lp_relop(lp_Bulk *B, const char *s) {
+    lp_State *S = B->S;
+    const char *p = lp_absbuf(S, B->cwd, s);
+    if (p == NULL) return 2;
+    if (!lp_relto(S->L, &B->out, p, B->start)) { /* on other drive */
+        lp_resetpath(&S->p), lp_joinparts(S->L, s, &S->p);
+        lp_applyparts(S->L, &B->out, &S->p);
+    }
+    return 0;
+}
+
+static int lp_bulkloop(lua_State *L) {
+    lp_Bulk *B = (lp_Bulk*)lua_touserdata(L, 1);
+    const char *s, *e, *p;
+    size_t len;
+    int i, n, ret;
+    if (B->packed) { /* results are packed in the same way */
+        for (s = lua_tolstring(L, 2, &len), e = s + len; s < e; s = p + 1) {
+            if ((p = (const char*)memchr(s, B->sep, e - s)) == NULL) p = e;
+            vec_reset(B->in), vec_extend(L, B->in, s, p - s);
+            vec_push(L, B->in, 0);
+            if ((ret = B->f(B, B->in)) != 0) return ret;
+            if (p < e) vec_push(L, B->out, (char)B->sep);
+        }
+        return lua_pushlstring(L, B->out, vec_len(B->out)), 1;
+    }
+    lua_createtable(L, n = (int)lua_rawlen(L, 2), 0);
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 2, i);
+        s = lp_checkitem(L, i, NULL);
+        vec_reset(B->out);
+        if ((ret = B->f(B, s)) != 0) return ret;
+        lua_pushlstring(L, B->out, vec_len(B->out));
+        lua_rawseti(L, -3, i);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+static int lp_bulk(lua_State *L, lp_BulkOp *f, int hasdir) {
+    lp_Bulk B;
+    int ret, top, sep = 2 + hasdir;
+    memset(&B, 0, sizeof(B));
+    if ((B.packed = !lua_istable(L, 1))) {
+        size_t len;
+        const char *s = (luaL_checkstring(L, 1),
+                luaL_optlstring(L, sep, "\n", &len));
+        luaL_argcheck(L, len == 1, sep, "separator must be one char");
+        B.sep = (unsigned char)*s;
+    }
+    if (f != lp_normalizeop) {
+        if ((ret = lpL_getcwd(L)) != 1) return ret;
+        B.cwd = lua_tostring(L, -1);
+    }
+    B.S = lp_getstate(L), B.f = f;
+    if (hasdir && !lua_isnoneornil(L, 2)) {
+        if ((ret = lp_abs(B.S, lp_checkpath(L, 2, NULL))) != 1) return ret;
+        B.start = lua_tostring(L, -1);
+    } else B.start = B.cwd;
+    top = lua_gettop(L);
+    lua_pushcfunction(L, lp_bulkloop);
+    lua_pushlightuserdata(L, &B);
+    lua_pushvalue(L, 1);
+    ret = lua_pcall(L, 2, LUA_MULTRET, 0);
+    vec_free(B.in), vec_free(B.tmp), vec_free(B.out);
+    if (ret != LUA_OK) return lua_error(L);
+    return lua_gettop(L) - top;
+}
+
+static int lpL_normalize_all(lua_State *L)
+{ return lp_bulk(L, lp_normalizeop, 0); }
+
+static int lpL_abs_all(lua_State *L)
+{ return lp_bulk(L, lp_absop, 0); }
+
+static int lpL_rel_all(lua_State *L)
+{ return lp_bulk(L, lp_relop, 1); }
+
 static int lp_delparts(lua_State *L) {
     lp_Path *p = luaL_testudata(L, 1, LP_PARTS_ITER);
     lp_freepath(p);
@@ -1992,7 +6538,7 @@ static int lpL_parts(lua_State *L) {
     int isint, idx = (int)lua_tointegerx(L, -1, &isint);
     int i, top = lua_gettop(L) - isint;
     for (i = 1; i <= top; ++i)
-        lp_joinparts(L, luaL_checkstring(L, i), &S->p);
+        lp_joinarg(L, i, &S->p);
     if (isint) return lp_indexparts(L, idx, &S->p);
     lp_applyparts(L, &S->buf, &S->p), lp_pushresult(S);
     return lp_newpartsiter(L);
@@ -2018,27 +6564,41 @@ static int lpL_anchor(lua_State *L) {
 }
 
 static int lpL_parent(lua_State *L) {
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L));
+    size_t len;
+    const char *s = lp_normalarg(L, 1, &len);
+    lp_State *S;
+    if (s != NULL) { /* drops the name, and the '/' before it */
+        lp_Part name = lp_normalname(s, len);
+        size_t plen = name.s - s;
+        plen -= plen > 1;
+        return plen ? lua_pushlstring(L, s, plen)
+            : lua_pushstring(L, LP_CURDIR), 1;
+    }
+    S = lp_joinargs(L, 1, lua_gettop(L));
     lp_joinparts(L, LP_PARDIR, &S->p);
     return lp_applyparts(L, &S->buf, &S->p), lp_pushresult(S);
 }
 
+static lp_Part lp_nameargs(lua_State *L) {
+    size_t len;
+    const char *s = lp_normalarg(L, 1, &len);
+    return s ? lp_normalname(s, len)
+        : lp_name(&lp_joinargs(L, 1, lua_gettop(L))->p);
+}
+
 static int lpL_name(lua_State *L) {
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L));
-    lp_Part name = lp_name(&S->p);
+    lp_Part name = lp_nameargs(L);
     return lua_pushlstring(L, name.s, lp_len(name)), 1;
 }
 
 static int lpL_stem(lua_State *L) {
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L));
-    lp_Part name = lp_name(&S->p);
+    lp_Part name = lp_nameargs(L);
     const char *ext = lp_splitext(name);
     return lua_pushlstring(L, name.s, ext - name.s), 1;
 }
 
 static int lpL_suffix(lua_State *L) {
-    lp_State *S = lp_joinargs(L, 1, lua_gettop(L));
-    lp_Part name = lp_name(&S->p);
+    lp_Part name = lp_nameargs(L);
     const char *ext = lp_splitext(name);
     return lua_pushlstring(L, ext, name.e - ext), 1;
 }
@@ -2079,10 +6639,105 @@ static int lpL_alt(lua_State *L) {
 }
 
 static int lpL_libcall(lua_State *L) {
-    lp_State *S = lp_joinargs(L, 2, lua_gettop(L));
+    size_t len;
+    lp_State *S;
+    if (lp_normalarg(L, 2, &len)) return 1; /* itself */
+    S = lp_joinargs(L, 2, lua_gettop(L));
     return lua_pushstring(L, lp_applyparts(L, &S->buf, &S->p)), 1;
 }
 
+/* path object */
+
+static int lp_pushpath(lua_State *L, lp_State *S);
+
+static int lpL_pathjoin(lua_State *L) {
+    lp_State *S = lp_getstate(L);
+    lp_joinarg(L, 1, &S->p), lp_joinarg(L, 2, &S->p);
+    return lp_pushpath(L, S);
+}
+
+static int lpL_patheq(lua_State *L) {
+    const char *a, *b;
+    size_t alen, blen;
+    return lp_bool(L, lp_topath(L, 1, &a, &alen) && lp_topath(L, 2, &b, &blen)
+            && alen == blen && memcmp(a, b, alen) == 0);
+}
+
+static int lpL_pathtostring(lua_State *L) {
+    lp_PathObj *o = (lp_PathObj*)luaL_checkudata(L, 1, LP_PATH_TYPE);
+    return lua_pushlstring(L, lp_pathstr(o), o->len), 1;
+}
+
+static void lp_openpath(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(n) { #n, lpL_##n }
+        ENTRY(alt),
+        ENTRY(abs),
+        ENTRY(rel),
+        ENTRY(fnmatch),
+        ENTRY(match),
+        ENTRY(parts),
+        ENTRY(drive),
+        ENTRY(root),
+        ENTRY(anchor),
+        ENTRY(parent),
+        ENTRY(name),
+        ENTRY(stem),
+        ENTRY(suffix),
+        ENTRY(suffixes),
+        ENTRY(exists),
+        ENTRY(resolve),
+        ENTRY(isdir),
+        ENTRY(islink),
+        ENTRY(isfile),
+        ENTRY(ismount),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (!luaL_newmetatable(L, LP_PATH_TYPE)) return;
+    lua_pushcfunction(L, lpL_pathjoin);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "__div");
+    lua_setfield(L, -2, "__concat");
+    lua_pushcfunction(L, lpL_patheq);
+    lua_setfield(L, -2, "__eq");
+    lua_pushcfunction(L, lpL_pathtostring);
+    lua_setfield(L, -2, "__tostring");
+    lp_newlib(L, libs);
+    lua_setfield(L, -2, "__index");
+}
+
+static int lp_pushpath(lua_State *L, lp_State *S) {
+    /* renders 'S->p' and keeps where its parts are, so they are not parsed
+     * again when the object is used as an argument */
+    lp_PathObj *o;
+    lp_Part drive;
+    unsigned n;
+    if (vec_len(S->p.parts) == 0) lp_joinparts(L, "", &S->p);
+    n = vec_len(S->p.parts);
+    o = (lp_PathObj*)lua_newuserdata(L, sizeof(lp_PathObj) +
+            (n-1)*2*sizeof(unsigned) + lp_rendersize(&S->p) + 2);
+    o->dots = S->p.dots, o->n = n;
+    lp_openpath(L);
+    lua_setmetatable(L, -2);
+    vec_reset(S->buf);
+    lp_applysepparts(L, LP_DIRSEP, &S->buf, &S->p, o->offs);
+    lp_splitdrive(S->buf, &drive); /* the drive is normalized */
+    o->offs[0] = (unsigned)(drive.s - S->buf);
+    o->offs[1] = (unsigned)(drive.e - S->buf);
+    o->len = vec_len(S->buf);
+    memcpy(lp_pathstr(o), S->buf, o->len + 1); /* kept inline: the uservalue
+                                                  must be a table on 5.1 */
+    return 1;
+}
+
+static int lpL_new(lua_State *L) {
+    const char *s;
+    if (lua_gettop(L) == 1 && lp_topath(L, 1, &s, NULL))
+        return 1; /* path objects are immutable */
+    return lp_pushpath(L, lp_joinargs(L, 1, lua_gettop(L)));
+}
+
 /* entry */
 
 #define LP_COMMON(X) \
@@ -2096,11 +6751,17 @@ LUAMOD_API int luaopen_path(lua_State *L) {
 #define ENTRY(n) { #n, lpL_##n }
         ENTRY(ansi),
         ENTRY(utf8),
+        ENTRY(new),
         ENTRY(alt),
         ENTRY(abs),
         ENTRY(rel),
+        ENTRY(normalize_all),
+        ENTRY(abs_all),
+        ENTRY(rel_all),
         ENTRY(fnmatch),
         ENTRY(match),
+        ENTRY(glob_compile),
+        ENTRY(globset),
         ENTRY(parts),
         ENTRY(drive),
         ENTRY(root),
@@ -2114,9 +6775,10 @@ LUAMOD_API int luaopen_path(lua_State *L) {
 #undef  ENTRY
         { NULL, NULL }
     };
-    luaL_newlib(L, libs);
+    lp_newlib(L, libs);
     lua_createtable(L, 0, 1);
-    lua_pushcfunction(L, lpL_libcall);
+    lp_pushstate(L);
+    lua_pushcclosure(L, lpL_libcall, 1);
     lua_setfield(L, -2, "__call");
     lua_setmetatable(L, -2);
     return 1;
@@ -2128,7 +6790,12 @@ LUAMOD_API int luaopen_path_fs(lua_State *L) {
 #define ENTRY(n) { #n, lpL_##n }
         ENTRY(dir),
         ENTRY(scandir),
+        ENTRY(pscandir),
+        ENTRY(du),
         ENTRY(glob),
+        ENTRY(stats),
+        ENTRY(changes),
+        ENTRY(watch),
         ENTRY(chdir),
         ENTRY(mkdir),
         ENTRY(rmdir),
@@ -2148,8 +6815,17 @@ LUAMOD_API int luaopen_path_fs(lua_State *L) {
         LP_COMMON(ENTRY)
 #undef  ENTRY
         { NULL, NULL }
+    }, cache[] = {
+        { "enable",     lpL_cacheenable     },
+        { "disable",    lpL_cachedisable    },
+        { "invalidate", lpL_cacheinvalidate },
+        { "stats",      lpL_cachestats      },
+        { NULL, NULL }
     };
-    return luaL_newlib(L, libs), 1;
+    lp_newlib(L, libs);
+    lp_newlib(L, cache);
+    lua_setfield(L, -2, "cache");
+    return 1;
 }
 
 LUAMOD_API int luaopen_path_env(lua_State *L) {
@@ -2160,7 +6836,7 @@ LUAMOD_API int luaopen_path_env(lua_State *L) {
         { "uname",  lpL_uname      },
         { NULL, NULL }
     };
-    return luaL_newlib(L, libs), 1;
+    return lp_newlib(L, libs), 1;
 }
 
 LUAMOD_API int luaopen_path_info(lua_State *L) {
@@ -2189,7 +6865,7 @@ LUAMOD_API int luaopen_path_info(lua_State *L) {
 }
 
 /* cc: flags+='-ggdb -Wextra -Wno-cast-function-type --coverage' run='lua test.lua'
- * unixcc: flags+='-O3 -shared -fPIC' output='path.so'
+ * unixcc: flags+='-O3 -shared -fPIC -pthread' output='path.so'
  * maccc: flags+='-shared -undefined dynamic_lookup' output='path.so'
  * win32cc: lua='Lua54' flags+='-s -O3 -mdll -DLUA_BUILD_AS_DLL -IC:/Devel/$lua/include'
  * win32cc: libs+='-L C:/Devel/$lua/lib -l$lua' output='path.dll' */
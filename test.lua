@@ -484,6 +484,71 @@ function _G.test_parentname()
    eq(path.name("abc/"), "abc")
 end
 
+function _G.test_normalized()
+   -- a normalized path alone is not parsed again, results must not change
+   local sep = info.sep
+   for _, s in ipairs {
+      "a", "a.b", ".a", "a.", "a..b", "...", "a" .. sep .. "b.c",
+      sep .. "a", sep .. "a" .. sep .. ".b" .. sep .. "c.tar.gz",
+      "a/b", "a\\b", "a//b", "a/./b", "a/../b", "a/", "/", "//a", ".", "..",
+      "", "c:a", "a\0b",
+   } do
+      eq(path(s), path("", s), s)
+      for _, f in ipairs { "name", "stem", "suffix", "parent" } do
+         eq(path[f](s), path[f]("", s), f .. " of " .. s)
+      end
+   end
+   local s = "a" .. sep .. "b"
+   eq(rawequal(path(s), s), true)
+   -- the state is checked, not trusted
+   local _, st = debug.getupvalue(path.name, 1)
+   eq(type(st), "userdata")
+   debug.setupvalue(path.name, 1, io.stdout)
+   local ok, err = pcall(path.name, "a//b")
+   debug.setupvalue(path.name, 1, st)
+   eq(ok, false)
+   eq(err:match "not the path state" ~= nil, true)
+   eq(path.name(s), "b")
+end
+
+function _G.test_sepscan()
+   -- separators and the end at each offset around a 16-byte block; two
+   -- arguments, so the path is scanned and rendered again
+   local sep = info.sep
+   for a = 0, 33 do
+      local x = ("x"):rep(a)
+      eq(path("", x), a == 0 and "." or x)
+      for b = 1, 17 do
+         local y = ("y"):rep(b)
+         local s = x .. sep .. y
+         eq(path("", s), a == 0 and sep .. y or s)
+         eq(path.name("", s), y)
+         eq(path("", s .. sep), s .. sep)
+         eq(path("", y .. sep .. sep .. "." .. sep .. x), a == 0
+            and y .. sep or y .. sep .. x)
+         eq(path("", y .. sep .. x .. sep .. ".." .. sep .. y),
+            a == 0 and y or y .. sep .. y)
+      end
+   end
+   -- a long path, against the parts joined in Lua
+   local parts, raw = {}, {}
+   for i = 1, 300 do
+      parts[i] = ("p"):rep(i % 37 + 1) .. i
+      raw[#raw+1] = parts[i]
+      raw[#raw+1] = (sep):rep(i % 3 + 1)
+      if i % 5 == 0 then raw[#raw+1] = "." .. sep end
+      if i % 7 == 0 then raw[#raw+1] = "zz" .. sep .. ".." .. sep end
+   end
+   local s = path("", table.concat(raw))
+   eq(s, table.concat(parts, sep) .. sep)
+   local n = 0
+   for _, part in path.parts(s) do n = n + 1; eq(part, parts[n]) end
+   eq(n, #parts)
+   eq(path("", "..", "..", "a", ".."), ".." .. sep .. "..")
+   eq(path("", sep .. "..", "a"), sep .. "a")
+   eq(path(path.new "a" / ("b"):rep(40) / "c"), "a" .. sep .. ("b"):rep(40) .. sep .. "c")
+end
+
 function _G.test_stem()
    if info.platform == "windows" then
       eq(path.stem'c:', '')
@@ -572,6 +637,71 @@ function _G.test_suffix()
    table_eq(collect "abc....zzz", {".", ".", ".", ".zzz"})
 end
 
+function _G.test_new()
+   local function parts(...)
+      local t = {}
+      for _, v in path.parts(...) do t[#t+1] = v end
+      return t
+   end
+   for _, s in ipairs {
+      "", ".", "..", "../..", "/", "//", "///", "a", "a/", "a/b/c.tar.gz",
+      "./a/./b/", "../a/../../b", "/a/../..", "//a/b", ".hidden", "a.",
+      "c:/a/b", "c:a", "//server/share/x",
+   } do
+      local p = path.new(s)
+      eq(tostring(p), path(s), s)
+      eq(path(p), path(s), s)
+      eq(path.new(p), p)
+      for _, f in ipairs {
+         "alt", "drive", "root", "anchor", "parent", "name", "stem", "suffix",
+      } do
+         eq(p[f](p), path[f](s), f .. " of " .. s)
+      end
+      table_eq(parts(p), parts(s), s)
+      eq(p:parts(-1), path.parts(s, -1), s)
+      eq(path(p, "x/y"), path(s, "x/y"), s)
+      eq(path("x/y", p), path("x/y", s), s)
+      eq(tostring(p / "x" / "../y"), path(s, "x", "../y"), s)
+      eq(tostring("x" / p), path("x", s), s)
+      eq(tostring(p .. path.new "z"), path(s, "z"), s)
+      eq(tostring(p / p), path(s, s), s)
+   end
+   local ps = {}
+   for i = 1, 64 do
+      ps[i] = path.new(("d"):rep(i), ("f"):rep(65 - i))
+   end
+   collectgarbage()
+   for i = 1, 64 do
+      eq(tostring(ps[i]), path(("d"):rep(i), ("f"):rep(65 - i)))
+      eq(ps[i]:name(), ("f"):rep(65 - i))
+      eq(ps[i], path.new(tostring(ps[i])))
+      is_true(ps[i] ~= ps[i % 64 + 1])
+   end
+   local p = path.new("a", "b/", "c.txt")
+   eq(p, path.new "a/b/c.txt")
+   is_true(p ~= path.new "a/b")
+   eq(p:name(), "c.txt")
+   eq(path.name(p), "c.txt")
+   eq(p:stem(), "c")
+   eq(p:suffix(), ".txt")
+   eq((p / "/x"):root(), info.sep)
+   eq(path.fnmatch(p, "*.txt"), true)
+   eq(path.rel(path.new "a/b", "a"), "b")
+   eq(path.glob_compile("**/*.txt"):match(p), p)
+   eq(path.globset({ "*.txt" }):match(p), 1)
+   eq(path.new(fs.getcwd()):exists(), true)
+   eq(path.new():parent(), "..")
+   eq(#fs.stats { path.new ".", "." }, 2)
+   table_eq(path.glob_compile("**/*.txt"):filter { p, "a.c" }, { p })
+   eq(path.normalize_all { p }, { tostring(p) })
+   if info.platform == "windows" then
+      eq(path("D:/x", path.new "/y"), path("D:/x", "/y"))
+      eq(tostring(path.new "D:/x" / path.new "/y"), path("D:/x", "/y"))
+   end
+   fail(".*string expected.*", function() return path.new {} end)
+   fail(".*string expected.*", function() return p / {} end)
+end
+
 function _G.test_fnmatch()
    is_true(path.fnmatch("abc", "a[b]c"))
    is_true(path.fnmatch("abc", "*a*b*c*"))
@@ -579,7 +709,9 @@ function _G.test_fnmatch()
 
    local function check(a, b, r, f)
       local ok = (r == nil and true or r)
-      eq(not not (f or path.fnmatch)(a, b), ok)
+      for _ = 1, 3 do -- patterns used again are compiled
+         eq(not not (f or path.fnmatch)(a, b), ok)
+      end
    end
 
    check('abc', 'abc')
@@ -591,6 +723,15 @@ function _G.test_fnmatch()
    check('abc', 'ab[cd]')
    check('abc', 'ab[!de]')
    check('abc', 'ab[de]', false)
+   check('abc', '[a-z]b?')
+   check('x',   '[a-z]')
+   check('x',   '[!a-z]', false)
+   check('*xb', '*b')
+   check('a*b', 'a[*]b')
+   check('axyzb', 'a*y*b')
+   check('axyzb', 'a*w*b', false)
+   check('abab', '*ab')
+   check('abba', '*ab', false)
    check('a',   '??',     false)
    check('a',   'b',      false)
 
@@ -608,6 +749,9 @@ function _G.test_fnmatch()
    -- The next "takes forever" if the regexp translation is
    -- straightforward.  See bpo-40480.
    check(('a'):rep(50)..'b', '*a*a*a*a*a*a*a*a*a*a', false)
+   check(('ab'):rep(40), ('?b'):rep(40))
+   check(('ab'):rep(40)..'c', ('?b'):rep(40)..'*')
+   check(('ab'):rep(40), ('?b'):rep(39)..'?c', false)
 
    -- test edge case
    check('[', '[[]')
@@ -852,6 +996,42 @@ function _G.test_rel()
 end
 in_tmpdir "test_rel"
 
+function _G.test_bulk()
+   local list = {
+      "", ".", "..", "a", "a/", "a//b/./c", "../a/../../b", "/", "/a/../x",
+      "x/y/z.txt", "c:/foo/bar", path.new "p/q",
+   }
+   local norm, abs, rel, relto = {}, {}, {}, {}
+   for i, s in ipairs(list) do
+      norm[i], abs[i] = path(s), path.abs(s)
+      rel[i], relto[i] = path.rel(s), path.rel(s, "x/y")
+   end
+   eq(path.normalize_all(list), norm)
+   eq(path.abs_all(list), abs)
+   eq(path.rel_all(list), rel)
+   eq(path.rel_all(list, "x/y"), relto)
+   eq(path.rel_all(list, path.new "x/y"), relto)
+   eq(path.normalize_all {}, {})
+
+   local strs = {}
+   for i, s in ipairs(list) do strs[i] = tostring(s) end
+   local buf = table.concat(strs, "\n")
+   eq(path.normalize_all(buf), table.concat(norm, "\n"))
+   eq(path.normalize_all(buf .. "\n"), table.concat(norm, "\n") .. "\n")
+   eq(path.abs_all(buf), table.concat(abs, "\n"))
+   eq(path.rel_all(buf, "x/y"), table.concat(relto, "\n"))
+   eq(path.rel_all(table.concat(strs, "\0"), nil, "\0"),
+      table.concat(rel, "\0"))
+   eq(path.normalize_all(""), "")
+   eq(path.normalize_all("\n"), ".\n")
+   fail(".*string expected at index 2, got table.*", function()
+      path.normalize_all { "a", {} }
+   end)
+   fail(".*separator must be one char.*", function()
+      path.abs_all("a", "ab")
+   end)
+end
+
 function _G.test_makedirs()
    if info.platform == "windows" then
       local long = "//?/"..("a"):rep(1024)
@@ -967,6 +1147,49 @@ function _G.test_dir()
    test_count(36, fs.scandir())
    test_count(5, fs.scandir(1))
    test_count(11, fs.scandir(2))
+   test_count(11, fs.scandir { limit = 2 })
+   test_count(36, fs.scandir { bufsize = 1 })
+   test_count(5, fs.scandir(1, { bufsize = 1 }))
+   test_count(3, fs.dir { bufsize = 1 })
+
+   local function batch_iter(batch, f, ...)
+      return f(..., { batch = batch })
+   end
+   for _, batch in ipairs { 1, 5, 1000 } do
+      local r, t = {}, {}
+      for fn, ty in fs.scandir "." do r[#r+1] = fn .. ":" .. ty end
+      for paths, states, n in batch_iter(batch, fs.scandir, ".") do
+         eq(#paths, n); eq(#states, n)
+         assert(n <= batch)
+         for i = 1, n do t[#t+1] = paths[i] .. ":" .. states[i] end
+      end
+      table_eq(t, r)
+      r, t = {}, {}
+      for fn, ty in fs.glob "**/*.txt" do r[#r+1] = fn .. ":" .. ty end
+      for paths, states, n in batch_iter(batch, fs.glob, "**/*.txt") do
+         for i = 1, n do t[#t+1] = paths[i] .. ":" .. states[i] end
+      end
+      table_eq(t, r)
+   end
+   local paths, states = {}, {}
+   local iters = 0
+   for p, s, n in fs.dir(".", { batch = 2, paths = paths, states = states }) do
+      assert(rawequal(p, paths)); assert(rawequal(s, states))
+      iters = iters + 1
+      if iters == 2 then eq(n, 1); eq(#p, 1); eq(#s, 1) end
+   end
+   eq(iters, 2)
+
+   assert(fs.mkdir "../test_wide")
+   assert(fs.chdir "../test_wide")
+   local wide = {}
+   for i = 1, 200 do wide[i] = ("file_with_a_long_name_%03d"):format(i) end
+   wide.sub = {}
+   for i = 1, 200 do wide.sub[i] = ("sub_file_%03d"):format(i) end
+   maketree(wide)
+   test_count(404, fs.scandir { bufsize = 1 })
+   test_count(404, fs.scandir())
+   assert(fs.chdir "../test_glob")
 
    assert(fs.mkdir "../test_deep")
    assert(fs.chdir "../test_deep")
@@ -1034,6 +1257,597 @@ function _G.test_walk()
 end
 in_tmpdir "test_walk"
 
+function _G.test_pscandir()
+   if info.platform == "windows" then
+      local ok, err = fs.pscandir "."
+      eq(ok, nil); assert(err)
+      return
+   end
+   maketree(glob_tree)
+   local function collect(...)
+      local t = {}
+      for fn, ty in ... do
+         local k = fn .. ":" .. ty
+         assert(not t[k], k)
+         t[k] = true
+      end
+      return t
+   end
+   for _, limit in ipairs { -1, 1, 2 } do
+      local r = collect(fs.scandir("test_glob", limit))
+      for _, threads in ipairs { 1, 4 } do
+         eq(collect(fs.pscandir("test_glob", limit, { threads = threads })), r)
+         eq(collect(fs.pscandir("test_glob", limit,
+            { threads = threads, grouped = true, queue = 1 })), r)
+      end
+   end
+   -- "in" and "out" of a folder surround all items under it
+   for _, grouped in ipairs { false, true } do
+      local open, cur = {}, nil
+      for fn, ty in fs.pscandir("test_glob", { threads = 4, grouped = grouped }) do
+         local parent = path.parent(fn)
+         if ty == "in" then
+            assert(fn == "test_glob" or open[parent], fn)
+            if open[parent] then open[parent] = open[parent] + 1 end
+            open[fn], cur = 0, fn
+         elseif ty == "out" then
+            eq(open[fn], 0, fn)
+            if open[parent] then open[parent] = open[parent] - 1 end
+            open[fn], cur = nil, nil
+         else
+            assert(open[parent], fn)
+            if grouped then eq(parent, cur) end
+         end
+      end
+      eq(next(open), nil)
+   end
+   eq(collect(fs.pscandir "top.txt"), { ["top.txt:file"] = true })
+   eq(collect(fs.pscandir "-not-exists-"), {})
+   for _ in fs.pscandir("test_glob", { threads = 4, queue = 1 }) do break end
+   collectgarbage "collect"
+end
+in_tmpdir "test_pscandir"
+
+function _G.test_du()
+   if info.platform == "windows" then return end
+   maketree { u = { "x.txt", a = { "y.txt", b = { "z.lua" } }, c = { "n" } } }
+   local function write(fn, n)
+      local fh = assert(io.open(fn, "w")); fh:write(("x"):rep(n)); fh:close()
+   end
+   write("u/x.txt", 10); write("u/a/y.txt", 100)
+   write("u/a/b/z.lua", 1000); write("u/c/n", 5)
+   local function dirs(...) -- folders have sizes as well
+      local n = 0
+      for _, d in ipairs { ... } do n = n + fs.size(d) end
+      return n
+   end
+   for _, threads in ipairs { 1, 3 } do
+      local r = assert(fs.du("u", { threads = threads, depth = 1, exts = true }))
+      eq(r.files, 4); eq(r.dirs, 4); eq(r.errors, 0)
+      eq(r.bytes, 1115 + dirs("u", "u/a", "u/a/b", "u/c"))
+      assert(r.blocks >= 0)
+      eq(r.exts[".txt"], { bytes = 110, files = 2 })
+      eq(r.exts[".lua"], { bytes = 1000, files = 1 })
+      eq(r.exts[""], { bytes = 5, files = 1 })
+      eq(r.tree["u/a"].files, 2); eq(r.tree["u/a"].dirs, 2)
+      eq(r.tree["u/a"].bytes, 1100 + dirs("u/a", "u/a/b"))
+      eq(r.tree["u/c"].bytes, 5 + dirs "u/c")
+      eq(r.tree["u/a/b"], nil)
+   end
+   local r = assert(fs.du "u/a/b/z.lua")
+   eq(r.files, 1); eq(r.dirs, 0); eq(r.bytes, 1000); eq(r.tree, nil)
+   eq(assert(fs.du("u", "c")).bytes, 5 + dirs "u/c")
+   local ok, err = fs.du "-not-exists-"
+   eq(ok, nil)
+   eq(err:match "errno=2" ~= nil, true)
+end
+in_tmpdir "test_du"
+
+function _G.test_cache()
+   local cache = fs.cache
+   if info.platform == "windows" then
+      eq(cache.enable(), nil)
+      return
+   end
+   eq(cache.enable(), true)
+   eq(fs.exists "c", false)
+   eq(fs.exists "c", false) -- negative entries are cached too
+   local st = cache.stats()
+   eq(st.enabled, true); eq(st.hits, 1); eq(st.misses, 1); eq(st.entries, 1)
+   assert(fs.mkdir "c") -- lpath's own changes invalidate the cache
+   eq(fs.exists "c", true)
+   assert(fs.touch "c/f")
+   eq(fs.isfile "c/f", "c/f")
+   assert(os.remove "c/f")
+   eq(fs.isfile("c", "f"), "c/f") -- changed outside, still cached
+   eq(cache.invalidate "c", 1)
+   eq(fs.isfile "c/f", false)
+   assert(fs.touch "c/g")
+   eq(fs.exists "c/g", true)
+   assert(fs.rename("c", "d"))
+   eq(fs.exists "c/g", false)
+   eq(fs.exists "d/g", true)
+   eq(fs.removedirs "d", 2)
+   eq(fs.exists "d/g", false)
+   eq(fs.exists "d", false)
+   local entries = cache.stats().entries
+   eq(cache.invalidate(), entries)
+   eq(cache.stats().entries, 0)
+   local up = "../" .. fs.getcwd():match "[^/]+$" .. "/a"
+   eq(fs.exists(path.abs "a"), false) -- keyed by absolute paths
+   eq(fs.exists(up), false)
+   assert(fs.mkdir "a")
+   eq(fs.exists(path.abs "a"), true)
+   eq(fs.exists(up), true)
+   assert(fs.rmdir(up))
+   eq(fs.exists "a", false)
+   eq(cache.enable { ttl = 0.01 }, true)
+   assert(fs.touch "x")
+   eq(fs.exists "x", true)
+   assert(os.remove "x")
+   local start = os.clock()
+   repeat until os.clock() - start > 0.02
+   eq(fs.exists "x", false)
+   cache.disable()
+   eq(cache.stats().enabled, false)
+   eq(cache.stats().hits, 0)
+end
+in_tmpdir "test_cache"
+
+function _G.test_entry()
+   maketree(glob_tree)
+   local fh = assert(io.open("test_glob/test.txt", "w"))
+   fh:write "hello"; fh:close()
+   local plain, kept = {}, {}
+   for fn, ty in fs.scandir "test_glob" do plain[#plain+1] = fn .. ":" .. ty end
+   local t = {}
+   for e, ty in fs.scandir("test_glob", { entry = true }) do
+      local fn = e:path()
+      t[#t+1] = fn .. ":" .. ty
+      eq(tostring(e), fn)
+      eq(e:name(), path.name(fn))
+      eq(e:isdir(), ty ~= "file")
+      eq(e:isfile(), ty == "file")
+      eq(e:type(), ty == "file" and "file" or "dir")
+      assert(not e:islink())
+      eq(e:mtime(), fs.mtime(fn))
+      eq(e:size(), fs.size(fn))
+      if info.platform ~= "windows" then
+         assert(math.type == nil or math.type(e:ino()) == "integer")
+         assert(e:mode())
+      end
+      kept[fn] = e
+   end
+   table_eq(t, plain)
+   -- parent closed, fall back to the whole path
+   eq(kept["test_glob/test.txt"]:size(), 5)
+   eq(kept["test_glob"]:name(), "test_glob")
+   t = {}
+   for e in fs.glob("test_glob/**/*.txt", { entry = true }) do
+      t[#t+1] = e:name()
+   end
+   table_eq(t, { "test.txt", "case1.txt", "case2.txt" })
+   for paths, _, n in fs.dir("test_glob", { entry = true, batch = 2 }) do
+      for i = 1, n do assert(paths[i]:type()) end
+   end
+   local e
+   for e1 in fs.dir(".", { entry = true }) do
+      if e1:name() == "top.txt" then e = e1 end
+   end
+   assert(fs.remove "top.txt")
+   local ok, err = e:size()
+   eq(ok, nil); assert(err:match "^stat:.-top%.txt:", err)
+   if info.platform ~= "windows" then
+      -- stat relative to the opened parent directory
+      local cwd = fs.getcwd()
+      for e1, ty in fs.scandir("test_glob", 1, { entry = true }) do
+         assert(fs.chdir "/")
+         if ty == "file" then eq(e1:size(), 5) end
+         assert(fs.chdir(cwd))
+      end
+      assert(fs.symlink("test_glob", "link"))
+      for e1 in fs.dir(".", { entry = true }) do
+         if e1:name() == "link" then
+            assert(e1:islink()); assert(not e1:isdir())
+            eq(e1:type(), "link")
+         end
+      end
+   end
+   collectgarbage "collect"
+end
+in_tmpdir "test_entry"
+
+function _G.test_sorted()
+   maketree { t = { "file10", "file2", "file1", "File3", "x01", "x1",
+      dir = { "z", "y" } } }
+   local function collect(...)
+      local t = {}
+      for fn, ty in ... do t[#t+1] = tostring(fn) .. ":" .. ty end
+      return t
+   end
+   local sep = info.sep
+   local function P(s) return (s:gsub("/", sep)) end
+   fail(".-invalid sort order 'foo'", function() fs.dir("t", { sorted = "foo" }) end)
+   eq(collect(fs.dir("t", { sorted = true })), {
+      P"t/File3:file", P"t/dir:dir", P"t/file1:file", P"t/file10:file",
+      P"t/file2:file", P"t/x01:file", P"t/x1:file" })
+   eq(collect(fs.dir("t", { sorted = "natural" })), {
+      P"t/File3:file", P"t/dir:dir", P"t/file1:file", P"t/file2:file",
+      P"t/file10:file", P"t/x01:file", P"t/x1:file" })
+   eq(collect(fs.scandir("t", { sorted = "bytes", bufsize = 1 })), {
+      P"t:in", P"t/File3:file", P"t/dir:in", P"t/dir/y:file",
+      P"t/dir/z:file", P"t/dir:out", P"t/file1:file", P"t/file10:file",
+      P"t/file2:file", P"t/x01:file", P"t/x1:file", P"t:out" })
+   eq(collect(fs.glob("t/**/[xy]*", { sorted = true, entry = true })), {
+      P"t/dir/y:file", P"t/x01:file", P"t/x1:file" })
+   local n = 0
+   for e, ty in fs.scandir("t", { sorted = true, entry = true }) do
+      eq(e:isdir(), ty ~= "file"); n = n + 1
+   end
+   eq(n, 12)
+end
+in_tmpdir "test_sorted"
+
+function _G.test_prune()
+   maketree { p = { "a.txt", "b.log", [".git"] = { "HEAD" },
+      node_modules = { "x.js" }, keep = { "z.log" },
+      src = { "main.c", "main.o", build = { "out.bin" } } } }
+   local function collect(...)
+      local t = {}
+      for fn, ty in ... do t[#t+1] = fn .. ":" .. ty end
+      return t
+   end
+   local sep = info.sep
+   local function P(s) return (s:gsub("/", sep)) end
+   table_eq(collect(fs.scandir("p", { exclude = { ".git", "node_modules", "src" } })), {
+      "p:in", "p:out", P"p/a.txt:file", P"p/b.log:file",
+      P"p/keep:in", P"p/keep:out", P"p/keep/z.log:file" })
+   table_eq(collect(fs.dir("p", { exclude = ".git", ignore = "*.txt\n*.log" })), {
+      P"p/keep:dir", P"p/node_modules:dir", P"p/src:dir" })
+   table_eq(collect(fs.scandir("p", { ignore = { "*.log", "!keep/z.log", "build/",
+      "/src/*.o", "**/HEAD", "node_modules/", "# comment", "" } })), {
+      "p:in", "p:out", P"p/.git:in", P"p/.git:out", P"p/a.txt:file",
+      P"p/keep:in", P"p/keep:out", P"p/keep/z.log:file",
+      P"p/src:in", P"p/src:out", P"p/src/main.c:file" })
+   local fh = assert(io.open(P"p/.ignore", "w"))
+   fh:write "# ignore file\r\nsrc/**\n.*\n"
+   fh:close()
+   table_eq(collect(fs.scandir("p", 1, { ignorefile = { P"p/.ignore", "-not-exists-" },
+      exclude = "node_modules" })), {
+      "p:in", "p:out", P"p/a.txt:file", P"p/b.log:file",
+      P"p/keep:dir", P"p/src:dir" })
+   table_eq(collect(fs.glob("p/**/*.c", { exclude = "src" })), {})
+   table_eq(collect(fs.glob("p/**/*.c", { ignore = "build" })), { P"p/src/main.c:file" })
+   table_eq(collect(fs.scandir("p", { xdev = true })), collect(fs.scandir "p"))
+   assert(fs.unlockdirs("p", { exclude = "keep" }))
+   assert(fs.removedirs("p", { ignore = "keep/" }))
+   assert(fs.isfile(P"p/keep/z.log"))
+   assert(not fs.exists(P"p/a.txt"))
+   assert(not fs.exists(P"p/src"))
+   assert(fs.removedirs "p")
+   assert(not fs.exists "p")
+   maketree { p = { "a", s = { "b" } } }
+   eq(fs.removedirs("p", { xdev = true }), 4)
+   assert(not fs.exists "p")
+end
+in_tmpdir "test_prune"
+
+function _G.test_globset()
+   local gs = path.globset { "*.c", "Makefile", "src/**/*.h", "build/",
+      "*.tar.gz", "a?c", "[!x]*.txt", "/top/*.lua", "*_1?.c" }
+   eq(gs:match "x.c", 1)
+   eq(gs:match "dir/Makefile", 2)
+   eq(gs:match "src/x.h", 3)
+   eq(gs:match "src/a/b/x.h", 3)
+   eq(gs:match "x/src/x.h", nil)
+   eq(gs:match "build", nil)
+   eq(gs:match "build/", 4)
+   eq(gs:match "a.tar.gz", 5)
+   eq(gs:match "a.gz", nil)
+   eq(gs:match "abc", 6)
+   eq(gs:match "x.txt", nil)
+   eq(gs:match "y.txt", 7)
+   eq(gs:match "top/a.lua", 8)
+   eq(gs:match "a/top/a.lua", nil)
+   table_eq(gs:matches "a_12.c", { 1, 9 })
+   table_eq(gs:matches "a.h", {})
+   gs = path.globset { "*.{c,h}", "{a,b}*" }
+   eq(gs:match "x.h", 1)
+   table_eq(gs:matches "a.c", { 1, 2 })
+   table_eq(path.globset { "{a,?}.c" }:matches "a.c", { 1 })
+   local pats = {}
+   for i = 1, 200 do pats[i] = ("*_%d?.c"):format(i) end
+   table_eq(path.globset(pats):matches "x_12a.c", { 12 })
+   fail(".*empty pattern at index 2.*", function() path.globset { "a", "/" } end)
+   fail(".*string expected at index 1, got table.*", function()
+      path.globset { {} }
+   end)
+
+   maketree { p = { "a.c", "b.h", "Makefile", src = { "x.c", "y.h",
+      build = { "z.c" } }, build = { "out.c" } } }
+   local function collect(...)
+      local t = {}
+      for fn, ty in ... do t[#t+1] = fn .. ":" .. ty end
+      table.sort(t)
+      return t
+   end
+   local sep = info.sep
+   local function P(s) return (s:gsub("/", sep)) end
+   table_eq(collect(fs.scandir("p", { filter = path.globset { "*.c" } })), {
+      "p:in", "p:out", P"p/a.c:file", P"p/build/out.c:file",
+      P"p/src/build/z.c:file", P"p/src/x.c:file" })
+   table_eq(collect(fs.scandir("p", { filter = path.globset { "src/**/*.c", "build/" },
+      exclude = "build" })), {
+      "p:in", "p:out", P"p/src/x.c:file" })
+   table_eq(collect(fs.scandir("p", { filter = path.globset { "build/" } })), {
+      "p:in", "p:out", P"p/build:in", P"p/build:out",
+      P"p/src/build:in", P"p/src/build:out" })
+   fail(".*globset expected in option 'filter'.*", function()
+      fs.scandir("p", { filter = "*.c" })
+   end)
+end
+in_tmpdir "test_globset"
+
+function _G.test_follow()
+   if info.platform == "windows" then return end
+   maketree { f = { real = { "a", sub = { "b" } } } }
+   assert(fs.symlink("real", "f/link"))
+   assert(fs.symlink("..", "f/real/sub/loop"))
+   assert(fs.symlink("-not-exists-", "f/broken"))
+   local function collect(...)
+      local t = {}
+      for fn, ty in ... do t[#t+1] = tostring(fn) .. ":" .. ty end
+      return t
+   end
+   eq(collect(fs.scandir("f", { sorted = true })), {
+      "f:in", "f/broken:file", "f/link:file", "f/real:in", "f/real/a:file",
+      "f/real/sub:in", "f/real/sub/b:file", "f/real/sub/loop:file",
+      "f/real/sub:out", "f/real:out", "f:out" })
+   -- only folders being walked are not walked into again
+   eq(collect(fs.scandir("f", { sorted = true, follow = true })), {
+      "f:in", "f/broken:file", "f/link:in", "f/link/a:file",
+      "f/link/sub:in", "f/link/sub/b:file", "f/link/sub/loop:dir",
+      "f/link/sub:out", "f/link:out", "f/real:in", "f/real/a:file",
+      "f/real/sub:in", "f/real/sub/b:file", "f/real/sub/loop:dir",
+      "f/real/sub:out", "f/real:out", "f:out" })
+   eq(collect(fs.scandir("f/link", { sorted = true, follow = true })), {
+      "f/link:in", "f/link/a:file", "f/link/sub:in", "f/link/sub/b:file",
+      "f/link/sub/loop:dir", "f/link/sub:out", "f/link:out" })
+   local t = {}
+   for e, ty in fs.dir("f", { follow = true, entry = true }) do
+      t[e:name()] = e:type() .. ":" .. ty
+   end
+   eq(t, { broken = "link:file", link = "dir:dir", real = "dir:dir" })
+   if os.execute "ln f/real/a f/real/hard" then
+      eq(collect(fs.dir("f/real", { sorted = true, unique = true })), {
+         "f/real/a:file", "f/real/sub:dir" })
+      eq(collect(fs.scandir("f", { sorted = true, follow = true,
+         unique = true, exclude = "sub" })), {
+         "f:in", "f/broken:file", "f/link:in", "f/link/a:file",
+         "f/link:out", "f/real:in", "f/real:out", "f:out" })
+   end
+   assert(fs.removedirs("f", { follow = true }))
+   assert(not fs.exists "f")
+end
+in_tmpdir "test_follow"
+
+function _G.test_resume()
+   maketree(glob_tree)
+   maketree { r = { "a", "b", e = {}, d = { "x", f = { "y" } } } }
+   local function collect(it, w)
+      local t = {}
+      for fn, ty in it, w do t[#t+1] = fn .. ":" .. ty end
+      return t
+   end
+   local function slices(walk, root, opts, size)
+      local t, cursor = {}, nil
+      repeat
+         opts.max_entries, opts.resume = size, cursor
+         local it, w = walk(root, opts)
+         local slice = collect(it, w)
+         assert(#slice <= size)
+         for _, v in ipairs(slice) do t[#t+1] = v end
+         cursor = w:checkpoint()
+      until cursor == nil
+      return t
+   end
+   for _, walk in ipairs { fs.dir, fs.scandir } do
+      for _, sorted in ipairs { false, true, "natural" } do
+         for _, root in ipairs { "test_glob", "r", "r/a", "r/e", "-not-exists-" } do
+            local all = collect(walk(root, { sorted = sorted }))
+            for size = 1, 4 do
+               eq(slices(walk, root, { sorted = sorted }, size), all)
+            end
+            -- stop at every item, and resume from there
+            for k = 0, #all do
+               local it, w = walk(root, { sorted = sorted })
+               for _ = 1, k do it(w) end
+               local cursor = w:checkpoint()
+               local rest = cursor and collect(walk(root,
+                  { sorted = sorted, resume = cursor })) or {}
+               eq(#rest, #all - k)
+               for i, v in ipairs(rest) do eq(v, all[k+i]) end
+            end
+         end
+      end
+   end
+   eq(slices(fs.scandir, "r", { sorted = true }, 2),
+      collect(fs.scandir("r", { sorted = true })))
+   local all = collect(fs.scandir("r", 2, { sorted = true }))
+   eq(slices(fs.scandir, "r", { sorted = true, limit = 2 }, 3), all)
+   local it, w = fs.scandir("r", { deadline = 0 })
+   eq(it(w), nil)
+   eq(collect(fs.scandir("r", { resume = w:checkpoint() })),
+      collect(fs.scandir "r"))
+   it, w = fs.scandir("r", { deadline = 60 })
+   eq(collect(it, w), collect(fs.scandir "r"))
+   eq(w:checkpoint(), nil)
+   it, w = fs.scandir("r", { sorted = true, max_entries = 3 })
+   eq(collect(it, w), { "r:in", "r/a:file", "r/b:file" })
+   local cursor = w:checkpoint()
+   eq(type(cursor), "string")
+   getmetatable(w).__close(w)
+   fail(".-walker is closed", function() w:checkpoint() end)
+   fail(".-invalid cursor", function() fs.scandir("r", { resume = "xyz" }) end)
+   fail(".-does not match the 'sorted' option",
+      function() fs.scandir("r", { resume = cursor }) end)
+   for _, fn in ipairs { "r/d/f/y", "r/d/f", "r/d/x", "r/d" } do
+      assert(fs.remove(fn))
+   end
+   local ok, err = pcall(fs.scandir, "r", { sorted = true, resume = "1bf/0:1:d/0:1:x" })
+   assert(not ok and err:match "walkin:r/d:", err)
+end
+in_tmpdir "test_resume"
+
+function _G.test_stats()
+   maketree(glob_tree)
+   local fh = assert(io.open("test_glob/test.txt", "w"))
+   fh:write "hello"; fh:close()
+   local list = { "test_glob", "-not-exists-" }
+   for fn in fs.scandir "test_glob" do list[#list+1] = fn end
+   eq(#fs.stats {}, 0)
+   for _, opts in ipairs { {}, { uring = false }, { depth = 2 }, { depth = 1 } } do
+      local t = fs.stats(list, opts)
+      eq(#t, #list)
+      for i, e in ipairs(t) do
+         eq(e:path(), list[i])
+         if i == 2 then
+            eq(e:type(), nil)
+            local ok, err = e:size()
+            eq(ok, nil); assert(err:match "^stat:%-not%-exists%-:", err)
+         else
+            eq(e:isdir(), not not fs.isdir(list[i]))
+            eq(e:size(), fs.size(list[i]))
+            eq(e:mtime(), fs.mtime(list[i]))
+         end
+      end
+   end
+   eq(fs.stats { "test_glob/test.txt" }[1]:size(), 5)
+   eq(fs.stats { "" }[1]:path(), ".")
+   fail(".-string expected at index 2, got table",
+      function() fs.stats { "test_glob", {} } end)
+   if info.platform ~= "windows" then
+      assert(fs.symlink("test_glob", "link"))
+      eq(fs.stats { "link" }[1]:type(), "link")
+      eq(fs.stats({ "link" }, { follow = true })[1]:type(), "dir")
+      assert(fs.remove "link")
+   end
+end
+in_tmpdir "test_stats"
+
+function _G.test_changes()
+   if info.platform == "windows" then return end
+   maketree { c = { "x", a = { "y", b = {} } } }
+   local function run(st, opts, root)
+      local paths, kinds, state = fs.changes(root or "c", st, opts)
+      local t = {}
+      for i, fn in ipairs(paths) do t[#t+1] = kinds[i] .. ":" .. fn end
+      table.sort(t)
+      return t, state
+   end
+   local t, st = run()
+   eq(t, { "added:c", "added:c/a", "added:c/a/b", "added:c/a/y", "added:c/x" })
+   t, st = run(st); eq(t, {})
+   -- folders changed just now are always read again, make them older
+   local old = os.time() - 100
+   for _, d in ipairs { "c", "c/a", "c/a/b" } do assert(fs.touch(d, old, old)) end
+   t, st = run(st); eq(t, {})
+   local fh = assert(io.open("c/a/y", "w")); fh:write "hello"; fh:close()
+   t, st = run(st); eq(t, {}) -- "c/a" is not read again
+   t, st = run(st, { files = true }); eq(t, { "modified:c/a/y" })
+   assert(fs.remove "c/x")
+   assert(fs.makedirs "c/z/w")
+   assert(fs.touch "c/z/w/q")
+   assert(fs.touch "c/a/b/n")
+   t, st = run(st)
+   eq(t, { "added:c/a/b/n", "added:c/z", "added:c/z/w", "added:c/z/w/q",
+      "removed:c/x" })
+   assert(fs.removedirs "c/z")
+   assert(fs.touch "c/z")
+   t, st = run(st)
+   eq(t, { "added:c/z", "removed:c/z", "removed:c/z/w", "removed:c/z/w/q" })
+   assert(fs.removedirs "c")
+   local paths, kinds, st2 = fs.changes("c", st)
+   eq(paths, { "c/a/b/n", "c/a/b", "c/a/y", "c/a", "c/z", "c" })
+   eq(kinds, { "removed", "removed", "removed", "removed", "removed", "removed" })
+   eq(st2, "LPCH1")
+   eq(run(st2), {})
+   fail(".-%(invalid state%)", function() fs.changes("c", "LPCH1\1\0") end)
+   fail(".-%(invalid state%)", function() fs.changes("c", "xyz") end)
+   maketree { p = { "x.log", "y", n = { "z.log" }, skip = { "w" } } }
+   local opts = { exclude = "skip", ignore = "*.log", xdev = true }
+   t, st = run(nil, opts, "p")
+   eq(t, { "added:p", "added:p/n", "added:p/y" })
+   for _, d in ipairs { "p", "p/n" } do assert(fs.touch(d, old, old)) end
+   assert(fs.touch "p/q.log")
+   assert(fs.touch "p/skip/v")
+   t, st = run(st, opts, "p"); eq(t, {})
+   assert(fs.touch "p/n/m")
+   t, st = run(st, opts, "p"); eq(t, { "added:p/n/m" })
+   for _, d in ipairs { "p", "p/n" } do assert(fs.touch(d, old, old)) end
+   t, st = run(st, opts, "p"); eq(t, {})
+   -- unchanged folders are pruned by the new options too
+   t, st = run(st, { exclude = { "skip", "n" }, ignore = "*.log" }, "p")
+   eq(t, { "removed:p/n", "removed:p/n/m" })
+   -- the root may be a symbolic link
+   assert(fs.symlink("p", "lp"))
+   t, st = run(nil, opts, "lp")
+   eq(t, { "added:lp", "added:lp/n", "added:lp/n/m", "added:lp/y" })
+   t, st = run(st, opts, "lp"); eq(t, {})
+end
+in_tmpdir "test_changes"
+
+function _G.test_watch()
+   if info.platform ~= "linux" then return end
+   maketree { w = { "x", a = { "y" }, skip = {} } }
+   local watch = assert(fs.watch("w", { window = 0.01, exclude = "skip" }))
+   local function run(timeout)
+      local t, paths, kinds, wait = {}
+      repeat -- events of a burst may be ready in different reads
+         paths, kinds, wait = watch:read(wait or timeout)
+         for i, fn in ipairs(paths) do t[#t+1] = kinds[i] .. ":" .. fn end
+      until not wait
+      table.sort(t)
+      return t
+   end
+   eq(type(watch:fd()), "number")
+   eq(run(), {})
+   assert(fs.touch "w/n")
+   assert(fs.touch "w/skip/z")
+   assert(fs.makedirs "w/d/e")
+   assert(fs.touch "w/d/e/f")
+   eq(run(1), { "added:w/d", "added:w/d/e", "added:w/d/e/f", "added:w/n" })
+   -- new folders are watched as well
+   assert(fs.touch "w/d/e/g")
+   assert(fs.remove "w/x")
+   local fh = assert(io.open("w/a/y", "w")); fh:write "hello"; fh:close()
+   assert(fs.touch "w/tmp"); assert(fs.remove "w/tmp")
+   eq(run(1), { "added:w/d/e/g", "modified:w/a/y", "removed:w/x" })
+   assert(fs.rename("w/d", "w/a/d"))
+   assert(fs.touch "w/a/d/e/h")
+   eq(run(1), { "added:w/a/d", "added:w/a/d/e", "added:w/a/d/e/f",
+      "added:w/a/d/e/g", "added:w/a/d/e/h", "removed:w/d" })
+   -- unreadable folders are reported, but not watched
+   if os.execute "mkdir w/l && chmod 0 w/l" then
+      assert(fs.touch "w/m")
+      eq(run(1), { "added:w/l", "added:w/m" })
+      assert(fs.rmdir "w/l")
+      assert(fs.remove "w/m")
+      eq(run(1), { "removed:w/l", "removed:w/m" })
+   end
+   eq(run(), {})
+   assert(fs.removedirs "w")
+   eq(run(1), { "removed:w", "removed:w/a", "removed:w/a/d", "removed:w/a/d/e",
+      "removed:w/a/d/e/f", "removed:w/a/d/e/g", "removed:w/a/d/e/h",
+      "removed:w/a/y", "removed:w/n" })
+   assert(watch:close() == nil)
+   fail(".-watch is closed", function() watch:read() end)
+   local ok, err = fs.watch "-not-exists-"
+   eq(ok, nil)
+   eq(err:match "errno=2" ~= nil, true)
+end
+in_tmpdir "test_watch"
+
 function _G.test_attr()
    maketree(dir_table)
    assert(fs.isdir "test")
@@ -1157,5 +1971,181 @@ function _G.test_glob()
 end
 in_tmpdir "test_glob"
 
+function _G.test_glob_probe()
+   -- literal parts after a wildcard are looked up, not listed
+   local hosts = {}
+   for i = 1, 12 do
+      hosts[("h%02d"):format(i)] = { "x", current = { "app.log", "b.log" } }
+   end
+   hosts.h03.current = nil
+   hosts.h04 = { "current" }
+   maketree { hosts = hosts }
+   local function collect(pat, opts)
+      local t = {}
+      for fn, ty in fs.glob(pat, opts or {}) do t[#t+1] = tostring(fn) .. ":" .. ty end
+      table.sort(t)
+      return t
+   end
+   local r = collect "hosts/*/current/app.log"
+   eq(#r, 10)
+   table_eq(r, collect "hosts/*/curren[t]/app.lo[g]")
+   table_eq(collect("hosts/*/current/app.log", { sorted = true }), r)
+   table_eq(collect("hosts/*/current/app.log", { entry = true }), r)
+   table_eq(collect "hosts/*/current", collect "hosts/*/curren[t]")
+   table_eq(collect "hosts/*/x/app.log", {})
+   table_eq(collect "hosts/*/nothing/app.log", {})
+   table_eq(collect "hosts/*/current/app.lo", {})
+   table_eq(collect "hosts/h04/current", { path("hosts/h04/current") .. ":file" })
+end
+in_tmpdir "test_glob_probe"
+
+function _G.test_glob_braces()
+   maketree { "top.c", lib = { "z.c" }, src = {
+      a = { "x.c", "x.h" }, b = { "y.c" } }, include = { a = { "x.h" } } }
+   local function collect(...)
+      local t = {}
+      for fn, ty in fs.glob(...) do t[#t+1] = tostring(fn) .. ":" .. ty end
+      table.sort(t)
+      return t
+   end
+   table_eq(collect "src/*/*.{c,h}", {
+      path "src/a/x.c:file", path "src/a/x.h:file", path "src/b/y.c:file" })
+   table_eq(collect "{src,include}/*/*.h", {
+      path "include/a/x.h:file", path "src/a/x.h:file" })
+   table_eq(collect "{src/a,src/b}/*.c", collect "src/*/*.c")
+   -- overlapped alternatives yield an entry once
+   table_eq(collect "{src/**/*.c,*.c,src/a/*.c}", {
+      path "src/a/x.c:file", path "src/b/y.c:file", "top.c:file" })
+   table_eq(collect "{top.c,lib,nothing}", { "lib:dir", "top.c:file" })
+   table_eq(collect "{lib,lib/z.c}", { "lib:in", "lib:out", path "lib/z.c:file" })
+   table_eq(collect "src/{a,b{,c}}/", { path "src/a:dir", path "src/b:dir" })
+   table_eq(collect "src/{a}/*", {})
+   table_eq(collect "[{]*", {})
+   fail(".*alternatives in pattern have different roots.*", function()
+      fs.glob "{/usr,lib}/*"
+   end)
+   fail(".*too many alternatives in pattern.*", function()
+      fs.glob(("{a,b}"):rep(11))
+   end)
+   assert(fs.chdir "lib")
+   table_eq(collect "../{src,lib}/*.c", { path "../lib/z.c:file" })
+   assert(fs.chdir "..")
+
+   local c = path.glob_compile "src/{a,b}/*.{c,h}"
+   eq(c:match "src/b/y.c", "src/b/y.c")
+   eq(c:match "src/c/y.c", nil)
+   local t = {}
+   for fn in c:walk() do t[#t+1] = fn end
+   table.sort(t)
+   table_eq(t, { path "src/a/x.c", path "src/a/x.h", path "src/b/y.c" })
+
+   eq(path.fnmatch("x.c", "*.{c,h}"), true)
+   eq(path.fnmatch("x.o", "*.{c,h}"), false)
+   eq(path.fnmatch("{a}", "{a}"), true)
+   eq(path.fnmatch("", "{,a}"), true)
+   eq(path.fnmatch("ab", "a{b,c{d,e}}"), true)
+   eq(path.fnmatch("ace", "a{b,c{d,e}}"), true)
+   eq(path.fnmatch("ac", "a{b,c{d,e}}"), false)
+   eq(path.match("src/a/x.c", "src/{a,b}/*.c"), "src/a/x.c")
+   eq(path.match("src/c/x.c", "src/{a,b}/*.c"), nil)
+end
+in_tmpdir "test_glob_braces"
+
+function _G.test_glob_prune()
+   -- folders nothing can match in are yielded but not walked into
+   maketree { src = { a = { "x.c", b = { "y.c" } }, b = { c = { "z.c" } } } }
+   local function collect(pat)
+      local t = {}
+      for fn, ty in fs.glob(pat) do t[#t+1] = tostring(fn) .. ":" .. ty end
+      table.sort(t)
+      return t
+   end
+   table_eq(collect "{src/*,src/a/*.c}", {
+      path "src/a:in", path "src/a:out", path "src/a/x.c:file", path "src/b:dir" })
+   table_eq(collect "src/[a]/**/*.c", { path "src/a/b/y.c:file", path "src/a/x.c:file" })
+   table_eq(collect "src/*/b/*.c", { path "src/a/b/y.c:file" })
+   table_eq(collect "{src/a/b,src/[ab]/b}/*.c", { path "src/a/b/y.c:file" })
+   table_eq(collect "src/*/c", { path "src/b/c:dir" })
+   table_eq(collect "src/{a*,*b}/c/*", { path "src/b/c/z.c:file" })
+end
+in_tmpdir "test_glob_prune"
+function _G.test_glob_dstars()
+   -- many '**' match in steps, not by trying every split of the path
+   local deep = ("a/"):rep(40) .. "b"
+   for _, case in ipairs {
+      { "**/a/**/a/**/a/**/c/**/b", false },
+      { "**/a/**/a/**/a/**/a/**/a/**/c", false },
+      { "**/a/**/a/**/a/**/a/**/a/**/b", true },
+      { "**/*/**/*/**/*/**/*/**/x", false },
+      { "**/*/**/*/**/*/**/*/**/b", true },
+      { "a/**/**/a/**/b", true },
+      { "**/a/b/a", false },
+   } do
+      local pat, ok = case[1], case[2]
+      eq(path.glob_compile(pat):match(deep) ~= nil, ok, pat)
+      eq(path.globset({ pat }):match(deep), ok and 1 or nil, pat)
+   end
+   local c = path.glob_compile "**/a/**/b/**"
+   eq(c:match "a/b", "a/b")
+   eq(c:match "x/a/y/b/z/", "x/a/y/b/z/")
+   eq(c:match "b/a", nil)
+   table_eq(c:filter { "a/b/c", "b/a/c", "a/a/b" }, { "a/b/c", "a/a/b" })
+   local gs = path.globset { "**/a/**/b/**", "**/b" }
+   table_eq(gs:matches "a/b", { 1, 2 })
+   table_eq(gs:matches "b/a", {})
+   -- a pattern of 64 parts or more still matches
+   local long = ("*/"):rep(70) .. "**/b"
+   eq(path.globset({ long }):match(deep), nil)
+   eq(path.globset({ long }):match(("a/"):rep(70) .. "b"), 1)
+end
+in_tmpdir "test_glob_dstars"
+
+function _G.test_glob_compile()
+   local function walk(c, ...)
+      local t = {}
+      for fn in c:walk(...) do t[#t+1] = fn end
+      table.sort(t)
+      return t
+   end
+   maketree(glob_tree)
+   fail(".*Unacceptable pattern: ''.*", function()
+      path.glob_compile ""
+   end)
+   for _, pat in ipairs {
+      "*.txt", "test_glob", "test_glob/*", "test_glob/**/*.txt",
+      "**/a/b", "test_glob/case_?/a/**/c/**",
+   } do
+      local c = path.glob_compile(pat)
+      local t = {}
+      for fn in fs.glob(pat) do t[#t+1] = fn end
+      table.sort(t)
+      table_eq(walk(c), t)
+      table_eq(walk(c), t) -- a compiled pattern can be walked again
+   end
+   local c = path.glob_compile("case_*", "*.txt")
+   eq(tostring(c), "case_*" .. info.sep .. "*.txt")
+   table_eq(walk(c, "test_glob"), {
+      path("test_glob", "case_1", "case1.txt"),
+      path("test_glob", "case_2", "case2.txt"),
+   })
+   fail(".*pattern is not relative.*", function()
+      path.glob_compile(fs.getcwd(), "*"):walk "test_glob"
+   end)
+   c = path.glob_compile "**/a/*.txt"
+   eq(c:match "a/x.txt", "a/x.txt")
+   eq(c:match "./a//x.txt", "./a//x.txt")
+   eq(c:match "b/c/a/x.txt", "b/c/a/x.txt")
+   eq(c:match "a/x.lua", nil)
+   eq(c:match "x.txt", nil)
+   eq(c:match "a/b/x.txt", nil)
+   table_eq(c:filter { "a/x.txt", "b/x.txt", "b/a/y.txt", "a/b" },
+      { "a/x.txt", "b/a/y.txt" })
+   table_eq(c:filter {}, {})
+   fail(".*string expected at index 2, got table.*", function()
+      c:filter { "a/x.txt", {} }
+   end)
+end
+in_tmpdir "test_glob_compile"
+
 os.exit(unit.LuaUnit.run(), true)
 